@@ -0,0 +1,1020 @@
+/* (c) Magnus Auvinen. See licence.txt in the root of the distribution for more information. */
+/* If you are missing that file, acquire a complete release at teeworlds.com.                */
+
+/*
+	Microbenchmarks for the codec paths of libtwnetwork.
+
+	Built as one translation unit together with the library so the inline
+	paths get the same treatment as in libtwnetwork.so. Every result is
+	printed as one JSON object per line:
+
+		{"bench":"huffman_compress","corpus":"snap","ops":..,"bytes":..,"ns_per_op":..,"bytes_per_sec":..}
+
+	Memory results report bytes_per_connection instead of the timings,
+	latency results the p50/p99/p99.9 one-way latency in ns, "shared_cpu"
+	if both sides had to run on one cpu and "skipped" if a mode failed.
+
+	Only the results go to stdout, the log of the library is sent to
+	stderr.
+
+	Run with "make bench".
+*/
+
+#include <time.h>
+
+#include "../libnetwork/network.cpp"
+
+enum
+{
+	BENCH_NUM_PAYLOADS=256,
+	BENCH_NUM_RUNS=5,
+	BENCH_MIN_RUNTIME_NS=50*1000*1000,
+};
+
+// keeps the compiler from dropping the measured work
+volatile int g_BenchSink;
+
+// the real stdout, stdout itself goes to stderr with the log
+static FILE *g_pBenchOut;
+
+static void bench_print(const char *pFormat, ...)
+{
+	// what the library logged so far comes first
+	dbg_msg_flush();
+	va_list Args;
+	va_start(Args, pFormat);
+	vfprintf(g_pBenchOut, pFormat, Args);
+	va_end(Args);
+	fflush(g_pBenchOut);
+}
+
+static int64_t bench_time_ns()
+{
+	struct timespec Time;
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	return (int64_t)Time.tv_sec*1000000000 + Time.tv_nsec;
+}
+
+// deterministic xorshift so every run sees the same corpus
+class CBenchRandom
+{
+	uint64_t m_State;
+public:
+	CBenchRandom(uint64_t Seed) : m_State(Seed) {}
+	unsigned Next()
+	{
+		m_State ^= m_State<<13;
+		m_State ^= m_State>>7;
+		m_State ^= m_State<<17;
+		return (unsigned)m_State;
+	}
+	int Range(int Num) { return Next()%Num; }
+};
+
+struct CBenchPayload
+{
+	int m_Size;
+	unsigned char m_aData[NET_MAX_PAYLOAD];
+};
+
+struct CBenchCorpus
+{
+	const char *m_pName;
+	CBenchPayload m_aPayloads[BENCH_NUM_PAYLOADS];
+	int m_TotalSize;
+};
+
+// CPacker::AddInt from the game
+static unsigned char *bench_pack_int(unsigned char *pDst, int i)
+{
+	*pDst = (i>>25)&0x40;
+	i = i^(i>>31);
+	*pDst |= i&0x3f;
+	i >>= 6;
+	while(i)
+	{
+		*pDst++ |= 0x80;
+		*pDst = i&0x7f;
+		i >>= 7;
+	}
+	return pDst + 1;
+}
+
+// wraps a message into a single chunk
+static void bench_make_chunk(CBenchPayload *pPayload, int Flags, int Sequence, const unsigned char *pMsg, int MsgSize)
+{
+	CNetChunkHeader Header;
+	Header.m_Flags = Flags;
+	Header.m_Size = MsgSize;
+	Header.m_Sequence = Sequence;
+	unsigned char *pData = Header.Pack(pPayload->m_aData);
+	mem_copy(pData, pMsg, MsgSize);
+	pPayload->m_Size = pData - pPayload->m_aData + MsgSize;
+}
+
+// NETMSG_INPUT, sent every tick
+static void bench_gen_input(CBenchRandom *pRandom, CBenchPayload *pPayload)
+{
+	unsigned char aMsg[64];
+	unsigned char *pMsg = aMsg;
+	pMsg = bench_pack_int(pMsg, (16<<1)|1);
+	pMsg = bench_pack_int(pMsg, 1000+pRandom->Range(100000));
+	pMsg = bench_pack_int(pMsg, 1000+pRandom->Range(100000));
+	pMsg = bench_pack_int(pMsg, 40);
+	pMsg = bench_pack_int(pMsg, pRandom->Range(3)-1); // direction
+	pMsg = bench_pack_int(pMsg, pRandom->Range(400)-200); // target x
+	pMsg = bench_pack_int(pMsg, pRandom->Range(300)-150); // target y
+	pMsg = bench_pack_int(pMsg, pRandom->Range(2)); // jump
+	pMsg = bench_pack_int(pMsg, pRandom->Range(50)); // fire
+	pMsg = bench_pack_int(pMsg, pRandom->Range(2)); // hook
+	pMsg = bench_pack_int(pMsg, pRandom->Range(4)); // player flags
+	for(int i = 0; i < 3; i++)
+		pMsg = bench_pack_int(pMsg, 0);
+	bench_make_chunk(pPayload, 0, 0, aMsg, pMsg-aMsg);
+}
+
+// NETMSG_SNAPSINGLE with mostly small delta values
+static void bench_gen_snap(CBenchRandom *pRandom, CBenchPayload *pPayload)
+{
+	unsigned char aMsg[NET_MAX_PAYLOAD];
+	unsigned char *pMsg = aMsg;
+	pMsg = bench_pack_int(pMsg, (8<<1)|1);
+	pMsg = bench_pack_int(pMsg, pRandom->Range(1000000));
+	pMsg = bench_pack_int(pMsg, 1);
+	pMsg = bench_pack_int(pMsg, pRandom->Range(1<<30));
+	unsigned char *pSizeField = pMsg;
+	pMsg += 2;
+	unsigned char *pDataStart = pMsg;
+	int NumValues = 150 + pRandom->Range(150);
+	for(int i = 0; i < NumValues; i++)
+	{
+		int Kind = pRandom->Range(100);
+		int Value = Kind < 55 ? 0 : Kind < 80 ? pRandom->Range(16) : Kind < 92 ? pRandom->Range(512)-256 : pRandom->Range(1<<20);
+		pMsg = bench_pack_int(pMsg, Value);
+	}
+	int DataSize = pMsg - pDataStart;
+	pSizeField[0] = 0x80 | (DataSize&0x3f);
+	pSizeField[1] = DataSize>>6;
+	bench_make_chunk(pPayload, 0, 0, aMsg, pMsg-aMsg);
+}
+
+// NETMSGTYPE_CL_SAY, vital
+static void bench_gen_chat(CBenchRandom *pRandom, CBenchPayload *pPayload)
+{
+	static const char *s_apWords[] = {"hello", "gg", "nice", "hook", "the", "frozen", "pls", "team",
+		"go", "left", "right", "noob", "lol", "chillerbot", "kill", "me"};
+	unsigned char aMsg[256];
+	unsigned char *pMsg = aMsg;
+	pMsg = bench_pack_int(pMsg, 3<<1);
+	pMsg = bench_pack_int(pMsg, pRandom->Range(2));
+	pMsg = bench_pack_int(pMsg, pRandom->Range(64));
+	int NumWords = 1 + pRandom->Range(12);
+	for(int i = 0; i < NumWords; i++)
+	{
+		const char *pWord = s_apWords[pRandom->Range(sizeof(s_apWords)/sizeof(s_apWords[0]))];
+		while(*pWord)
+			*pMsg++ = *pWord++;
+		*pMsg++ = ' ';
+	}
+	*pMsg++ = 0;
+	bench_make_chunk(pPayload, NET_CHUNKFLAG_VITAL, pRandom->Range(NET_MAX_SEQUENCE), aMsg, pMsg-aMsg);
+}
+
+static void bench_gen_corpus(CBenchCorpus *pCorpus, const char *pName, void (*pfnGen)(CBenchRandom *, CBenchPayload *))
+{
+	CBenchRandom Random(0x7e3779b97f4a7c15ull);
+	pCorpus->m_pName = pName;
+	pCorpus->m_TotalSize = 0;
+	for(int i = 0; i < BENCH_NUM_PAYLOADS; i++)
+	{
+		pfnGen(&Random, &pCorpus->m_aPayloads[i]);
+		pCorpus->m_TotalSize += pCorpus->m_aPayloads[i].m_Size;
+	}
+}
+
+/*
+	Function: bench_run
+		Times a batch function and prints the result.
+
+	Parameters:
+		pBench - Name of the benchmark
+		pCorpus - Name of the input set
+		pfnBatch - Runs the measured operation once per op, returns a value to sink
+		pUser - Passed to pfnBatch
+		OpsPerBatch - Number of ops a single pfnBatch call does
+		BytesPerBatch - Bytes processed by a single pfnBatch call, 0 if not meaningful
+
+	Remarks:
+		- Repeats the batch until it ran for at least BENCH_MIN_RUNTIME_NS and
+		  reports the fastest of BENCH_NUM_RUNS such runs.
+*/
+static void bench_run(const char *pBench, const char *pCorpus, int (*pfnBatch)(void *), void *pUser, int OpsPerBatch, int BytesPerBatch)
+{
+	// calibrate
+	int64_t Batches = 1;
+	while(1)
+	{
+		int64_t Start = bench_time_ns();
+		for(int64_t i = 0; i < Batches; i++)
+			g_BenchSink += pfnBatch(pUser);
+		if(bench_time_ns() - Start >= BENCH_MIN_RUNTIME_NS/4)
+			break;
+		Batches *= 2;
+	}
+	Batches *= 4;
+
+	int64_t Best = -1;
+	for(int Run = 0; Run < BENCH_NUM_RUNS; Run++)
+	{
+		int64_t Start = bench_time_ns();
+		for(int64_t i = 0; i < Batches; i++)
+			g_BenchSink += pfnBatch(pUser);
+		int64_t Duration = bench_time_ns() - Start;
+		if(Best < 0 || Duration < Best)
+			Best = Duration;
+	}
+
+	double Ops = (double)Batches*OpsPerBatch;
+	double Bytes = (double)Batches*BytesPerBatch;
+	bench_print("{\"bench\":\"%s\",\"corpus\":\"%s\",\"ops\":%.0f,\"bytes\":%.0f,\"ns_per_op\":%.3f,\"bytes_per_sec\":%.0f}\n",
+		pBench, pCorpus, Ops, Bytes, Best/Ops, Bytes*1e9/Best);
+}
+
+// huffman
+
+struct CHuffmanBench
+{
+	const CBenchCorpus *m_pCorpus;
+	CBenchPayload m_aCompressed[BENCH_NUM_PAYLOADS];
+	int m_CompressedSize;
+};
+
+static int bench_huffman_compress(void *pUser)
+{
+	const CHuffmanBench *pBench = (const CHuffmanBench *)pUser;
+	unsigned char aBuf[NET_MAX_PACKETSIZE];
+	int Result = 0;
+	for(int i = 0; i < BENCH_NUM_PAYLOADS; i++)
+		Result += g_Huffman.Compress(pBench->m_pCorpus->m_aPayloads[i].m_aData, pBench->m_pCorpus->m_aPayloads[i].m_Size, aBuf, sizeof(aBuf));
+	return Result;
+}
+
+static int bench_huffman_decompress(void *pUser)
+{
+	const CHuffmanBench *pBench = (const CHuffmanBench *)pUser;
+	unsigned char aBuf[NET_MAX_PACKETSIZE];
+	int Result = 0;
+	for(int i = 0; i < BENCH_NUM_PAYLOADS; i++)
+		Result += g_Huffman.Decompress(pBench->m_aCompressed[i].m_aData, pBench->m_aCompressed[i].m_Size, aBuf, sizeof(aBuf));
+	return Result;
+}
+
+static void bench_huffman(const CBenchCorpus *pCorpus)
+{
+	static CHuffmanBench s_Bench;
+	s_Bench.m_pCorpus = pCorpus;
+	s_Bench.m_CompressedSize = 0;
+	for(int i = 0; i < BENCH_NUM_PAYLOADS; i++)
+	{
+		s_Bench.m_aCompressed[i].m_Size = g_Huffman.Compress(pCorpus->m_aPayloads[i].m_aData, pCorpus->m_aPayloads[i].m_Size,
+			s_Bench.m_aCompressed[i].m_aData, sizeof(s_Bench.m_aCompressed[i].m_aData));
+		s_Bench.m_CompressedSize += s_Bench.m_aCompressed[i].m_Size;
+	}
+
+	// bytes are counted on the uncompressed side for both directions
+	bench_run("huffman_compress", pCorpus->m_pName, bench_huffman_compress, &s_Bench, BENCH_NUM_PAYLOADS, pCorpus->m_TotalSize);
+	bench_run("huffman_decompress", pCorpus->m_pName, bench_huffman_decompress, &s_Bench, BENCH_NUM_PAYLOADS, pCorpus->m_TotalSize);
+}
+
+// chunk header
+
+struct CChunkHeaderBench
+{
+	CNetChunkHeader m_aHeaders[BENCH_NUM_PAYLOADS];
+	unsigned char m_aPacked[BENCH_NUM_PAYLOADS*NET_MAX_CHUNKHEADERSIZE];
+};
+
+static int bench_chunkheader_pack(void *pUser)
+{
+	CChunkHeaderBench *pBench = (CChunkHeaderBench *)pUser;
+	unsigned char *pData = pBench->m_aPacked;
+	for(int i = 0; i < BENCH_NUM_PAYLOADS; i++)
+		pData = pBench->m_aHeaders[i].Pack(pData);
+	return pData - pBench->m_aPacked;
+}
+
+static int bench_chunkheader_unpack(void *pUser)
+{
+	CChunkHeaderBench *pBench = (CChunkHeaderBench *)pUser;
+	const unsigned char *pData = pBench->m_aPacked;
+	CNetChunkHeader Header;
+	int Result = 0;
+	for(int i = 0; i < BENCH_NUM_PAYLOADS; i++)
+	{
+		pData = Header.Unpack(pData);
+		Result += Header.m_Size + Header.m_Sequence;
+	}
+	return Result;
+}
+
+static void bench_chunkheader()
+{
+	static CChunkHeaderBench s_Bench;
+	CBenchRandom Random(1);
+	int PackedSize = 0;
+	for(int i = 0; i < BENCH_NUM_PAYLOADS; i++)
+	{
+		// mix of vital and non vital chunks like in a game
+		s_Bench.m_aHeaders[i].m_Flags = Random.Range(4) ? 0 : NET_CHUNKFLAG_VITAL;
+		s_Bench.m_aHeaders[i].m_Size = Random.Range(NET_MAX_PAYLOAD);
+		s_Bench.m_aHeaders[i].m_Sequence = Random.Range(NET_MAX_SEQUENCE);
+		PackedSize += s_Bench.m_aHeaders[i].m_Flags&NET_CHUNKFLAG_VITAL ? 3 : 2;
+	}
+	bench_chunkheader_pack(&s_Bench);
+
+	bench_run("chunkheader_pack", "mixed", bench_chunkheader_pack, &s_Bench, BENCH_NUM_PAYLOADS, PackedSize);
+	bench_run("chunkheader_unpack", "mixed", bench_chunkheader_unpack, &s_Bench, BENCH_NUM_PAYLOADS, PackedSize);
+}
+
+// packet parsing
+
+struct CPacketBench
+{
+	CBenchPayload m_aPackets[BENCH_NUM_PAYLOADS];
+	CNetPacketConstruct m_Packet;
+	bool m_ZeroCopy;
+};
+
+static int bench_parse_packet(void *pUser)
+{
+	CPacketBench *pBench = (CPacketBench *)pUser;
+	const unsigned char *pData;
+	int Result = 0;
+	for(int i = 0; i < BENCH_NUM_PAYLOADS; i++)
+	{
+		Result += ParsePacket(pBench->m_aPackets[i].m_aData, pBench->m_aPackets[i].m_Size, &pBench->m_Packet, pBench->m_ZeroCopy ? &pData : 0);
+		Result += pBench->m_Packet.m_DataSize;
+	}
+	return Result;
+}
+
+// builds the same bytes SendPacket puts on the wire
+static void bench_make_packet(CBenchPayload *pPacket, const CBenchPayload *pPayload, bool Compress)
+{
+	int Flags = 0;
+	int Size = -1;
+	if(Compress)
+	{
+		Size = g_Huffman.Compress(pPayload->m_aData, pPayload->m_Size, &pPacket->m_aData[NET_PACKETHEADERSIZE], NET_MAX_PAYLOAD);
+		Flags = NET_PACKETFLAG_COMPRESSION;
+	}
+	if(Size < 0)
+	{
+		Size = pPayload->m_Size;
+		mem_copy(&pPacket->m_aData[NET_PACKETHEADERSIZE], pPayload->m_aData, Size);
+		Flags = 0;
+	}
+	int Ack = 123;
+	TOKEN Token = 0x12345678;
+	pPacket->m_aData[0] = ((Flags<<2)&0xfc) | ((Ack>>8)&0x03);
+	pPacket->m_aData[1] = Ack&0xff;
+	pPacket->m_aData[2] = 1;
+	pPacket->m_aData[3] = (Token>>24)&0xff;
+	pPacket->m_aData[4] = (Token>>16)&0xff;
+	pPacket->m_aData[5] = (Token>>8)&0xff;
+	pPacket->m_aData[6] = Token&0xff;
+	pPacket->m_Size = NET_PACKETHEADERSIZE + Size;
+}
+
+static void bench_packet(const CBenchCorpus *pCorpus)
+{
+	static CPacketBench s_Bench;
+	char aName[64];
+	for(int Compress = 0; Compress < 2; Compress++)
+	{
+		int TotalSize = 0;
+		for(int i = 0; i < BENCH_NUM_PAYLOADS; i++)
+		{
+			bench_make_packet(&s_Bench.m_aPackets[i], &pCorpus->m_aPayloads[i], Compress);
+			TotalSize += s_Bench.m_aPackets[i].m_Size;
+		}
+		str_format(aName, sizeof(aName), "%s%s", pCorpus->m_pName, Compress ? "_compressed" : "");
+		s_Bench.m_ZeroCopy = false;
+		bench_run("unpack_packet", aName, bench_parse_packet, &s_Bench, BENCH_NUM_PAYLOADS, TotalSize);
+		s_Bench.m_ZeroCopy = true;
+		bench_run("unpack_packet_zerocopy", aName, bench_parse_packet, &s_Bench, BENCH_NUM_PAYLOADS, TotalSize);
+	}
+}
+
+// chunk unpacking
+
+struct CUnpackerBench
+{
+	CNetRecvUnpacker m_Unpacker;
+	NETADDR m_Addr;
+	CNetSequenceWindow m_Sequence;
+	int m_NextSequence;
+};
+
+static int bench_fetch_chunk(void *pUser)
+{
+	CUnpackerBench *pBench = (CUnpackerBench *)pUser;
+	CNetChunk Chunk;
+	int Result = 0;
+	pBench->m_Unpacker.Start(&pBench->m_Addr, 0, 0);
+	while(pBench->m_Unpacker.FetchChunk(&Chunk))
+		Result += Chunk.m_DataSize;
+	return Result;
+}
+
+static int bench_sequence_feed(void *pUser)
+{
+	CUnpackerBench *pBench = (CUnpackerBench *)pUser;
+	int Result = 0;
+	for(int i = 0; i < BENCH_NUM_PAYLOADS; i++)
+	{
+		Result += pBench->m_Sequence.Feed(pBench->m_NextSequence);
+		pBench->m_NextSequence = (pBench->m_NextSequence+1)&NET_SEQUENCE_MASK;
+	}
+	return Result;
+}
+
+static void bench_unpacker(const CBenchCorpus *pInput, const CBenchCorpus *pChat)
+{
+	static CUnpackerBench s_Bench;
+	CNetRecvUnpacker *pUnpacker = &s_Bench.m_Unpacker;
+	mem_zero(&s_Bench.m_Addr, sizeof(s_Bench.m_Addr));
+
+	// fill a packet with inputs and chat messages
+	pUnpacker->m_Data.m_DataSize = 0;
+	pUnpacker->m_Data.m_NumChunks = 0;
+	for(int i = 0; pUnpacker->m_Data.m_NumChunks < NET_MAX_PACKET_CHUNKS-1; i++)
+	{
+		const CBenchPayload *pPayload = i&1 ? &pChat->m_aPayloads[i%BENCH_NUM_PAYLOADS] : &pInput->m_aPayloads[i%BENCH_NUM_PAYLOADS];
+		if(pUnpacker->m_Data.m_DataSize + pPayload->m_Size > NET_MAX_PAYLOAD)
+			break;
+		mem_copy(&pUnpacker->m_aBuffer[pUnpacker->m_Data.m_DataSize], pPayload->m_aData, pPayload->m_Size);
+		pUnpacker->m_Data.m_DataSize += pPayload->m_Size;
+		pUnpacker->m_Data.m_NumChunks++;
+	}
+	pUnpacker->m_pData = pUnpacker->m_aBuffer;
+
+	bench_run("fetch_chunk", "mixed", bench_fetch_chunk, &s_Bench, pUnpacker->m_Data.m_NumChunks, pUnpacker->m_Data.m_DataSize);
+
+	s_Bench.m_Sequence.Reset();
+	s_Bench.m_NextSequence = 1;
+	bench_run("sequence_feed", "in_order", bench_sequence_feed, &s_Bench, BENCH_NUM_PAYLOADS, 0);
+}
+
+// resend buffer
+
+struct CResendBench
+{
+	CNetResendBuffer m_Buffer;
+	int m_Sequence;
+};
+
+static int bench_resend_buffer(void *pUser)
+{
+	CResendBench *pBench = (CResendBench *)pUser;
+	int Result = 0;
+	// a tick worth of vital chunks, acked at once
+	for(int i = 0; i < 64; i++)
+	{
+		pBench->m_Sequence = (pBench->m_Sequence+1)&NET_SEQUENCE_MASK;
+		CNetChunkResend *pResend = pBench->m_Buffer.Allocate(pBench->m_Sequence, 24);
+		Result += pResend->m_DataSize;
+	}
+	pBench->m_Buffer.Release(pBench->m_Sequence);
+	return Result;
+}
+
+static void bench_resend()
+{
+	static CNetBlockPool s_Pool(CNetResendBuffer::StorageSize(), 1);
+	static CResendBench s_Bench;
+	s_Bench.m_Buffer.Init(&s_Pool);
+	s_Bench.m_Sequence = 0;
+	bench_run("resend_buffer", "alloc_ack", bench_resend_buffer, &s_Bench, 64, 64*24);
+}
+
+// connection table
+
+static void bench_connection_memory()
+{
+	// connections that are online but have nothing in flight
+	const int NumConnections = 10000;
+	NETADDR BindAddr;
+	mem_zero(&BindAddr, sizeof(BindAddr));
+	BindAddr.type = NETTYPE_IPV4;
+	CNetClient *pClient = new CNetClient();
+	if(pClient->Open(BindAddr, NumConnections, 0) == 0)
+	{
+		bench_print("{\"bench\":\"connection_memory\",\"corpus\":\"idle\",\"connections\":%d,\"bytes_per_connection\":%.0f}\n",
+			NumConnections, (double)pClient->MemoryUsage()/NumConnections);
+	}
+	delete pClient;
+}
+
+// sockets
+
+struct CSocketBench
+{
+	NETSOCKET m_Sender;
+	NETSOCKET m_Receiver;
+	NETADDR m_ReceiverAddr;
+	unsigned char m_aaData[NET_BATCH_SIZE][NET_MAX_PACKETSIZE];
+	NETPACKET m_aPackets[NET_BATCH_SIZE];
+	CNetUring m_SenderRing;
+	CNetUring m_ReceiverRing;
+	int m_Features;
+	NETPACKET m_aGroPackets[NET_GRO_BUFFERS];
+	int m_aGroSegments[NET_GRO_BUFFERS];
+};
+
+enum
+{
+	BENCH_DATAGRAM_SIZE=64,
+};
+
+static int bench_socket_single(void *pUser)
+{
+	CSocketBench *pBench = (CSocketBench *)pUser;
+	int Result = 0;
+	for(int i = 0; i < NET_BATCH_SIZE; i++)
+		net_udp_send(pBench->m_Sender, &pBench->m_ReceiverAddr, pBench->m_aaData[i], BENCH_DATAGRAM_SIZE);
+	NETADDR Addr;
+	for(int i = 0; i < NET_BATCH_SIZE; i++)
+		Result += net_udp_recv(pBench->m_Receiver, &Addr, pBench->m_aaData[i], NET_MAX_PACKETSIZE);
+	return Result;
+}
+
+static int bench_socket_batch(void *pUser)
+{
+	CSocketBench *pBench = (CSocketBench *)pUser;
+	for(int i = 0; i < NET_BATCH_SIZE; i++)
+	{
+		pBench->m_aPackets[i].addr = pBench->m_ReceiverAddr;
+		pBench->m_aPackets[i].size = BENCH_DATAGRAM_SIZE;
+	}
+	net_udp_send_batch(pBench->m_Sender, pBench->m_aPackets, NET_BATCH_SIZE, 0);
+	for(int i = 0; i < NET_BATCH_SIZE; i++)
+		pBench->m_aPackets[i].size = NET_MAX_PACKETSIZE;
+	return net_udp_recv_batch(pBench->m_Receiver, pBench->m_aPackets, NET_BATCH_SIZE, 0);
+}
+
+static int bench_socket_gso(void *pUser)
+{
+	CSocketBench *pBench = (CSocketBench *)pUser;
+	for(int i = 0; i < NET_BATCH_SIZE; i++)
+	{
+		pBench->m_aPackets[i].addr = pBench->m_ReceiverAddr;
+		pBench->m_aPackets[i].size = BENCH_DATAGRAM_SIZE;
+	}
+	net_udp_send_batch(pBench->m_Sender, pBench->m_aPackets, NET_BATCH_SIZE, &pBench->m_Features);
+	if(!(pBench->m_Features&NETSOCKET_GRO))
+	{
+		for(int i = 0; i < NET_BATCH_SIZE; i++)
+			pBench->m_aPackets[i].size = NET_MAX_PACKETSIZE;
+		return net_udp_recv_batch(pBench->m_Receiver, pBench->m_aPackets, NET_BATCH_SIZE, 0);
+	}
+
+	// count the datagrams in the coalesced receives
+	for(int i = 0; i < NET_GRO_BUFFERS; i++)
+		pBench->m_aGroPackets[i].size = NET_GRO_BUFFER_SIZE;
+	int Num = net_udp_recv_batch_gro(pBench->m_Receiver, pBench->m_aGroPackets, pBench->m_aGroSegments, NET_GRO_BUFFERS, 0);
+	int Received = 0;
+	for(int i = 0; i < Num; i++)
+		Received += pBench->m_aGroSegments[i] > 0 ? (pBench->m_aGroPackets[i].size+pBench->m_aGroSegments[i]-1)/pBench->m_aGroSegments[i] : 1;
+	return Received;
+}
+
+static int bench_socket_uring(void *pUser)
+{
+	CSocketBench *pBench = (CSocketBench *)pUser;
+	for(int i = 0; i < NET_BATCH_SIZE; i++)
+	{
+		pBench->m_aPackets[i].addr = pBench->m_ReceiverAddr;
+		pBench->m_aPackets[i].data = pBench->m_aaData[i];
+		pBench->m_aPackets[i].size = BENCH_DATAGRAM_SIZE;
+	}
+	pBench->m_SenderRing.Send(pBench->m_aPackets, NET_BATCH_SIZE);
+	int Received = 0;
+	while(Received < NET_BATCH_SIZE)
+	{
+		int Num = pBench->m_ReceiverRing.Recv(pBench->m_aPackets, NET_BATCH_SIZE-Received);
+		// the completions are posted on the way out of the next system call
+		if(!Num)
+			sched_yield();
+		Received += Num;
+	}
+	return Received;
+}
+
+static void bench_sockets()
+{
+	// loopback round trips, the syscalls are what is measured
+	static CSocketBench s_Bench;
+	NETADDR BindAddr;
+	mem_zero(&BindAddr, sizeof(BindAddr));
+	BindAddr.type = NETTYPE_IPV4;
+	s_Bench.m_Sender = net_udp_create(BindAddr, 0, 0);
+	s_Bench.m_Receiver = net_udp_create(BindAddr, 0, 0);
+	if(!s_Bench.m_Sender.type || !s_Bench.m_Receiver.type)
+		return;
+
+	struct sockaddr_in Addr;
+	socklen_t AddrLen = sizeof(Addr);
+	getsockname(s_Bench.m_Receiver.ipv4sock, (struct sockaddr *)&Addr, &AddrLen);
+	net_addr_from_str(&s_Bench.m_ReceiverAddr, "127.0.0.1");
+	s_Bench.m_ReceiverAddr.port = ntohs(Addr.sin_port);
+	for(int i = 0; i < NET_BATCH_SIZE; i++)
+		s_Bench.m_aPackets[i].data = s_Bench.m_aaData[i];
+
+	bench_run("udp_send_recv", "single", bench_socket_single, &s_Bench, NET_BATCH_SIZE, NET_BATCH_SIZE*BENCH_DATAGRAM_SIZE);
+	bench_run("udp_send_recv", "batch", bench_socket_batch, &s_Bench, NET_BATCH_SIZE, NET_BATCH_SIZE*BENCH_DATAGRAM_SIZE);
+
+	// segmented sends, received one by one and then coalesced
+	s_Bench.m_Features = net_udp_features(s_Bench.m_Sender)&NETSOCKET_GSO;
+	if(s_Bench.m_Features)
+	{
+		bench_run("udp_send_recv", "gso", bench_socket_gso, &s_Bench, NET_BATCH_SIZE, NET_BATCH_SIZE*BENCH_DATAGRAM_SIZE);
+		unsigned char *pGroBuffers = (unsigned char *)mem_alloc(NET_GRO_BUFFERS*NET_GRO_BUFFER_SIZE);
+		for(int i = 0; i < NET_GRO_BUFFERS; i++)
+			s_Bench.m_aGroPackets[i].data = &pGroBuffers[i*NET_GRO_BUFFER_SIZE];
+		if(net_udp_features(s_Bench.m_Receiver)&NETSOCKET_GRO && net_udp_set_gro(s_Bench.m_Receiver, 1) == 0)
+		{
+			s_Bench.m_Features |= NETSOCKET_GRO;
+			bench_run("udp_send_recv", "gso_gro", bench_socket_gso, &s_Bench, NET_BATCH_SIZE, NET_BATCH_SIZE*BENCH_DATAGRAM_SIZE);
+			net_udp_set_gro(s_Bench.m_Receiver, 0);
+		}
+		mem_free(pGroBuffers);
+	}
+
+	for(int Sqpoll = 0; Sqpoll < 2; Sqpoll++)
+	{
+		if(s_Bench.m_SenderRing.Open(s_Bench.m_Sender, Sqpoll) == 0 && s_Bench.m_ReceiverRing.Open(s_Bench.m_Receiver, Sqpoll) == 0)
+			bench_run("udp_send_recv", Sqpoll ? "uring_sqpoll" : "uring", bench_socket_uring, &s_Bench, NET_BATCH_SIZE, NET_BATCH_SIZE*BENCH_DATAGRAM_SIZE);
+		s_Bench.m_SenderRing.Close();
+		s_Bench.m_ReceiverRing.Close();
+	}
+
+	net_udp_close(s_Bench.m_Sender);
+	net_udp_close(s_Bench.m_Receiver);
+}
+
+// latency
+
+enum
+{
+	BENCH_LATENCY_ROUNDS=10000,
+	BENCH_LATENCY_WARMUP=500,
+	BENCH_LATENCY_MAX_NS=2000*1000*1000LL,
+	BENCH_LATENCY_SPIN_US=50,
+	BENCH_LATENCY_RT_PRIORITY=10,
+};
+
+struct CLatencyMode
+{
+	const char *m_pName;
+	int m_SpinUs;
+	bool m_Pin;
+	int m_RtPriority;
+};
+
+static const CLatencyMode s_aLatencyModes[] = {
+	{"blocking", 0, false, 0},
+	{"busy_poll", BENCH_LATENCY_SPIN_US, false, 0},
+	{"busy_poll_pinned", BENCH_LATENCY_SPIN_US, true, 0},
+	{"busy_poll_rt", BENCH_LATENCY_SPIN_US, true, BENCH_LATENCY_RT_PRIORITY},
+};
+
+struct CLatencyBench
+{
+	CNetBase m_Ping;
+	CNetBase m_Pong;
+	NETADDR m_PongAddr;
+	const CLatencyMode *m_pMode;
+	int m_NumCpus;
+	int m_Stop;
+	int m_Failed;
+	int m_NumSamples;
+	int64_t m_aSamples[BENCH_LATENCY_ROUNDS];
+};
+
+static int bench_latency_setup(CLatencyBench *pBench, int Cpu)
+{
+	if(pBench->m_pMode->m_Pin && thread_pin_cpu(Cpu%pBench->m_NumCpus) != 0)
+		return -1;
+	if(pBench->m_pMode->m_RtPriority && thread_set_realtime(pBench->m_pMode->m_RtPriority) != 0)
+		return -1;
+	return 0;
+}
+
+// echoes every packet back until m_Stop
+static void *bench_latency_pong(void *pUser)
+{
+	CLatencyBench *pBench = (CLatencyBench *)pUser;
+	if(bench_latency_setup(pBench, 1) != 0)
+		__atomic_store_n(&pBench->m_Failed, 1, __ATOMIC_RELAXED);
+
+	CNetPacketConstruct Packet;
+	const unsigned char *pData;
+	NETADDR Addr;
+	while(!__atomic_load_n(&pBench->m_Stop, __ATOMIC_RELAXED))
+	{
+		pBench->m_Pong.Wait(10);
+		while(pBench->m_Pong.UnpackPacket(&Addr, &Packet, &pData) == 0)
+		{
+			if(pData != Packet.m_aChunkData)
+				mem_copy(Packet.m_aChunkData, pData, Packet.m_DataSize);
+			pBench->m_Pong.SendPacket(&Addr, &Packet, 0);
+		}
+		pBench->m_Pong.FlushSend();
+	}
+	return 0;
+}
+
+static void *bench_latency_ping(void *pUser)
+{
+	CLatencyBench *pBench = (CLatencyBench *)pUser;
+	pBench->m_NumSamples = 0;
+	if(bench_latency_setup(pBench, 0) != 0)
+	{
+		__atomic_store_n(&pBench->m_Failed, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	CNetPacketConstruct Packet;
+	const unsigned char *pData;
+	NETADDR Addr;
+	int64_t End = bench_time_ns() + BENCH_LATENCY_MAX_NS;
+	for(int Round = 0; Round < BENCH_LATENCY_WARMUP+BENCH_LATENCY_ROUNDS && !__atomic_load_n(&pBench->m_Failed, __ATOMIC_RELAXED); Round++)
+	{
+		// a control packet, so nothing is compressed
+		mem_zero(&Packet, sizeof(Packet));
+		Packet.m_Flags = NET_PACKETFLAG_CONTROL;
+		Packet.m_aChunkData[0] = NET_CTRLMSG_KEEPALIVE;
+		mem_copy(&Packet.m_aChunkData[1], &Round, sizeof(Round));
+		Packet.m_DataSize = 1+sizeof(Round);
+
+		int64_t Start = bench_time_ns();
+		pBench->m_Ping.SendPacket(&pBench->m_PongAddr, &Packet, 0);
+		pBench->m_Ping.FlushSend();
+		while(pBench->m_Ping.UnpackPacket(&Addr, &Packet, &pData) != 0)
+		{
+			// loopback doesn't drop, a lost round only happens when the pong thread failed
+			if(pBench->m_Ping.Wait(1000) == 0)
+				break;
+		}
+		int64_t Now = bench_time_ns();
+		if(Round >= BENCH_LATENCY_WARMUP)
+			pBench->m_aSamples[pBench->m_NumSamples++] = (Now-Start)/2;
+		if(Now > End)
+			break;
+	}
+	return 0;
+}
+
+static int bench_latency_compare(const void *pA, const void *pB)
+{
+	int64_t A = *(const int64_t *)pA;
+	int64_t B = *(const int64_t *)pB;
+	return A < B ? -1 : A > B;
+}
+
+static void bench_latency()
+{
+	// loopback ping-pong between two threads, half the round trip is
+	// reported as the one-way latency
+	static CLatencyBench s_Bench;
+	NETADDR BindAddr;
+	mem_zero(&BindAddr, sizeof(BindAddr));
+	BindAddr.type = NETTYPE_IPV4;
+	if(s_Bench.m_Ping.Open(BindAddr, 0) != 0 || s_Bench.m_Pong.Open(BindAddr, 0) != 0)
+		return;
+
+	struct sockaddr_in Addr;
+	socklen_t AddrLen = sizeof(Addr);
+	getsockname(s_Bench.m_Pong.Socket().ipv4sock, (struct sockaddr *)&Addr, &AddrLen);
+	net_addr_from_str(&s_Bench.m_PongAddr, "127.0.0.1");
+	s_Bench.m_PongAddr.port = ntohs(Addr.sin_port);
+	s_Bench.m_NumCpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if(s_Bench.m_NumCpus < 1)
+		s_Bench.m_NumCpus = 1;
+	// with one cpu both sides of the spinning modes share it
+	bool SharedCpu = s_Bench.m_NumCpus < 2;
+
+	for(unsigned i = 0; i < sizeof(s_aLatencyModes)/sizeof(s_aLatencyModes[0]); i++)
+	{
+		const CLatencyMode *pMode = &s_aLatencyModes[i];
+		s_Bench.m_pMode = pMode;
+		s_Bench.m_Stop = 0;
+		s_Bench.m_Failed = 0;
+		s_Bench.m_Ping.SetBusyPoll(pMode->m_SpinUs);
+		s_Bench.m_Pong.SetBusyPoll(pMode->m_SpinUs);
+
+		// fresh threads, so the pinning and the scheduler don't stick
+		pthread_t Pong, Ping;
+		pthread_create(&Pong, 0, bench_latency_pong, &s_Bench);
+		pthread_create(&Ping, 0, bench_latency_ping, &s_Bench);
+		pthread_join(Ping, 0);
+		__atomic_store_n(&s_Bench.m_Stop, 1, __ATOMIC_RELAXED);
+		pthread_join(Pong, 0);
+
+		if(s_Bench.m_Failed || !s_Bench.m_NumSamples)
+		{
+			bench_print("{\"bench\":\"latency\",\"corpus\":\"%s\",\"skipped\":true}\n", pMode->m_pName);
+			continue;
+		}
+		int Num = s_Bench.m_NumSamples;
+		qsort(s_Bench.m_aSamples, Num, sizeof(int64_t), bench_latency_compare);
+		bench_print("{\"bench\":\"latency\",\"corpus\":\"%s\",\"ops\":%d,\"p50_ns\":%lld,\"p99_ns\":%lld,\"p999_ns\":%lld,\"shared_cpu\":%s}\n",
+			pMode->m_pName, Num, (long long)s_Bench.m_aSamples[Num/2], (long long)s_Bench.m_aSamples[(int64_t)Num*99/100],
+			(long long)s_Bench.m_aSamples[(int64_t)Num*999/1000], SharedCpu ? "true" : "false");
+	}
+
+	s_Bench.m_Ping.Close();
+	s_Bench.m_Pong.Close();
+}
+
+// timers
+
+struct CTimerBench
+{
+	CTimerWheel m_Wheel;
+	CTimer m_aTimers[BENCH_NUM_PAYLOADS];
+	int64_t m_Time;
+	int m_NumFired;
+};
+
+static void bench_timer_callback(CTimer *, void *pUser)
+{
+	((CTimerBench *)pUser)->m_NumFired++;
+}
+
+static int bench_timer_rearm(void *pUser)
+{
+	// like keepalive timers, pushed back on every send
+	CTimerBench *pBench = (CTimerBench *)pUser;
+	for(int i = 0; i < BENCH_NUM_PAYLOADS; i++)
+		pBench->m_Wheel.Insert(&pBench->m_aTimers[i], pBench->m_Time + time_freq()/2 + i*100);
+	return 0;
+}
+
+static int bench_timer_expire(void *pUser)
+{
+	CTimerBench *pBench = (CTimerBench *)pUser;
+	for(int i = 0; i < BENCH_NUM_PAYLOADS; i++)
+		pBench->m_Wheel.Insert(&pBench->m_aTimers[i], pBench->m_Time + (i%64)*1000);
+	pBench->m_Time += time_freq()/10;
+	return pBench->m_Wheel.Advance(pBench->m_Time);
+}
+
+static void bench_timers()
+{
+	static CTimerBench s_Bench;
+	s_Bench.m_Time = 0;
+	s_Bench.m_Wheel.Reset(s_Bench.m_Time);
+	for(int i = 0; i < BENCH_NUM_PAYLOADS; i++)
+		s_Bench.m_aTimers[i].Init(bench_timer_callback, &s_Bench);
+
+	bench_run("timer_wheel", "rearm", bench_timer_rearm, &s_Bench, BENCH_NUM_PAYLOADS, 0);
+	bench_run("timer_wheel", "insert_expire", bench_timer_expire, &s_Bench, BENCH_NUM_PAYLOADS, 0);
+}
+
+// io thread queues
+
+struct CQueueBench
+{
+	CNetMpscQueue m_Commands;
+	CNetSpscQueue m_Events;
+};
+
+static int bench_queue_mpsc(void *pUser)
+{
+	// a burst of small sends, drained at once
+	CQueueBench *pBench = (CQueueBench *)pUser;
+	int Result = 0;
+	for(int i = 0; i < 64; i++)
+	{
+		unsigned char *pRecord = (unsigned char *)pBench->m_Commands.BeginPush();
+		mem_copy(pRecord, &i, sizeof(i));
+		pBench->m_Commands.EndPush(pRecord);
+	}
+	unsigned char *pRecord;
+	while((pRecord = (unsigned char *)pBench->m_Commands.Front()))
+	{
+		Result += pRecord[0];
+		pBench->m_Commands.Pop();
+	}
+	return Result;
+}
+
+static int bench_queue_spsc(void *pUser)
+{
+	CQueueBench *pBench = (CQueueBench *)pUser;
+	int Result = 0;
+	for(int i = 0; i < 64; i++)
+	{
+		unsigned char *pRecord = (unsigned char *)pBench->m_Events.BeginPush(NET_MAX_PAYLOAD);
+		mem_copy(pRecord, &i, sizeof(i));
+		pBench->m_Events.EndPush(32);
+	}
+	unsigned char *pRecord;
+	while((pRecord = (unsigned char *)pBench->m_Events.Front()))
+	{
+		Result += pRecord[0];
+		pBench->m_Events.Pop();
+	}
+	return Result;
+}
+
+static void bench_queues()
+{
+	static CQueueBench s_Bench;
+	s_Bench.m_Commands.Init(32, 64);
+	s_Bench.m_Events.Init(NET_THREAD_EVENT_BYTES);
+	bench_run("queue", "mpsc_burst", bench_queue_mpsc, &s_Bench, 64, 0);
+	bench_run("queue", "spsc_burst", bench_queue_spsc, &s_Bench, 64, 64*32);
+}
+
+// addresses
+
+static const char *s_apBenchAddresses[] = {
+	"127.0.0.1:8303",
+	"192.168.178.20:8304",
+	"5.9.62.153:8303",
+	"[::1]:8303",
+	"[2a01:4f8:141:1::2]:8303",
+	"10.0.0.1",
+};
+
+enum
+{
+	BENCH_NUM_ADDRESSES=sizeof(s_apBenchAddresses)/sizeof(s_apBenchAddresses[0]),
+};
+
+static NETADDR s_aBenchAddrs[BENCH_NUM_ADDRESSES];
+
+static int bench_addr_from_str(void *)
+{
+	NETADDR Addr;
+	int Result = 0;
+	for(int i = 0; i < BENCH_NUM_ADDRESSES; i++)
+		Result += net_addr_from_str(&Addr, s_apBenchAddresses[i]) + Addr.port;
+	return Result;
+}
+
+static int bench_addr_str(void *)
+{
+	char aBuf[NETADDR_MAXSTRSIZE];
+	int Result = 0;
+	for(int i = 0; i < BENCH_NUM_ADDRESSES; i++)
+	{
+		net_addr_str(&s_aBenchAddrs[i], aBuf, sizeof(aBuf), true);
+		Result += aBuf[0];
+	}
+	return Result;
+}
+
+static void bench_addr()
+{
+	int StrSize = 0;
+	for(int i = 0; i < BENCH_NUM_ADDRESSES; i++)
+	{
+		net_addr_from_str(&s_aBenchAddrs[i], s_apBenchAddresses[i]);
+		StrSize += str_length(s_apBenchAddresses[i]);
+	}
+	bench_run("net_addr_from_str", "mixed", bench_addr_from_str, 0, BENCH_NUM_ADDRESSES, StrSize);
+	bench_run("net_addr_str", "mixed", bench_addr_str, 0, BENCH_NUM_ADDRESSES, 0);
+}
+
+int main()
+{
+	// keep stdout for the results and send everything else to stderr
+	g_pBenchOut = fdopen(dup(1), "w");
+	if(!g_pBenchOut || dup2(2, 1) < 0)
+		return 1;
+
+	static CBenchCorpus s_aCorpora[3];
+	bench_gen_corpus(&s_aCorpora[0], "input", bench_gen_input);
+	bench_gen_corpus(&s_aCorpora[1], "snap", bench_gen_snap);
+	bench_gen_corpus(&s_aCorpora[2], "chat", bench_gen_chat);
+
+	for(int i = 0; i < 3; i++)
+		bench_huffman(&s_aCorpora[i]);
+	bench_chunkheader();
+	for(int i = 0; i < 3; i++)
+		bench_packet(&s_aCorpora[i]);
+	bench_unpacker(&s_aCorpora[0], &s_aCorpora[2]);
+	bench_resend();
+	bench_connection_memory();
+	bench_sockets();
+	bench_latency();
+	bench_timers();
+	bench_queues();
+	bench_addr();
+	dbg_msg_flush();
+	return 0;
+}
@@ -0,0 +1,319 @@
+/* (c) Magnus Auvinen. See licence.txt in the root of the distribution for more information. */
+/* If you are missing that file, acquire a complete release at teeworlds.com.                */
+
+/*
+	Replays a pcap capture through the receive path of libtwnetwork.
+
+	The capture is loaded into memory first, then every UDP datagram goes
+	through CNetBase::UnpackDatagram (parsing and huffman decoding) and
+	the chunk unpacker, with one sequence window per sender. There are no
+	sockets involved, so this is the decode pipeline alone:
+
+		./twreplay capture.pcap [passes]
+
+	Prints the counters of the first pass and the fastest pass in the
+	JSON format of twbench. Captures written by StartCapture work as well
+	as ones from tcpdump.
+*/
+
+#include <time.h>
+
+#include "../libnetwork/network.cpp"
+
+enum
+{
+	REPLAY_MAX_SENDERS=1024,
+
+	PCAP_HEADERSIZE=24,
+	PCAP_RECORD_HEADERSIZE=16,
+
+	LINKTYPE_NULL=0,
+	LINKTYPE_ETHERNET=1,
+	LINKTYPE_RAW=101,
+	LINKTYPE_LOOP=108,
+	LINKTYPE_LINUX_SLL=113,
+	LINKTYPE_IPV4=228,
+	LINKTYPE_IPV6=229,
+	LINKTYPE_LINUX_SLL2=276,
+};
+
+struct CReplayDatagram
+{
+	NETADDR m_Addr; // sender
+	const unsigned char *m_pData;
+	int m_Size;
+};
+
+struct CReplayCounters
+{
+	int64_t m_Datagrams;
+	int64_t m_Bytes;
+	int64_t m_Invalid;
+	int64_t m_Connless;
+	int64_t m_Control;
+	int64_t m_Chunks;
+	int64_t m_ChunkBytes;
+};
+
+struct CReplaySender
+{
+	NETADDR m_Addr;
+	CNetSequenceWindow m_Sequence;
+};
+
+static int64_t replay_time_ns()
+{
+	struct timespec Time;
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	return (int64_t)Time.tv_sec*1000000000 + Time.tv_nsec;
+}
+
+static unsigned replay_read32(const unsigned char *p, bool Swap)
+{
+	unsigned Value;
+	mem_copy(&Value, p, sizeof(Value));
+	return Swap ? __builtin_bswap32(Value) : Value;
+}
+
+// finds the udp payload in an ip packet, -1 if it isn't udp
+static int replay_parse_ip(const unsigned char *pData, int Size, CReplayDatagram *pDatagram)
+{
+	if(Size < 1)
+		return -1;
+
+	mem_zero(&pDatagram->m_Addr, sizeof(pDatagram->m_Addr));
+	int Version = pData[0]>>4;
+	int HeaderSize;
+	if(Version == 4)
+	{
+		HeaderSize = (pData[0]&0xf)*4;
+		// the fixed part must be there before its fields are read
+		if(HeaderSize < 20 || Size < 20)
+			return -1;
+		// only whole udp datagrams, fragments are skipped
+		if(Size < HeaderSize+8 || pData[9] != 17 || (((pData[6]<<8)|pData[7])&0x3fff))
+			return -1;
+		pDatagram->m_Addr.type = NETTYPE_IPV4;
+		mem_copy(pDatagram->m_Addr.ip, &pData[12], 4);
+	}
+	else if(Version == 6)
+	{
+		HeaderSize = 40;
+		// extension headers are not followed
+		if(Size < HeaderSize+8 || pData[6] != 17)
+			return -1;
+		pDatagram->m_Addr.type = NETTYPE_IPV6;
+		mem_copy(pDatagram->m_Addr.ip, &pData[8], 16);
+	}
+	else
+		return -1;
+
+	const unsigned char *pUdp = &pData[HeaderSize];
+	int UdpSize = (pUdp[4]<<8) | pUdp[5];
+	if(UdpSize < 8 || HeaderSize+UdpSize > Size)
+		return -1;
+	pDatagram->m_Addr.port = (pUdp[0]<<8) | pUdp[1];
+	pDatagram->m_pData = pUdp+8;
+	pDatagram->m_Size = UdpSize-8;
+	return 0;
+}
+
+// offset of the ip packet in a frame of the link type, -1 if it doesn't carry ip
+static int replay_link_offset(int LinkType, const unsigned char *pData, int Size)
+{
+	switch(LinkType)
+	{
+	case LINKTYPE_RAW:
+	case LINKTYPE_IPV4:
+	case LINKTYPE_IPV6:
+		return 0;
+	case LINKTYPE_NULL:
+	case LINKTYPE_LOOP:
+		return 4;
+	case LINKTYPE_ETHERNET:
+	{
+		int Offset = 12;
+		// vlan tags
+		while(Size >= Offset+2 && ((pData[Offset]<<8)|pData[Offset+1]) == 0x8100)
+			Offset += 4;
+		if(Size < Offset+2)
+			return -1;
+		int EtherType = (pData[Offset]<<8) | pData[Offset+1];
+		return EtherType == 0x0800 || EtherType == 0x86dd ? Offset+2 : -1;
+	}
+	case LINKTYPE_LINUX_SLL:
+		return 16;
+	case LINKTYPE_LINUX_SLL2:
+		return 20;
+	}
+	return -1;
+}
+
+// collects the datagrams of the capture, returns how many or -1
+static int replay_load(const unsigned char *pFile, int64_t FileSize, CReplayDatagram **ppDatagrams, int64_t *pSkipped)
+{
+	if(FileSize < PCAP_HEADERSIZE)
+		return -1;
+
+	unsigned Magic;
+	mem_copy(&Magic, pFile, sizeof(Magic));
+	bool Swap;
+	if(Magic == 0xa1b2c3d4 || Magic == 0xa1b23c4d)
+		Swap = false;
+	else if(Magic == 0xd4c3b2a1 || Magic == 0x4d3cb2a1)
+		Swap = true;
+	else
+	{
+		dbg_msg("replay", "not a pcap file, pcapng has to be converted first");
+		return -1;
+	}
+	int LinkType = replay_read32(&pFile[20], Swap)&0xffff;
+
+	int Capacity = 1024;
+	int Num = 0;
+	CReplayDatagram *pDatagrams = (CReplayDatagram *)mem_alloc(Capacity*sizeof(CReplayDatagram));
+	*pSkipped = 0;
+
+	int64_t Offset = PCAP_HEADERSIZE;
+	while(Offset + PCAP_RECORD_HEADERSIZE <= FileSize)
+	{
+		unsigned CapturedSize = replay_read32(&pFile[Offset+8], Swap);
+		const unsigned char *pFrame = &pFile[Offset+PCAP_RECORD_HEADERSIZE];
+		Offset += PCAP_RECORD_HEADERSIZE + CapturedSize;
+		if(Offset > FileSize)
+			break;
+
+		CReplayDatagram Datagram;
+		int LinkOffset = replay_link_offset(LinkType, pFrame, CapturedSize);
+		if(LinkOffset < 0 || replay_parse_ip(pFrame+LinkOffset, CapturedSize-LinkOffset, &Datagram) != 0 || Datagram.m_Size > NET_MAX_PACKETSIZE)
+		{
+			(*pSkipped)++;
+			continue;
+		}
+
+		if(Num == Capacity)
+		{
+			Capacity *= 2;
+			CReplayDatagram *pNew = (CReplayDatagram *)mem_alloc(Capacity*sizeof(CReplayDatagram));
+			mem_copy(pNew, pDatagrams, Num*sizeof(CReplayDatagram));
+			mem_free(pDatagrams);
+			pDatagrams = pNew;
+		}
+		pDatagrams[Num++] = Datagram;
+	}
+
+	*ppDatagrams = pDatagrams;
+	return Num;
+}
+
+static CReplaySender *replay_find_sender(CReplaySender *pSenders, int *pNumSenders, const NETADDR *pAddr)
+{
+	for(int i = 0; i < *pNumSenders; i++)
+		if(net_addr_comp(&pSenders[i].m_Addr, pAddr) == 0)
+			return &pSenders[i];
+	if(*pNumSenders == REPLAY_MAX_SENDERS)
+		return 0;
+	CReplaySender *pSender = &pSenders[(*pNumSenders)++];
+	pSender->m_Addr = *pAddr;
+	pSender->m_Sequence.Reset();
+	return pSender;
+}
+
+static void replay_pass(CNetBase *pNet, CNetRecvUnpacker *pUnpacker, CReplaySender *pSenders,
+	const CReplayDatagram *pDatagrams, int NumDatagrams, CReplayCounters *pCounters)
+{
+	mem_zero(pCounters, sizeof(*pCounters));
+	int NumSenders = 0;
+	for(int i = 0; i < NumDatagrams; i++)
+	{
+		const CReplayDatagram *pDatagram = &pDatagrams[i];
+		pCounters->m_Datagrams++;
+		pCounters->m_Bytes += pDatagram->m_Size;
+
+		// as if it was just received
+		mem_copy(pUnpacker->m_aBuffer, pDatagram->m_pData, pDatagram->m_Size);
+		if(pNet->UnpackDatagram(&pDatagram->m_Addr, pUnpacker->m_aBuffer, pDatagram->m_Size, &pUnpacker->m_Data, &pUnpacker->m_pData) != 0)
+		{
+			pCounters->m_Invalid++;
+			continue;
+		}
+		if(pUnpacker->m_Data.m_Flags&NET_PACKETFLAG_CONNLESS)
+		{
+			pCounters->m_Connless++;
+			continue;
+		}
+		if(pUnpacker->m_Data.m_Flags&NET_PACKETFLAG_CONTROL)
+		{
+			pCounters->m_Control++;
+			continue;
+		}
+
+		CReplaySender *pSender = replay_find_sender(pSenders, &NumSenders, &pDatagram->m_Addr);
+		pUnpacker->Start(&pDatagram->m_Addr, pSender ? &pSender->m_Sequence : 0, 0);
+		CNetChunk Chunk;
+		while(pUnpacker->FetchChunk(&Chunk))
+		{
+			pCounters->m_Chunks++;
+			pCounters->m_ChunkBytes += Chunk.m_DataSize;
+		}
+	}
+}
+
+int main(int argc, const char **argv)
+{
+	if(argc < 2)
+	{
+		dbg_msg("replay", "usage: %s <capture.pcap> [passes]", argv[0]);
+		return 1;
+	}
+	int NumPasses = argc > 2 ? atoi(argv[2]) : 10;
+	if(NumPasses < 1)
+		NumPasses = 1;
+
+	FILE *pFile = fopen(argv[1], "rb");
+	if(!pFile)
+	{
+		dbg_msg("replay", "could not open %s", argv[1]);
+		return 1;
+	}
+	fseek(pFile, 0, SEEK_END);
+	int64_t FileSize = ftell(pFile);
+	fseek(pFile, 0, SEEK_SET);
+	unsigned char *pFileData = (unsigned char *)mem_alloc(FileSize+1);
+	int64_t Read = fread(pFileData, 1, FileSize, pFile);
+	fclose(pFile);
+
+	CReplayDatagram *pDatagrams = 0;
+	int64_t Skipped = 0;
+	int NumDatagrams = replay_load(pFileData, Read, &pDatagrams, &Skipped);
+	if(NumDatagrams < 0)
+	{
+		dbg_msg("replay", "could not read %s", argv[1]);
+		return 1;
+	}
+
+	static CNetBase s_Net;
+	static CNetRecvUnpacker s_Unpacker;
+	static CReplaySender s_aSenders[REPLAY_MAX_SENDERS];
+	CReplayCounters Counters;
+	int64_t Best = -1;
+	for(int Pass = 0; Pass < NumPasses; Pass++)
+	{
+		int64_t Start = replay_time_ns();
+		replay_pass(&s_Net, &s_Unpacker, s_aSenders, pDatagrams, NumDatagrams, &Counters);
+		int64_t Duration = replay_time_ns() - Start;
+		if(Best < 0 || Duration < Best)
+			Best = Duration;
+	}
+
+	printf("{\"replay\":\"%s\",\"datagrams\":%lld,\"skipped\":%lld,\"invalid\":%lld,\"connless\":%lld,\"control\":%lld,\"chunks\":%lld,\"chunk_bytes\":%lld}\n",
+		argv[1], (long long)Counters.m_Datagrams, (long long)Skipped, (long long)Counters.m_Invalid, (long long)Counters.m_Connless,
+		(long long)Counters.m_Control, (long long)Counters.m_Chunks, (long long)Counters.m_ChunkBytes);
+	if(Best > 0 && Counters.m_Datagrams)
+		printf("{\"bench\":\"replay\",\"corpus\":\"%s\",\"ops\":%lld,\"bytes\":%lld,\"ns_per_op\":%.3f,\"bytes_per_sec\":%.0f}\n",
+			argv[1], (long long)Counters.m_Datagrams, (long long)Counters.m_Bytes, (double)Best/Counters.m_Datagrams, Counters.m_Bytes*1e9/Best);
+
+	mem_free(pDatagrams);
+	mem_free(pFileData);
+	return 0;
+}
@@ -1,7 +1,7 @@
 /* (c) Magnus Auvinen. See licence.txt in the root of the distribution for more information. */
 /* If you are missing that file, acquire a complete release at teeworlds.com.                */
 
-static const unsigned gs_aFreqTable[256 + 1] = {
+static constexpr unsigned gs_aFreqTable[256 + 1] = {
 	1 << 30,4545,2657,431,1950,919,444,482,2244,617,838,542,715,1814,304,240,754,212,647,186,
 	283,131,146,166,543,164,167,136,179,859,363,113,157,154,204,108,137,180,202,176,
 	872,404,168,134,151,111,113,109,120,126,129,100,41,20,16,22,18,18,17,19,
@@ -16,49 +16,53 @@ static const unsigned gs_aFreqTable[256 + 1] = {
 	12,18,18,27,20,18,15,19,11,17,33,12,18,15,19,18,16,26,17,18,
 	9,10,25,22,22,17,20,16,6,16,15,20,14,18,24,335,1517 };
 
-struct CHuffmanConstructNode
+enum
 {
-	unsigned short m_NodeId;
- 	int m_Frequency;
+	HUFFMAN_EOF_SYMBOL = 256,
+
+	HUFFMAN_MAX_SYMBOLS=HUFFMAN_EOF_SYMBOL+1,
+	HUFFMAN_MAX_NODES=HUFFMAN_MAX_SYMBOLS*2-1,
+
+	HUFFMAN_LUTBITS = 12,
+	HUFFMAN_LUTSIZE = (1<<HUFFMAN_LUTBITS),
+	HUFFMAN_LUTMASK = (HUFFMAN_LUTSIZE-1),
+
+	// decode LUT entry: up to 3 symbols in the low 24 bits, then the number of bits they use
+	// and how many there are. an entry without symbols holds the node index reached after
+	// HUFFMAN_LUTBITS bits instead, the code has to be finished by walking the tree
+	HUFFMAN_LUT_MAXSYMBOLS = 3,
+	HUFFMAN_LUT_BITSSHIFT = 24,
+	HUFFMAN_LUT_BITSMASK = 0xf,
+	HUFFMAN_LUT_COUNTSHIFT = 28,
+	HUFFMAN_LUT_COUNTMASK = 0x3,
+	HUFFMAN_LUT_EOF = 1<<30,
+
+	// lookup width of the reference decoder, see CHuffman::Decompress
+	HUFFMAN_REFERENCE_LUTBITS = 10,
+
+	// longest code the 64 bit paths can handle, two lookups per refill when decoding and two
+	// symbols per 64 bit store when encoding
+	HUFFMAN_FASTPATH_MAXBITS = 24,
+
+	// encode LUT entry: code bits in the low 24 bits, code length above
+	HUFFMAN_ENCODE_LENGTHSHIFT = 24,
+	HUFFMAN_ENCODE_BITSMASK = (1<<HUFFMAN_ENCODE_LENGTHSHIFT)-1,
+
+	// longest code the avx2 encoder can handle, it merges 4 codes into one 64 bit lane
+	HUFFMAN_AVX2_MAXBITS = 16
 };
 
-// TODO: this should be something faster, but it's enough for now
-static void BubbleSort(CHuffmanConstructNode **ppList, int Size)
-{
-	int Changed = 1;
-	CHuffmanConstructNode *pTemp;
-
-	while(Changed)
-	{
-		Changed = 0;
-		for(int i = 0; i < Size-1; i++)
-		{
-			if(ppList[i]->m_Frequency < ppList[i+1]->m_Frequency)
-			{
-				pTemp = ppList[i];
-				ppList[i] = ppList[i+1];
-				ppList[i+1] = pTemp;
-				Changed = 1;
-			}
-		}
-		Size--;
-	}
-}
+/*
+	Struct: CHuffmanTables
+		Everything the compressor and decompressor need for one frequency table.
 
-class CHuffman
+	Remarks:
+		- Build is constexpr, the tables for gs_aFreqTable are generated at compile time.
+		- Build orders the nodes with a heap, which yields exactly the tree of the
+		  reference implementation that bubble sorts the remaining nodes before every merge.
+*/
+struct CHuffmanTables
 {
-	enum
-	{
-		HUFFMAN_EOF_SYMBOL = 256,
-
-		HUFFMAN_MAX_SYMBOLS=HUFFMAN_EOF_SYMBOL+1,
-		HUFFMAN_MAX_NODES=HUFFMAN_MAX_SYMBOLS*2-1,
-
-		HUFFMAN_LUTBITS = 10,
-		HUFFMAN_LUTSIZE = (1<<HUFFMAN_LUTBITS),
-		HUFFMAN_LUTMASK = (HUFFMAN_LUTSIZE-1)
-	};
-
 	struct CNode
 	{
 		// symbol
@@ -73,28 +77,79 @@ class CHuffman
 	};
 
 	CNode m_aNodes[HUFFMAN_MAX_NODES];
-	CNode *m_apDecodeLut[HUFFMAN_LUTSIZE];
-	CNode *m_pStartNode;
-	int m_NumNodes;
+	unsigned m_aDecodeLut[HUFFMAN_LUTSIZE];
+	unsigned m_aEncodeLut[HUFFMAN_MAX_SYMBOLS];
+	unsigned short m_aCodeLengths[HUFFMAN_MAX_SYMBOLS];
+	int m_StartNode;
+	unsigned m_MaxCodeLength;
+
+	// node waiting to be merged. the reference keeps these in a list that is stably sorted by
+	// descending frequency and merges the last two, so among equal frequencies the node that
+	// was inserted last goes first: merged nodes in reverse order of creation, then the
+	// symbols from the highest to the lowest
+	struct CConstructNode
+	{
+		int m_Frequency;
+		int m_Order;
+		unsigned short m_NodeId;
+
+		constexpr bool MergesBefore(const CConstructNode &Other) const
+		{
+			if(m_Frequency != Other.m_Frequency)
+				return m_Frequency < Other.m_Frequency;
+			return m_Order > Other.m_Order;
+		}
+	};
+
+	static constexpr void HeapPush(CConstructNode *pHeap, int &Size, CConstructNode Node)
+	{
+		int i = Size++;
+		while(i > 0 && Node.MergesBefore(pHeap[(i-1)/2]))
+		{
+			pHeap[i] = pHeap[(i-1)/2];
+			i = (i-1)/2;
+		}
+		pHeap[i] = Node;
+	}
+
+	static constexpr CConstructNode HeapPop(CConstructNode *pHeap, int &Size)
+	{
+		CConstructNode Top = pHeap[0];
+		CConstructNode Last = pHeap[--Size];
+		int i = 0;
+		while(2*i+1 < Size)
+		{
+			int Child = 2*i+1;
+			if(Child+1 < Size && pHeap[Child+1].MergesBefore(pHeap[Child]))
+				Child++;
+			if(!pHeap[Child].MergesBefore(Last))
+				break;
+			pHeap[i] = pHeap[Child];
+			i = Child;
+		}
+		pHeap[i] = Last;
+		return Top;
+	}
 
-	void Setbits_r(CNode *pNode, int Bits, unsigned Depth)
+	constexpr void Setbits_r(int Node, unsigned Bits, unsigned Depth)
 	{
-		if(pNode->m_aLeafs[1] != 0xffff)
-			Setbits_r(&m_aNodes[pNode->m_aLeafs[1]], Bits|(1<<Depth), Depth+1);
-		if(pNode->m_aLeafs[0] != 0xffff)
-			Setbits_r(&m_aNodes[pNode->m_aLeafs[0]], Bits, Depth+1);
+		CNode &Current = m_aNodes[Node];
+		if(Current.m_aLeafs[1] != 0xffff)
+			Setbits_r(Current.m_aLeafs[1], Depth < 32 ? Bits|(1u<<Depth) : Bits, Depth+1);
+		if(Current.m_aLeafs[0] != 0xffff)
+			Setbits_r(Current.m_aLeafs[0], Bits, Depth+1);
 
-		if(pNode->m_NumBits)
+		if(Current.m_NumBits)
 		{
-			pNode->m_Bits = Bits;
-			pNode->m_NumBits = Depth;
+			Current.m_Bits = Bits;
+			Current.m_NumBits = Depth;
 		}
 	}
-	void ConstructTree(const unsigned *pFrequencies)
+
+	constexpr void ConstructTree(const unsigned *pFrequencies)
 	{
-		CHuffmanConstructNode aNodesLeftStorage[HUFFMAN_MAX_SYMBOLS];
-		CHuffmanConstructNode *apNodesLeft[HUFFMAN_MAX_SYMBOLS];
-		int NumNodesLeft = HUFFMAN_MAX_SYMBOLS;
+		CConstructNode aHeap[HUFFMAN_MAX_SYMBOLS] = {};
+		int HeapSize = 0;
 
 		// add the symbols
 		for(int i = 0; i < HUFFMAN_MAX_SYMBOLS; i++)
@@ -104,110 +159,288 @@ class CHuffman
 			m_aNodes[i].m_aLeafs[0] = 0xffff;
 			m_aNodes[i].m_aLeafs[1] = 0xffff;
 
-			if(i == HUFFMAN_EOF_SYMBOL)
-				aNodesLeftStorage[i].m_Frequency = 1;
-			else
-				aNodesLeftStorage[i].m_Frequency = pFrequencies[i];
-			aNodesLeftStorage[i].m_NodeId = i;
-			apNodesLeft[i] = &aNodesLeftStorage[i];
-
+			CConstructNode Node = {};
+			Node.m_Frequency = i == HUFFMAN_EOF_SYMBOL ? 1 : (int)pFrequencies[i];
+			Node.m_Order = i;
+			Node.m_NodeId = i;
+			HeapPush(aHeap, HeapSize, Node);
 		}
 
-		m_NumNodes = HUFFMAN_MAX_SYMBOLS;
+		int NumNodes = HUFFMAN_MAX_SYMBOLS;
 
 		// construct the table
-		while(NumNodesLeft > 1)
+		while(HeapSize > 1)
 		{
-			// we can't rely on stdlib's qsort for this, it can generate different results on different implementations
-			BubbleSort(apNodesLeft, NumNodesLeft);
+			CConstructNode First = HeapPop(aHeap, HeapSize);
+			CConstructNode Second = HeapPop(aHeap, HeapSize);
 
-			m_aNodes[m_NumNodes].m_NumBits = 0;
-			m_aNodes[m_NumNodes].m_aLeafs[0] = apNodesLeft[NumNodesLeft-1]->m_NodeId;
-			m_aNodes[m_NumNodes].m_aLeafs[1] = apNodesLeft[NumNodesLeft-2]->m_NodeId;
-			apNodesLeft[NumNodesLeft-2]->m_NodeId = m_NumNodes;
-			apNodesLeft[NumNodesLeft-2]->m_Frequency = apNodesLeft[NumNodesLeft-1]->m_Frequency + apNodesLeft[NumNodesLeft-2]->m_Frequency;
+			m_aNodes[NumNodes].m_NumBits = 0;
+			m_aNodes[NumNodes].m_aLeafs[0] = First.m_NodeId;
+			m_aNodes[NumNodes].m_aLeafs[1] = Second.m_NodeId;
 
-			m_NumNodes++;
-			NumNodesLeft--;
+			CConstructNode Node = {};
+			Node.m_Frequency = (int)((unsigned)First.m_Frequency + (unsigned)Second.m_Frequency);
+			Node.m_Order = NumNodes;
+			Node.m_NodeId = NumNodes;
+			HeapPush(aHeap, HeapSize, Node);
+
+			NumNodes++;
 		}
 
 		// set start node
-		m_pStartNode = &m_aNodes[m_NumNodes-1];
+		m_StartNode = NumNodes-1;
 
 		// build symbol bits
-		Setbits_r(m_pStartNode, 0, 0);
+		Setbits_r(m_StartNode, 0, 0);
 	}
 
-public:
-	/*
-		Function: huffman_init
-			Inits the compressor/decompressor.
-
-		Parameters:
-			huff - Pointer to the state to init
-			frequencies - A pointer to an array of 256 entries of the frequencies of the bytes
-
-		Remarks:
-			- Does no allocation what so ever.
-			- You don't have to call any cleanup functions when you are done with it
-	*/
-	void Init(const unsigned *pFrequencies)
+	constexpr void BuildLuts()
 	{
-		// make sure to cleanout every thing
-		mem_zero(this, sizeof(*this));
-
-		// construct the tree
-		if(!pFrequencies)
-			pFrequencies = gs_aFreqTable;
-		ConstructTree(pFrequencies);
+		// find the longest code and pack the codes for the encoder
+		m_MaxCodeLength = 0;
+		for(int i = 0; i < HUFFMAN_MAX_SYMBOLS; i++)
+		{
+			if(m_aNodes[i].m_NumBits > m_MaxCodeLength)
+				m_MaxCodeLength = m_aNodes[i].m_NumBits;
+			m_aEncodeLut[i] = (m_aNodes[i].m_Bits&HUFFMAN_ENCODE_BITSMASK) | (m_aNodes[i].m_NumBits<<HUFFMAN_ENCODE_LENGTHSHIFT);
+			m_aCodeLengths[i] = m_aNodes[i].m_NumBits;
+		}
 
-		// build decode LUT
+		// each entry holds as many complete codes as fit into the index
 		for(int i = 0; i < HUFFMAN_LUTSIZE; i++)
 		{
-			unsigned Bits = i;
-			int k;
-			CNode *pNode = m_pStartNode;
-			for(k = 0; k < HUFFMAN_LUTBITS; k++)
+			unsigned Entry = 0;
+			unsigned NumSymbols = 0;
+			unsigned NumBits = 0;
+			while(NumSymbols < HUFFMAN_LUT_MAXSYMBOLS)
 			{
-				pNode = &m_aNodes[pNode->m_aLeafs[Bits&1]];
-				Bits >>= 1;
+				int Node = m_StartNode;
+				unsigned k = NumBits;
+				while(!m_aNodes[Node].m_NumBits && k < HUFFMAN_LUTBITS)
+				{
+					Node = m_aNodes[Node].m_aLeafs[(i>>k)&1];
+					k++;
+				}
 
-				if(!pNode)
+				// the code continues past the index
+				if(!m_aNodes[Node].m_NumBits)
+				{
+					if(NumSymbols == 0)
+						Entry = Node;
 					break;
+				}
 
-				if(pNode->m_NumBits)
+				// eof ends the stream, it never shares an entry
+				if(Node == HUFFMAN_EOF_SYMBOL)
 				{
-					m_apDecodeLut[i] = pNode;
+					if(NumSymbols == 0)
+					{
+						Entry = HUFFMAN_LUT_EOF;
+						NumSymbols = 1;
+						NumBits = k;
+					}
 					break;
 				}
+
+				Entry |= (unsigned)m_aNodes[Node].m_Symbol << (NumSymbols*8);
+				NumSymbols++;
+				NumBits = k;
 			}
 
-			if(k == HUFFMAN_LUTBITS)
-				m_apDecodeLut[i] = pNode;
+			m_aDecodeLut[i] = Entry | (NumBits<<HUFFMAN_LUT_BITSSHIFT) | (NumSymbols<<HUFFMAN_LUT_COUNTSHIFT);
 		}
+	}
 
+	static constexpr CHuffmanTables Build(const unsigned *pFrequencies)
+	{
+		CHuffmanTables Tables = {};
+		Tables.ConstructTree(pFrequencies);
+		Tables.BuildLuts();
+		return Tables;
 	}
+};
 
-	/*
-		Function: huffman_compress
-			Compresses a buffer and outputs a compressed buffer.
+static constexpr CHuffmanTables gs_HuffmanDefaultTables = CHuffmanTables::Build(gs_aFreqTable);
 
-		Parameters:
-			huff - Pointer to the huffman state
-			input - Buffer to compress
-			input_size - Size of the buffer to compress
-			output - Buffer to put the compressed data into
-			output_size - Size of the output buffer
+static void HuffmanStore64(unsigned char *pDst, uint64_t Value)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	Value = __builtin_bswap64(Value);
+#endif
+	mem_copy(pDst, &Value, sizeof(Value));
+}
 
-		Returns:
-			Returns the size of the compressed data. Negative value on failure.
-	*/
-	int Compress(const void *pInput, int InputSize, void *pOutput, int OutputSize)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONF_HUFFMAN_AVX2 1
+#include <immintrin.h>
+
+static bool HuffmanDetectAvx2()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+// picked once at startup, the encoder output doesn't depend on it
+static const bool gs_HuffmanUseAvx2 = HuffmanDetectAvx2();
+
+/*
+	Function: HuffmanCompressAvx2
+		Encodes 32 bytes per step. The codes are gathered 8 at a time and merged pairwise
+		into two 64 bit lanes of 4 codes each, the summed code lengths give the shift offsets.
+		The 8 merged words are then appended to the bit buffer.
+
+	Remarks:
+		- Requires all codes to be at most HUFFMAN_AVX2_MAXBITS long.
+		- Stops when less than 32 input bytes or 72 output bytes are left, the caller
+		  continues from the updated pointers and bit buffer.
+*/
+__attribute__((target("avx2")))
+static void HuffmanCompressAvx2(const CHuffmanTables *pTables, const unsigned char *&pSrc, const unsigned char *pSrcEnd,
+	unsigned char *&pDst, const unsigned char *pDstEnd, uint64_t &Bits, unsigned &Bitcount)
+{
+	const __m256i LowMask = _mm256_set1_epi64x(0xffffffff);
+	const __m256i CodeMask = _mm256_set1_epi32(HUFFMAN_ENCODE_BITSMASK);
+
+	// 8 merged words of up to 7+64 bits, each one stores 8 bytes
+	while(pSrcEnd - pSrc >= 32 && pDstEnd - pDst >= 72)
+	{
+		uint64_t aCodes[16];
+		uint64_t aLengths[16];
+		for(int Part = 0; Part < 4; Part++)
+		{
+			__m256i Symbols = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(pSrc + Part*8)));
+			__m256i Entries = _mm256_i32gather_epi32((const int *)pTables->m_aEncodeLut, Symbols, 4);
+			__m256i Codes = _mm256_and_si256(Entries, CodeMask);
+			__m256i Lengths = _mm256_srli_epi32(Entries, HUFFMAN_ENCODE_LENGTHSHIFT);
+
+			// odd codes behind even codes, one pair per 64 bit lane
+			__m256i EvenLengths = _mm256_and_si256(Lengths, LowMask);
+			__m256i PairCodes = _mm256_or_si256(_mm256_and_si256(Codes, LowMask),
+				_mm256_sllv_epi64(_mm256_srli_epi64(Codes, 32), EvenLengths));
+			__m256i PairLengths = _mm256_add_epi64(EvenLengths, _mm256_srli_epi64(Lengths, 32));
+
+			// odd pairs behind even pairs, lanes 0 and 2 end up with 4 codes each
+			__m256i QuadCodes = _mm256_or_si256(PairCodes, _mm256_sllv_epi64(_mm256_srli_si256(PairCodes, 8), PairLengths));
+			__m256i QuadLengths = _mm256_add_epi64(PairLengths, _mm256_srli_si256(PairLengths, 8));
+
+			_mm256_storeu_si256((__m256i *)&aCodes[Part*4], QuadCodes);
+			_mm256_storeu_si256((__m256i *)&aLengths[Part*4], QuadLengths);
+		}
+		pSrc += 32;
+
+		for(int i = 0; i < 16; i += 2)
+		{
+			// up to 7 buffered bits plus 64 code bits
+			uint64_t Low = Bits | (aCodes[i] << Bitcount);
+			uint64_t High = Bitcount ? aCodes[i] >> (64 - Bitcount) : 0;
+			unsigned Total = Bitcount + (unsigned)aLengths[i];
+			HuffmanStore64(pDst, Low);
+			pDst += Total >> 3;
+			Bits = Total >= 64 ? High : Low >> (Total&~7);
+			Bitcount = Total&7;
+		}
+	}
+}
+#endif
+
+
+/*
+	Struct: CHuffmanBuffer
+		One stream for CHuffman::CompressBatch and CHuffman::DecompressBatch.
+
+	Members:
+		m_pInput, m_InputSize - Buffer to compress or decompress
+		m_pOutput, m_OutputSize - Buffer to put the result into
+		m_Result - Set by the batch call, same meaning as the return value of Compress/Decompress
+*/
+struct CHuffmanBuffer
+{
+	const void *m_pInput;
+	int m_InputSize;
+	void *m_pOutput;
+	int m_OutputSize;
+	int m_Result;
+};
+
+class CHuffman
+{
+	enum
+	{
+		// streams that are decoded/encoded interleaved by the batch calls
+		HUFFMAN_BATCH_STREAMS = 4,
+	};
+
+	typedef CHuffmanTables::CNode CNode;
+
+	// position of one stream, the bit buffer is only used by the 64 bit paths
+	struct CStream
+	{
+		const unsigned char *m_pSrc;
+		const unsigned char *m_pSrcEnd;
+		unsigned char *m_pDst;
+		unsigned char *m_pDstEnd;
+		uint64_t m_Bits;
+		unsigned m_Bitcount;
+
+		void Init(const void *pInput, int InputSize, void *pOutput, int OutputSize)
+		{
+			m_pSrc = (const unsigned char *)pInput;
+			m_pSrcEnd = m_pSrc + InputSize;
+			m_pDst = (unsigned char *)pOutput;
+			m_pDstEnd = m_pDst + OutputSize;
+			m_Bits = 0;
+			m_Bitcount = 0;
+		}
+	};
+
+	const CHuffmanTables *m_pTables;
+	CHuffmanTables m_CustomTables;
+
+	static uint64_t Load64(const unsigned char *pSrc)
+	{
+		uint64_t Value;
+		mem_copy(&Value, pSrc, sizeof(Value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		Value = __builtin_bswap64(Value);
+#endif
+		return Value;
+	}
+
+	bool CanEncodeWide(const CStream *pStream) const
+	{
+		return pStream->m_pSrcEnd - pStream->m_pSrc >= 2 && pStream->m_pDstEnd - pStream->m_pDst >= 8;
+	}
+
+	// {W} encode two symbols into the 64 bit buffer and store the whole bytes as one word,
+	// at most 7+48 bits. only called while CanEncodeWide, so it never fills the output
+	void EncodeWide(CStream *pStream) const
+	{
+		const unsigned *pEncodeLut = m_pTables->m_aEncodeLut;
+		unsigned Entry0 = pEncodeLut[pStream->m_pSrc[0]];
+		unsigned Entry1 = pEncodeLut[pStream->m_pSrc[1]];
+		pStream->m_pSrc += 2;
+
+		uint64_t Bits = pStream->m_Bits;
+		unsigned Bitcount = pStream->m_Bitcount;
+		Bits |= (uint64_t)(Entry0&HUFFMAN_ENCODE_BITSMASK) << Bitcount;
+		Bitcount += Entry0>>HUFFMAN_ENCODE_LENGTHSHIFT;
+		Bits |= (uint64_t)(Entry1&HUFFMAN_ENCODE_BITSMASK) << Bitcount;
+		Bitcount += Entry1>>HUFFMAN_ENCODE_LENGTHSHIFT;
+
+		HuffmanStore64(pStream->m_pDst, Bits);
+		pStream->m_pDst += Bitcount >> 3;
+		pStream->m_Bits = Bits >> (Bitcount&~7);
+		pStream->m_Bitcount = Bitcount&7;
+	}
+
+	// encodes what is left of the stream byte by byte and terminates it, exactly like the
+	// reference encoder. the bit buffer must hold less than 8 bits
+	int EncodeTail(CStream *pStream, const void *pOutput) const
 	{
 		// this macro loads a symbol for a byte into bits and bitcount
 	#define HUFFMAN_MACRO_LOADSYMBOL(Sym) \
-		Bits |= m_aNodes[Sym].m_Bits << Bitcount; \
-		Bitcount += m_aNodes[Sym].m_NumBits;
+		Bits |= pNodes[Sym].m_Bits << Bitcount; \
+		Bitcount += pNodes[Sym].m_NumBits;
 
 		// this macro writes the symbol stored in bits and bitcount to the dst pointer
 	#define HUFFMAN_MACRO_WRITE() \
@@ -221,17 +454,18 @@ public:
 		}
 
 		// setup buffer pointers
-		const unsigned char *pSrc = (const unsigned char *)pInput;
-		const unsigned char *pSrcEnd = pSrc + InputSize;
-		unsigned char *pDst = (unsigned char *)pOutput;
-		unsigned char *pDstEnd = pDst + OutputSize;
+		const unsigned char *pSrc = pStream->m_pSrc;
+		const unsigned char *pSrcEnd = pStream->m_pSrcEnd;
+		unsigned char *pDst = pStream->m_pDst;
+		unsigned char *pDstEnd = pStream->m_pDstEnd;
 
 		// symbol variables
-		unsigned Bits = 0;
-		unsigned Bitcount = 0;
+		const CNode *pNodes = m_pTables->m_aNodes;
+		unsigned Bits = (unsigned)pStream->m_Bits;
+		unsigned Bitcount = pStream->m_Bitcount;
 
 		// make sure that we have data that we want to compress
-		if(InputSize)
+		if(pSrc != pSrcEnd)
 		{
 			// {A} load the first symbol
 			int Symbol = *pSrc++;
@@ -268,88 +502,132 @@ public:
 	#undef HUFFMAN_MACRO_WRITE
 	}
 
-	/*
-		Function: huffman_decompress
-			Decompresses a buffer
-
-		Parameters:
-			huff - Pointer to the huffman state
-			input - Buffer to decompress
-			input_size - Size of the buffer to decompress
-			output - Buffer to put the uncompressed data into
-			output_size - Size of the output buffer
+	bool CanDecodeWide(const CStream *pStream) const
+	{
+		return pStream->m_pSrcEnd - pStream->m_pSrc >= 8 && pStream->m_pDstEnd - pStream->m_pDst >= 2*HUFFMAN_LUT_MAXSYMBOLS;
+	}
 
-		Returns:
-			Returns the size of the uncompressed data. Negative value on failure.
-	*/
-	int Decompress(const void *pInput, int InputSize, void *pOutput, int OutputSize)
+	// {A} refill the 64 bit buffer to at least 56 bits and do two lookups. only called while
+	// CanDecodeWide, so it never runs out of bits or output and can't hit any of the error
+	// cases. returns false when it decoded the eof symbol
+	bool DecodeWide(CStream *pStream) const
 	{
-		// setup buffer pointers
-		unsigned char *pDst = (unsigned char *)pOutput;
-		unsigned char *pSrc = (unsigned char *)pInput;
-		unsigned char *pDstEnd = pDst + OutputSize;
-		unsigned char *pSrcEnd = pSrc + InputSize;
+		const CNode *pNodes = m_pTables->m_aNodes;
+		const unsigned *pDecodeLut = m_pTables->m_aDecodeLut;
+		const unsigned char *pSrc = pStream->m_pSrc;
+		unsigned char *pDst = pStream->m_pDst;
+		uint64_t Bits = pStream->m_Bits;
+		unsigned Bitcount = pStream->m_Bitcount;
+
+		// fill up to at least 56 bits
+		Bits |= Load64(pSrc) << Bitcount;
+		pSrc += (63 - Bitcount) >> 3;
+		Bitcount |= 56;
+
+		bool Eof = false;
+		for(int Lookup = 0; Lookup < 2 && !Eof; Lookup++)
+		{
+			unsigned Entry = pDecodeLut[Bits&HUFFMAN_LUTMASK];
+			unsigned NumSymbols = (Entry>>HUFFMAN_LUT_COUNTSHIFT)&HUFFMAN_LUT_COUNTMASK;
+			if(NumSymbols)
+			{
+				if(Entry&HUFFMAN_LUT_EOF)
+				{
+					Eof = true;
+					break;
+				}
 
-		unsigned Bits = 0;
-		unsigned Bitcount = 0;
+				// always store all three, only the valid ones are kept
+				pDst[0] = Entry;
+				pDst[1] = Entry>>8;
+				pDst[2] = Entry>>16;
+				pDst += NumSymbols;
 
-		CNode *pEof = &m_aNodes[HUFFMAN_EOF_SYMBOL];
-		CNode *pNode = 0;
+				unsigned NumBits = (Entry>>HUFFMAN_LUT_BITSSHIFT)&HUFFMAN_LUT_BITSMASK;
+				Bits >>= NumBits;
+				Bitcount -= NumBits;
+			}
+			else
+			{
+				// walk the rest of the tree bit by bit
+				const CNode *pNode = &pNodes[Entry];
+				Bits >>= HUFFMAN_LUTBITS;
+				Bitcount -= HUFFMAN_LUTBITS;
+				do
+				{
+					pNode = &pNodes[pNode->m_aLeafs[Bits&1]];
+					Bits >>= 1;
+					Bitcount--;
+				}
+				while(!pNode->m_NumBits);
+
+				if(pNode == &pNodes[HUFFMAN_EOF_SYMBOL])
+					Eof = true;
+				else
+					*pDst++ = pNode->m_Symbol;
+			}
+		}
+
+		pStream->m_pSrc = pSrc;
+		pStream->m_pDst = pDst;
+		pStream->m_Bits = Bits;
+		pStream->m_Bitcount = Bitcount;
+		return !Eof;
+	}
+
+	// {B} decode what is left of the stream one symbol at a time. this has to behave exactly
+	// like the reference decoder on broken or truncated input: past the end of the input it
+	// keeps decoding zero bits with a wrapped bit count
+	int DecodeTail(CStream *pStream, const void *pOutput) const
+	{
+		const CNode *pNodes = m_pTables->m_aNodes;
+		const unsigned *pDecodeLut = m_pTables->m_aDecodeLut;
+		const CNode *pEof = &pNodes[HUFFMAN_EOF_SYMBOL];
+		unsigned char *pDst = pStream->m_pDst;
+		unsigned char *pDstEnd = pStream->m_pDstEnd;
+		const unsigned char *pSrcEnd = pStream->m_pSrcEnd;
+
+		// give back the whole bytes that are still buffered
+		const unsigned char *pSrc = pStream->m_pSrc - (pStream->m_Bitcount >> 3);
+		unsigned Bitcount = pStream->m_Bitcount&7;
+		unsigned Bits = (unsigned)pStream->m_Bits & ((1u<<Bitcount)-1);
 
 		while(1)
 		{
-			// {A} try to load a node now, this will reduce dependency at location {D}
-			pNode = 0;
-			if(Bitcount >= HUFFMAN_LUTBITS)
-				pNode = m_apDecodeLut[Bits&HUFFMAN_LUTMASK];
-
-			// {B} fill with new bits
+			// fill with new bits
 			while(Bitcount < 24 && pSrc != pSrcEnd)
 			{
 				Bits |= (*pSrc++) << Bitcount;
 				Bitcount += 8;
 			}
 
-			// {C} load symbol now if we didn't that earlier at location {A}
-			if(!pNode)
-				pNode = m_apDecodeLut[Bits&HUFFMAN_LUTMASK];
-
-			if(!pNode)
-				return -1;
-
-			// {D} check if we hit a symbol already
-			if(pNode->m_NumBits)
-			{
-				// remove the bits for that symbol
-				Bits >>= pNode->m_NumBits;
-				Bitcount -= pNode->m_NumBits;
-			}
+			unsigned Entry = pDecodeLut[Bits&HUFFMAN_LUTMASK];
+			const CNode *pNode;
+			if((Entry>>HUFFMAN_LUT_COUNTSHIFT)&HUFFMAN_LUT_COUNTMASK)
+				pNode = &pNodes[Entry&HUFFMAN_LUT_EOF ? (unsigned)HUFFMAN_EOF_SYMBOL : Entry&0xff];
 			else
 			{
-				// remove the bits that the lut checked up for us
-				Bits >>= HUFFMAN_LUTBITS;
-				Bitcount -= HUFFMAN_LUTBITS;
-
 				// walk the tree bit by bit
-				while(1)
+				unsigned WalkBits = Bits >> HUFFMAN_LUTBITS;
+				pNode = &pNodes[Entry];
+				do
 				{
-					// traverse tree
-					pNode = &m_aNodes[pNode->m_aLeafs[Bits&1]];
-
-					// remove bit
-					Bitcount--;
-					Bits >>= 1;
-
-					// check if we hit a symbol
-					if(pNode->m_NumBits)
-						break;
-
-					// no more bits, decoding error
-					if(Bitcount == 0)
-						return -1;
+					pNode = &pNodes[pNode->m_aLeafs[WalkBits&1]];
+					WalkBits >>= 1;
 				}
+				while(!pNode->m_NumBits);
 			}
 
+			// the reference decoder resolves 10 bits per lookup and fails when a longer code runs
+			// out of buffered bits while walking the tree
+			unsigned NumBits = pNode->m_NumBits;
+			if(NumBits > HUFFMAN_REFERENCE_LUTBITS && Bitcount > HUFFMAN_REFERENCE_LUTBITS && Bitcount < NumBits)
+				return -1;
+
+			// remove the bits for that symbol
+			Bits = NumBits < 32 ? Bits >> NumBits : 0;
+			Bitcount -= NumBits;
+
 			// check for eof
 			if(pNode == pEof)
 				break;
@@ -364,4 +642,339 @@ public:
 		return (int)(pDst - (const unsigned char *)pOutput);
 	}
 
-};
\ No newline at end of file
+	// DecodeWide on all HUFFMAN_BATCH_STREAMS streams in lockstep, until one of them can't
+	// take another step or decoded the eof symbol, which is flagged in pEof. the state lives
+	// in locals, the output stores could alias anything else
+	void DecodeInterleaved(CStream *pStreams, bool *pEof) const
+	{
+		const CNode *pNodes = m_pTables->m_aNodes;
+		const unsigned *pDecodeLut = m_pTables->m_aDecodeLut;
+		const unsigned char *apSrc[HUFFMAN_BATCH_STREAMS];
+		const unsigned char *apSrcEnd[HUFFMAN_BATCH_STREAMS];
+		unsigned char *apDst[HUFFMAN_BATCH_STREAMS];
+		unsigned char *apDstEnd[HUFFMAN_BATCH_STREAMS];
+		uint64_t aBits[HUFFMAN_BATCH_STREAMS];
+		unsigned aBitcount[HUFFMAN_BATCH_STREAMS];
+		bool aEof[HUFFMAN_BATCH_STREAMS];
+		for(int i = 0; i < HUFFMAN_BATCH_STREAMS; i++)
+		{
+			apSrc[i] = pStreams[i].m_pSrc;
+			apSrcEnd[i] = pStreams[i].m_pSrcEnd;
+			apDstEnd[i] = pStreams[i].m_pDstEnd;
+			aEof[i] = false;
+			apDst[i] = pStreams[i].m_pDst;
+			aBits[i] = pStreams[i].m_Bits;
+			aBitcount[i] = pStreams[i].m_Bitcount;
+		}
+
+		bool Eof = false;
+		while(!Eof)
+		{
+			bool CanStep = true;
+			for(int i = 0; i < HUFFMAN_BATCH_STREAMS; i++)
+				CanStep &= apSrcEnd[i] - apSrc[i] >= 8 && apDstEnd[i] - apDst[i] >= 2*HUFFMAN_LUT_MAXSYMBOLS;
+			if(!CanStep)
+				break;
+
+			// fill up to at least 56 bits
+			for(int i = 0; i < HUFFMAN_BATCH_STREAMS; i++)
+			{
+				aBits[i] |= Load64(apSrc[i]) << aBitcount[i];
+				apSrc[i] += (63 - aBitcount[i]) >> 3;
+				aBitcount[i] |= 56;
+			}
+
+			for(int Lookup = 0; Lookup < 2; Lookup++)
+			{
+				for(int i = 0; i < HUFFMAN_BATCH_STREAMS; i++)
+				{
+					if(aEof[i])
+						continue;
+
+					unsigned Entry = pDecodeLut[aBits[i]&HUFFMAN_LUTMASK];
+					unsigned NumSymbols = (Entry>>HUFFMAN_LUT_COUNTSHIFT)&HUFFMAN_LUT_COUNTMASK;
+					if(NumSymbols)
+					{
+						if(Entry&HUFFMAN_LUT_EOF)
+						{
+							aEof[i] = Eof = true;
+							continue;
+						}
+
+						apDst[i][0] = Entry;
+						apDst[i][1] = Entry>>8;
+						apDst[i][2] = Entry>>16;
+						apDst[i] += NumSymbols;
+
+						unsigned NumBits = (Entry>>HUFFMAN_LUT_BITSSHIFT)&HUFFMAN_LUT_BITSMASK;
+						aBits[i] >>= NumBits;
+						aBitcount[i] -= NumBits;
+					}
+					else
+					{
+						const CNode *pNode = &pNodes[Entry];
+						aBits[i] >>= HUFFMAN_LUTBITS;
+						aBitcount[i] -= HUFFMAN_LUTBITS;
+						do
+						{
+							pNode = &pNodes[pNode->m_aLeafs[aBits[i]&1]];
+							aBits[i] >>= 1;
+							aBitcount[i]--;
+						}
+						while(!pNode->m_NumBits);
+
+						if(pNode == &pNodes[HUFFMAN_EOF_SYMBOL])
+							aEof[i] = Eof = true;
+						else
+							*apDst[i]++ = pNode->m_Symbol;
+					}
+				}
+			}
+		}
+
+		for(int i = 0; i < HUFFMAN_BATCH_STREAMS; i++)
+		{
+			pStreams[i].m_pSrc = apSrc[i];
+			pStreams[i].m_pDst = apDst[i];
+			pStreams[i].m_Bits = aBits[i];
+			pStreams[i].m_Bitcount = aBitcount[i];
+			pEof[i] = aEof[i];
+		}
+	}
+
+public:
+	CHuffman() { Init(0); }
+
+	/*
+		Function: huffman_init
+			Inits the compressor/decompressor.
+
+		Parameters:
+			huff - Pointer to the state to init
+			frequencies - A pointer to an array of 256 entries of the frequencies of the bytes
+
+		Remarks:
+			- Does no allocation what so ever.
+			- You don't have to call any cleanup functions when you are done with it
+			- Passing 0 selects the precomputed tables for gs_aFreqTable and costs nothing.
+	*/
+	void Init(const unsigned *pFrequencies)
+	{
+		if(!pFrequencies)
+		{
+			m_pTables = &gs_HuffmanDefaultTables;
+			return;
+		}
+
+		m_CustomTables = CHuffmanTables::Build(pFrequencies);
+		m_pTables = &m_CustomTables;
+	}
+
+	/*
+		Function: huffman_compress
+			Compresses a buffer and outputs a compressed buffer.
+
+		Parameters:
+			huff - Pointer to the huffman state
+			input - Buffer to compress
+			input_size - Size of the buffer to compress
+			output - Buffer to put the compressed data into
+			output_size - Size of the output buffer
+
+		Returns:
+			Returns the size of the compressed data. Negative value on failure.
+	*/
+	int Compress(const void *pInput, int InputSize, void *pOutput, int OutputSize) const
+	{
+		if(OutputSize <= 0)
+			return -1;
+
+		CStream Stream;
+		Stream.Init(pInput, InputSize, pOutput, OutputSize);
+		if(m_pTables->m_MaxCodeLength <= HUFFMAN_FASTPATH_MAXBITS)
+		{
+#if defined(CONF_HUFFMAN_AVX2)
+			if(gs_HuffmanUseAvx2 && m_pTables->m_MaxCodeLength <= HUFFMAN_AVX2_MAXBITS)
+				HuffmanCompressAvx2(m_pTables, Stream.m_pSrc, Stream.m_pSrcEnd, Stream.m_pDst, Stream.m_pDstEnd, Stream.m_Bits, Stream.m_Bitcount);
+#endif
+			while(CanEncodeWide(&Stream))
+				EncodeWide(&Stream);
+		}
+		return EncodeTail(&Stream, pOutput);
+	}
+
+	/*
+		Function: CompressedSize
+			Computes what Compress would return for a large enough output buffer,
+			without encoding anything.
+
+		Parameters:
+			pInput - Buffer to compress
+			InputSize - Size of the buffer to compress
+			MaxSize - Size from which on the exact result doesn't matter
+
+		Returns:
+			The size of the compressed data, or MaxSize if it would be MaxSize or more.
+
+		Remarks:
+			- Only sums up code lengths and stops as soon as MaxSize is reached, which
+			  makes it a lot cheaper than trying to compress.
+	*/
+	int CompressedSize(const void *pInput, int InputSize, int MaxSize) const
+	{
+		const unsigned short *pCodeLengths = m_pTables->m_aCodeLengths;
+		const unsigned char *pSrc = (const unsigned char *)pInput;
+		const unsigned char *pSrcEnd = pSrc + InputSize;
+
+		// Compress stores all complete bytes and one more for the remaining bits
+		if(MaxSize <= 1)
+			return MaxSize;
+		unsigned MaxBits = (MaxSize-1)*8;
+		unsigned NumBits = pCodeLengths[HUFFMAN_EOF_SYMBOL];
+
+		while(pSrc != pSrcEnd)
+		{
+			// check the limit every 32 bytes, 4 sums to keep the adds independent
+			const unsigned char *pBlockEnd = pSrcEnd - pSrc > 32 ? pSrc + 32 : pSrcEnd;
+			unsigned aSums[4] = {0, 0, 0, 0};
+			for(; pBlockEnd - pSrc >= 4; pSrc += 4)
+			{
+				aSums[0] += pCodeLengths[pSrc[0]];
+				aSums[1] += pCodeLengths[pSrc[1]];
+				aSums[2] += pCodeLengths[pSrc[2]];
+				aSums[3] += pCodeLengths[pSrc[3]];
+			}
+			for(; pSrc != pBlockEnd; pSrc++)
+				aSums[0] += pCodeLengths[*pSrc];
+
+			NumBits += aSums[0] + aSums[1] + aSums[2] + aSums[3];
+			if(NumBits >= MaxBits)
+				return MaxSize;
+		}
+
+		return NumBits/8 + 1;
+	}
+
+	/*
+		Function: huffman_decompress
+			Decompresses a buffer
+
+		Parameters:
+			huff - Pointer to the huffman state
+			input - Buffer to decompress
+			input_size - Size of the buffer to decompress
+			output - Buffer to put the uncompressed data into
+			output_size - Size of the output buffer
+
+		Returns:
+			Returns the size of the uncompressed data. Negative value on failure.
+	*/
+	int Decompress(const void *pInput, int InputSize, void *pOutput, int OutputSize) const
+	{
+		CStream Stream;
+		Stream.Init(pInput, InputSize, pOutput, OutputSize);
+		if(m_pTables->m_MaxCodeLength <= HUFFMAN_FASTPATH_MAXBITS)
+		{
+			while(CanDecodeWide(&Stream))
+			{
+				if(!DecodeWide(&Stream))
+					return (int)(Stream.m_pDst - (const unsigned char *)pOutput);
+			}
+		}
+		return DecodeTail(&Stream, pOutput);
+	}
+
+	/*
+		Function: CompressBatch
+			Compresses several independent buffers.
+
+		Parameters:
+			pBuffers - Buffers to compress, m_Result receives what Compress would return
+			Num - Number of buffers
+
+		Remarks:
+			- The buffers are encoded one after another. The dependency chain of the
+			  64 bit encoder is short enough that interleaving streams only adds
+			  register pressure, this is here so callers can treat both directions alike.
+	*/
+	void CompressBatch(CHuffmanBuffer *pBuffers, int Num) const
+	{
+		for(int i = 0; i < Num; i++)
+			pBuffers[i].m_Result = Compress(pBuffers[i].m_pInput, pBuffers[i].m_InputSize, pBuffers[i].m_pOutput, pBuffers[i].m_OutputSize);
+	}
+
+	/*
+		Function: DecompressBatch
+			Decompresses several independent buffers, e.g. all packets of one receive burst.
+
+		Parameters:
+			pBuffers - Buffers to decompress, m_Result receives what Decompress would return
+			Num - Number of buffers
+
+		Remarks:
+			- Keeps HUFFMAN_BATCH_STREAMS buffers in flight and decodes them in lockstep,
+			  so the CPU can overlap the table lookups of several streams. A finished
+			  buffer is replaced by the next one.
+			- Output is identical to calling Decompress on every buffer.
+	*/
+	void DecompressBatch(CHuffmanBuffer *pBuffers, int Num) const
+	{
+		if(m_pTables->m_MaxCodeLength > HUFFMAN_FASTPATH_MAXBITS)
+		{
+			for(int i = 0; i < Num; i++)
+				pBuffers[i].m_Result = Decompress(pBuffers[i].m_pInput, pBuffers[i].m_InputSize, pBuffers[i].m_pOutput, pBuffers[i].m_OutputSize);
+			return;
+		}
+
+		CStream aStreams[HUFFMAN_BATCH_STREAMS];
+		CHuffmanBuffer *apSlots[HUFFMAN_BATCH_STREAMS] = {0};
+		bool aEof[HUFFMAN_BATCH_STREAMS] = {false};
+		int Next = 0;
+		while(1)
+		{
+			// every slot needs a stream that can take a wide step, the others get finished
+			int NumFilled = 0;
+			for(int i = 0; i < HUFFMAN_BATCH_STREAMS; i++)
+			{
+				while(!apSlots[i] || aEof[i] || !CanDecodeWide(&aStreams[i]))
+				{
+					if(apSlots[i])
+					{
+						if(aEof[i])
+							apSlots[i]->m_Result = (int)(aStreams[i].m_pDst - (const unsigned char *)apSlots[i]->m_pOutput);
+						else
+							apSlots[i]->m_Result = DecodeTail(&aStreams[i], apSlots[i]->m_pOutput);
+						apSlots[i] = 0;
+						aEof[i] = false;
+					}
+					if(Next == Num)
+						break;
+
+					CHuffmanBuffer *pBuffer = &pBuffers[Next++];
+					aStreams[i].Init(pBuffer->m_pInput, pBuffer->m_InputSize, pBuffer->m_pOutput, pBuffer->m_OutputSize);
+					apSlots[i] = pBuffer;
+				}
+				if(apSlots[i])
+					NumFilled++;
+			}
+
+			if(NumFilled < HUFFMAN_BATCH_STREAMS)
+				break;
+			DecodeInterleaved(aStreams, aEof);
+		}
+
+		// not enough buffers left to fill all slots
+		for(int i = 0; i < HUFFMAN_BATCH_STREAMS; i++)
+		{
+			if(!apSlots[i])
+				continue;
+			bool Eof = aEof[i];
+			while(!Eof && CanDecodeWide(&aStreams[i]))
+				Eof = !DecodeWide(&aStreams[i]);
+			if(Eof)
+				apSlots[i]->m_Result = (int)(aStreams[i].m_pDst - (const unsigned char *)apSlots[i]->m_pOutput);
+			else
+				apSlots[i]->m_Result = DecodeTail(&aStreams[i], apSlots[i]->m_pOutput);
+		}
+	}
+};
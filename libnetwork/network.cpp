@@ -6,22 +6,22 @@
 
 #include "huffman.h"
 
+#include "timer.h"
+
+#include "uring.h"
+
+#include "queue.h"
+
 #include "network.h"
 
-CHuffman g_Huffman;
-NETSOCKET g_Socket;
-NETADDR g_ServerAddr;
-unsigned char g_aRequestTokenBuf[NET_TOKENREQUEST_DATASIZE];
+#include "network_conn.h"
 
+#include "network_client.h"
 
-void init_network()
-{
-	NETADDR BindAddr;
-	net_host_lookup("127.0.0.1", &BindAddr, NETTYPE_ALL);
-	g_Socket = net_udp_create(BindAddr, 0);
-	g_Huffman.Init(0);
-	mem_zero(g_aRequestTokenBuf, sizeof(g_aRequestTokenBuf));
-}
+#include "network_thread.h"
+
+// read-only after static initialization, shared by all threads
+const CHuffman g_Huffman;
 
 
 int net_udp_send(NETSOCKET sock, const NETADDR *addr, const void *data, int size)
@@ -119,15 +119,571 @@ int net_udp_recv(NETSOCKET sock, NETADDR *addr, void *data, int maxsize)
 	return -1; /* error */
 }
 
-void SendPacket(const NETADDR *pAddr, CNetPacketConstruct *pPacket)
+/* segment_sizes gets the UDP_GRO segment size of every datagram, 0 if it wasn't coalesced.
+   type is cleared from *types once the socket is drained */
+static int net_udp_recv_batch_sock(int sock, int type, int addr_size, NETPACKET *packets, int *segment_sizes, int num, int *types)
+{
+	struct mmsghdr msgs[NET_BATCH_MAX];
+	struct iovec iovecs[NET_BATCH_MAX];
+	struct sockaddr_storage addrs[NET_BATCH_MAX];
+	char controls[NET_BATCH_MAX][CMSG_SPACE(sizeof(int))];
+	int i, received;
+
+	for(i = 0; i < num; i++)
+	{
+		iovecs[i].iov_base = packets[i].data;
+		iovecs[i].iov_len = packets[i].size;
+		mem_zero(&msgs[i].msg_hdr, sizeof(msgs[i].msg_hdr));
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = addr_size;
+		msgs[i].msg_hdr.msg_iov = &iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		if(segment_sizes)
+		{
+			msgs[i].msg_hdr.msg_control = controls[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+		}
+	}
+
+	received = recvmmsg(sock, msgs, num, MSG_DONTWAIT, 0);
+	/* a short batch ended on an empty queue too */
+	if(types && (received < 0 ? errno == EAGAIN || errno == EWOULDBLOCK : received < num))
+		*types &= ~type;
+	if(received <= 0)
+		return 0;
+
+	for(i = 0; i < received; i++)
+	{
+		sockaddr_to_netaddr((struct sockaddr *)&addrs[i], &packets[i].addr);
+		packets[i].size = msgs[i].msg_len;
+		if(segment_sizes)
+		{
+			struct cmsghdr *cmsg;
+			segment_sizes[i] = 0;
+			for(cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg))
+				if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+					mem_copy(&segment_sizes[i], CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+	return received;
+}
+
+static int net_udp_recv_batch_impl(NETSOCKET sock, NETPACKET *packets, int *segment_sizes, int num, int *types)
+{
+	int received = 0;
+	int ask = types ? *types : NETTYPE_ALL;
+	if(num > NET_BATCH_MAX)
+		num = NET_BATCH_MAX;
+
+	if(types && !(*types&sock.type))
+	{
+		/* all of them came back empty, the next call asks them again */
+		*types = sock.type&NETTYPE_ALL;
+		return 0;
+	}
+
+	if(sock.ipv4sock >= 0 && ask&NETTYPE_IPV4)
+		received = net_udp_recv_batch_sock(sock.ipv4sock, NETTYPE_IPV4, sizeof(struct sockaddr_in), packets, segment_sizes, num, types);
+	/* the ipv6 socket is only asked if there is room left */
+	if(received < num && sock.ipv6sock >= 0 && ask&NETTYPE_IPV6)
+		received += net_udp_recv_batch_sock(sock.ipv6sock, NETTYPE_IPV6, sizeof(struct sockaddr_in6), packets+received,
+			segment_sizes ? segment_sizes+received : 0, num-received, types);
+	return received;
+}
+
+/*
+	Function: net_udp_recv_batch
+		Receives up to num datagrams with one call per address family.
+
+	Parameters:
+		packets - data and size of every entry describe a receive buffer,
+		          the received entries get the address and size filled in
+		types - optional, NETTYPE_* of the sockets that may have
+		        datagrams waiting. only those are asked and a socket
+		        that comes back empty is cleared. once none is left the
+		        call returns 0 without asking and sets all of them again
+
+	Returns:
+		Number of datagrams received, 0 if there are none.
+*/
+int net_udp_recv_batch(NETSOCKET sock, NETPACKET *packets, int num, int *types)
+{
+	return net_udp_recv_batch_impl(sock, packets, 0, num, types);
+}
+
+/*
+	Function: net_udp_recv_batch_gro
+		Like net_udp_recv_batch for a socket with net_udp_set_gro. An entry
+		can hold several datagrams of one sender back to back, each of
+		segment_sizes[i] bytes except for a shorter last one.
+*/
+int net_udp_recv_batch_gro(NETSOCKET sock, NETPACKET *packets, int *segment_sizes, int num, int *types)
+{
+	return net_udp_recv_batch_impl(sock, packets, segment_sizes, num, types);
+}
+
+/* the system refuses segmentation e.g. without checksum offload on the device */
+static int net_udp_gso_refused(int error)
+{
+	return error == EIO || error == EINVAL || error == ENOPROTOOPT || error == EOPNOTSUPP;
+}
+
+static void net_udp_send_batch_sock(int sock, struct mmsghdr *msgs, int num, int *features)
+{
+	while(num > 0)
+	{
+		int sent = sendmmsg(sock, msgs, num, 0);
+		if(sent <= 0)
+		{
+			int error = errno;
+			struct msghdr *hdr = &msgs[0].msg_hdr;
+			if(hdr->msg_controllen && net_udp_gso_refused(error))
+			{
+				/* send the segments one by one, and never again with gso */
+				dbg_msg("net", "UDP_SEGMENT refused (%d '%s'), sending without it", error, strerror(error));
+				*features &= ~NETSOCKET_GSO;
+				for(unsigned i = 0; i < hdr->msg_iovlen; i++)
+				{
+					struct msghdr single = *hdr;
+					single.msg_iov = &hdr->msg_iov[i];
+					single.msg_iovlen = 1;
+					single.msg_control = 0;
+					single.msg_controllen = 0;
+					if(sendmsg(sock, &single, 0) < 0)
+						dbg_msg("net", "sendmsg error (%d '%s')", errno, strerror(errno));
+				}
+			}
+			else
+				dbg_msg("net", "sendmmsg error (%d '%s')", error, strerror(error));
+			/* skip the one that failed */
+			sent = 1;
+		}
+		msgs += sent;
+		num -= sent;
+	}
+}
+
+/*
+	Function: net_udp_send_batch
+		Sends datagrams with one call per address family.
+
+	Parameters:
+		features - NETSOCKET_GSO sends datagrams of the same size to the same
+		           peer as one segmented send. it's cleared if the system
+		           refuses that. 0 for plain sends
+
+	Returns:
+		Number of datagrams handed to the system.
+
+	Remarks:
+		- The order is kept for every peer.
+*/
+int net_udp_send_batch(NETSOCKET sock, const NETPACKET *packets, int num, int *features)
+{
+	struct mmsghdr msgs4[NET_BATCH_MAX];
+	struct mmsghdr msgs6[NET_BATCH_MAX];
+	struct iovec iovecs[NET_BATCH_MAX];
+	struct sockaddr_in addrs4[NET_BATCH_MAX];
+	struct sockaddr_in6 addrs6[NET_BATCH_MAX];
+	char controls[NET_BATCH_MAX][CMSG_SPACE(sizeof(unsigned short))];
+	char grouped[NET_BATCH_MAX];
+	int num4 = 0, num6 = 0, numiovecs = 0, numsent = 0, i, k;
+	int nofeatures = 0;
+	if(!features)
+		features = &nofeatures;
+	if(num > NET_BATCH_MAX)
+		num = NET_BATCH_MAX;
+	mem_zero(grouped, sizeof(grouped));
+
+	for(i = 0; i < num; i++)
+	{
+		const NETADDR *addr = &packets[i].addr;
+		struct msghdr *hdr;
+		if(grouped[i])
+			continue;
+		if(addr->type&NETTYPE_LINK_BROADCAST)
+		{
+			net_udp_send(sock, addr, packets[i].data, packets[i].size);
+			continue;
+		}
+
+		if(addr->type&NETTYPE_IPV4 && sock.ipv4sock >= 0)
+		{
+			netaddr_to_sockaddr_in(addr, &addrs4[num4]);
+			hdr = &msgs4[num4].msg_hdr;
+			mem_zero(hdr, sizeof(*hdr));
+			hdr->msg_name = &addrs4[num4];
+			hdr->msg_namelen = sizeof(addrs4[num4]);
+			num4++;
+		}
+		else if(addr->type&NETTYPE_IPV6 && sock.ipv6sock >= 0)
+		{
+			netaddr_to_sockaddr_in6(addr, &addrs6[num6]);
+			hdr = &msgs6[num6].msg_hdr;
+			mem_zero(hdr, sizeof(*hdr));
+			hdr->msg_name = &addrs6[num6];
+			hdr->msg_namelen = sizeof(addrs6[num6]);
+			num6++;
+		}
+		else
+		{
+			dbg_msg("net", "can't send to network of type %d", addr->type);
+			continue;
+		}
+
+		hdr->msg_iov = &iovecs[numiovecs];
+		iovecs[numiovecs].iov_base = packets[i].data;
+		iovecs[numiovecs].iov_len = packets[i].size;
+		numiovecs++;
+		hdr->msg_iovlen = 1;
+		numsent++;
+
+		/* the following datagrams to the peer join as long as they have the
+		   same size, a shorter one can still be the last segment */
+		if(*features&NETSOCKET_GSO)
+		{
+			int total = packets[i].size;
+			for(k = i+1; k < num && hdr->msg_iovlen < NET_GSO_MAX_SEGMENTS; k++)
+			{
+				if(grouped[k] || net_addr_comp(&packets[k].addr, addr) != 0)
+					continue;
+				if(packets[k].size > packets[i].size || total+packets[k].size > NET_GSO_MAX_BYTES)
+					break;
+				grouped[k] = 1;
+				iovecs[numiovecs].iov_base = packets[k].data;
+				iovecs[numiovecs].iov_len = packets[k].size;
+				numiovecs++;
+				hdr->msg_iovlen++;
+				numsent++;
+				total += packets[k].size;
+				if(packets[k].size < packets[i].size)
+					break;
+			}
+
+			if(hdr->msg_iovlen > 1)
+			{
+				struct cmsghdr *cmsg;
+				unsigned short segment = packets[i].size;
+				hdr->msg_control = controls[i];
+				hdr->msg_controllen = sizeof(controls[i]);
+				cmsg = CMSG_FIRSTHDR(hdr);
+				cmsg->cmsg_level = SOL_UDP;
+				cmsg->cmsg_type = UDP_SEGMENT;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(segment));
+				mem_copy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+			}
+		}
+	}
+
+	if(num4)
+		net_udp_send_batch_sock(sock.ipv4sock, msgs4, num4, features);
+	if(num6)
+		net_udp_send_batch_sock(sock.ipv6sock, msgs6, num6, features);
+	return numsent;
+}
+
+CNetBase::CNetBase()
+: m_ResendPool(CNetResendBuffer::StorageSize(), 4), m_ConstructPool(sizeof(CNetPacketConstruct), 16)
+{
+	m_Socket = invalid_socket;
+	m_LogLevel = NET_LOG_NONE;
+	m_pBatchBuffers = 0;
+	m_NumRecv = 0;
+	m_RecvIndex = 0;
+	m_NumSend = 0;
+	m_EpollFd = -1;
+	m_TimerFd = -1;
+	m_ArmedExpiry = -1;
+	m_SpinTime = 0;
+	m_RecvTypes = 0;
+	m_Backend = NET_BACKEND_SOCKET;
+	m_Features = 0;
+	m_Gro = false;
+	m_pGroBuffers = 0;
+	m_NumGro = 0;
+	m_GroIndex = 0;
+	m_GroOffset = 0;
+}
+
+int CNetBase::Open(NETADDR BindAddr, int Flags)
 {
-	unsigned char aBuffer[NET_MAX_PACKETSIZE];
+	Close();
+	m_pBatchBuffers = (unsigned char *)mem_alloc(2*NET_BATCH_SIZE*NET_MAX_PACKETSIZE);
+	if(!m_pBatchBuffers)
+		return -1;
+	for(int i = 0; i < NET_BATCH_SIZE; i++)
+	{
+		m_aRecvBatch[i].data = &m_pBatchBuffers[i*NET_MAX_PACKETSIZE];
+		m_aSendBatch[i].data = &m_pBatchBuffers[(NET_BATCH_SIZE+i)*NET_MAX_PACKETSIZE];
+	}
+
+	m_Socket = net_udp_create(BindAddr, (Flags&NETCREATE_FLAG_RANDOMPORT) ? 1 : 0, (Flags&NETCREATE_FLAG_REUSEPORT) ? 1 : 0);
+	if(!m_Socket.type)
+	{
+		Close();
+		return -1;
+	}
+	m_Timers.Reset(time_get());
+	m_Features = net_udp_features(m_Socket);
+	m_RecvTypes = m_Socket.type&NETTYPE_ALL;
+
+	m_EpollFd = epoll_create1(EPOLL_CLOEXEC);
+	m_TimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if(m_EpollFd < 0 || m_TimerFd < 0)
+	{
+		dbg_msg("libtwnetwork", "could not create the wait fds (%d '%s')", errno, strerror(errno));
+		Close();
+		return -1;
+	}
+	int aFds[3] = {m_Socket.ipv4sock, m_Socket.ipv6sock, m_TimerFd};
+	for(int i = 0; i < 3; i++)
+	{
+		if(aFds[i] < 0)
+			continue;
+		struct epoll_event Event;
+		mem_zero(&Event, sizeof(Event));
+		Event.events = EPOLLIN;
+		Event.data.fd = aFds[i];
+		epoll_ctl(m_EpollFd, EPOLL_CTL_ADD, aFds[i], &Event);
+	}
+	m_ArmedExpiry = -1;
+	if(m_SpinTime)
+		net_udp_set_busy_poll(m_Socket, m_SpinTime*1000000/time_freq());
+	m_Backend = OpenBackend();
+	return 0;
+}
+
+int CNetBase::OpenBackend()
+{
+	int aSocks[2] = {m_Socket.ipv4sock, m_Socket.ipv6sock};
+	struct epoll_event Event;
+	mem_zero(&Event, sizeof(Event));
+	Event.events = EPOLLIN;
+	if(m_Uring.Active())
+	{
+		epoll_ctl(m_EpollFd, EPOLL_CTL_DEL, m_Uring.Fd(), 0);
+		m_Uring.Close();
+		for(int i = 0; i < 2; i++)
+		{
+			Event.data.fd = aSocks[i];
+			if(aSocks[i] >= 0)
+				epoll_ctl(m_EpollFd, EPOLL_CTL_ADD, aSocks[i], &Event);
+		}
+	}
+	if(m_pGroBuffers)
+	{
+		net_udp_set_gro(m_Socket, 0);
+		mem_free(m_pGroBuffers);
+		m_pGroBuffers = 0;
+	}
+	// the batch may point into the ring or gro buffers
+	m_NumRecv = 0;
+	m_RecvIndex = 0;
+	m_NumGro = 0;
+	m_GroIndex = 0;
+	m_GroOffset = 0;
+	for(int i = 0; i < NET_BATCH_SIZE; i++)
+		m_aRecvBatch[i].data = &m_pBatchBuffers[i*NET_MAX_PACKETSIZE];
+
+	if(m_Backend == NET_BACKEND_SOCKET)
+	{
+		if(m_Gro && m_Features&NETSOCKET_GRO && net_udp_set_gro(m_Socket, 1) == 0)
+		{
+			m_pGroBuffers = (unsigned char *)mem_alloc(NET_GRO_BUFFERS*NET_GRO_BUFFER_SIZE);
+			for(int i = 0; i < NET_GRO_BUFFERS; i++)
+				m_aGroRecv[i].data = &m_pGroBuffers[i*NET_GRO_BUFFER_SIZE];
+		}
+		return NET_BACKEND_SOCKET;
+	}
+	if(m_Uring.Open(m_Socket, m_Backend == NET_BACKEND_URING_SQPOLL) != 0)
+	{
+		dbg_msg("libtwnetwork", "io_uring isn't available, using the socket calls");
+		return NET_BACKEND_SOCKET;
+	}
+	// the ring takes the datagrams off the sockets, it's what becomes
+	// readable. the sockets would wake the wait before the ring got them
+	for(int i = 0; i < 2; i++)
+		if(aSocks[i] >= 0)
+			epoll_ctl(m_EpollFd, EPOLL_CTL_DEL, aSocks[i], 0);
+	Event.data.fd = m_Uring.Fd();
+	epoll_ctl(m_EpollFd, EPOLL_CTL_ADD, m_Uring.Fd(), &Event);
+	return m_Backend;
+}
+
+int CNetBase::EnableGro(bool Enable)
+{
+	m_Gro = Enable;
+	if(m_Socket.type)
+		OpenBackend();
+	return !Enable || m_pGroBuffers ? 0 : -1;
+}
+
+int CNetBase::SetBackend(int Backend)
+{
+	m_Backend = Backend;
+	if(m_Socket.type)
+		m_Backend = OpenBackend();
+	return m_Backend;
+}
+
+void CNetBase::Close()
+{
+	if(m_Socket.type)
+		FlushSend();
+	m_Capture.Close();
+	if(m_Socket.type)
+		net_udp_close(m_Socket);
+	m_Socket = invalid_socket;
+	m_Uring.Close();
+	mem_free(m_pGroBuffers);
+	m_pGroBuffers = 0;
+	m_NumGro = 0;
+	m_GroIndex = 0;
+	if(m_EpollFd >= 0)
+		close(m_EpollFd);
+	if(m_TimerFd >= 0)
+		close(m_TimerFd);
+	m_EpollFd = -1;
+	m_TimerFd = -1;
+	mem_free(m_pBatchBuffers);
+	m_pBatchBuffers = 0;
+	m_NumRecv = 0;
+	m_RecvIndex = 0;
+	m_NumSend = 0;
+}
+
+void CNetBase::FlushSend()
+{
+	if(m_NumSend && m_Uring.Active())
+		m_Uring.Send(m_aSendBatch, m_NumSend);
+	else if(m_NumSend)
+		net_udp_send_batch(m_Socket, m_aSendBatch, m_NumSend, &m_Features);
+	m_NumSend = 0;
+}
+
+void CNetBase::ArmWakeup()
+{
+	int64_t Expiry = m_Timers.NextExpiry();
+	// setting the timer also resets its expirations, so a timer that
+	// fired doesn't keep the fd readable once it was handled
+	if(m_TimerFd < 0 || Expiry == m_ArmedExpiry)
+		return;
+
+	// time_get is CLOCK_MONOTONIC as well
+	struct itimerspec Spec;
+	mem_zero(&Spec, sizeof(Spec));
+	if(Expiry >= 0)
+	{
+		Spec.it_value.tv_sec = Expiry/time_freq();
+		Spec.it_value.tv_nsec = (Expiry%time_freq())*(1000000000/time_freq());
+		// zero would disarm the timer
+		if(!Spec.it_value.tv_sec && !Spec.it_value.tv_nsec)
+			Spec.it_value.tv_nsec = 1;
+	}
+	timerfd_settime(m_TimerFd, TFD_TIMER_ABSTIME, &Spec, 0);
+	m_ArmedExpiry = Expiry;
+}
+
+void CNetBase::WatchFd(int Fd, bool Watch)
+{
+	if(m_EpollFd < 0)
+		return;
+	struct epoll_event Event;
+	mem_zero(&Event, sizeof(Event));
+	Event.events = EPOLLIN;
+	Event.data.fd = Fd;
+	epoll_ctl(m_EpollFd, Watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, Fd, &Event);
+}
+
+void CNetBase::SetBusyPoll(int SpinUs)
+{
+	m_SpinTime = SpinUs > 0 ? time_freq()*SpinUs/1000000 : 0;
+	if(m_Socket.type)
+		net_udp_set_busy_poll(m_Socket, SpinUs > 0 ? SpinUs : 0);
+}
+
+int CNetBase::Wait(int TimeoutMs)
+{
+	// the rest of the last batch doesn't show up on the socket
+	if(m_RecvIndex < m_NumRecv || m_GroIndex < m_NumGro || (m_Uring.Active() && m_Uring.Pending()))
+		return 1;
+	if(m_EpollFd < 0)
+		return -1;
+
+	if(m_SpinTime && TimeoutMs != 0)
+	{
+		int64_t Now = time_get();
+		int64_t End = Now + m_SpinTime;
+		if(TimeoutMs > 0 && End > Now + time_freq()*TimeoutMs/1000)
+			End = Now + time_freq()*TimeoutMs/1000;
+		int64_t Expiry = m_Timers.NextExpiry();
+		if(Expiry >= 0 && End > Expiry)
+			End = Expiry;
+
+		// whatever arrives is kept in the receive batch for UnpackPacket
+		while(Now < End)
+		{
+			m_RecvTypes = m_Socket.type&NETTYPE_ALL;
+			if(RecvBatch())
+				return 1;
+			// lets the sender run if it shares the core
+			sched_yield();
+			Now = time_get();
+		}
+		if(Expiry >= 0 && Now >= Expiry)
+			return 1;
+		if(TimeoutMs > 0)
+		{
+			TimeoutMs -= (int)(m_SpinTime*1000/time_freq());
+			if(TimeoutMs <= 0)
+				return 0;
+		}
+	}
+
+	ArmWakeup();
+	// the sockets, the timer fd and one watched fd
+	struct epoll_event aEvents[4];
+	int Result = epoll_wait(m_EpollFd, aEvents, 4, TimeoutMs < 0 ? -1 : TimeoutMs);
+	if(Result < 0)
+	{
+		// the completions of the ring are posted by interrupting the wait
+		if(errno == EINTR)
+			return m_Uring.Active() && m_Uring.Pending() ? 1 : 0;
+		return -1;
+	}
+	// the next receive only asks the sockets that are readable
+	m_RecvTypes = 0;
+	for(int i = 0; i < Result; i++)
+	{
+		if(aEvents[i].data.fd == m_Socket.ipv4sock)
+			m_RecvTypes |= NETTYPE_IPV4;
+		else if(aEvents[i].data.fd == m_Socket.ipv6sock)
+			m_RecvTypes |= NETTYPE_IPV6;
+	}
+	return Result;
+}
+
+void CNetBase::SendPacket(const NETADDR *pAddr, CNetPacketConstruct *pPacket, CNetCompressionPolicy *pPolicy)
+{
+	if(!m_pBatchBuffers)
+		return;
+	if(m_NumSend == NET_BATCH_SIZE)
+		FlushSend();
+
+	// the packet is built right in its place in the batch
+	NETPACKET *pSend = &m_aSendBatch[m_NumSend];
+	unsigned char *aBuffer = (unsigned char *)pSend->data;
 	int CompressedSize = -1;
 	int FinalSize = -1;
 
-	// compress if not ctrl msg
-	if(!(pPacket->m_Flags&NET_PACKETFLAG_CONTROL))
-		CompressedSize = g_Huffman.Compress(pPacket->m_aChunkData, pPacket->m_DataSize, &aBuffer[NET_PACKETHEADERSIZE], NET_MAX_PAYLOAD);
+	// compress if not ctrl msg and the size estimate says it pays off
+	if(!(pPacket->m_Flags&NET_PACKETFLAG_CONTROL) && (!pPolicy || pPolicy->ShouldTry(pPacket->m_DataSize)))
+	{
+		if(g_Huffman.CompressedSize(pPacket->m_aChunkData, pPacket->m_DataSize, pPacket->m_DataSize) < pPacket->m_DataSize)
+			CompressedSize = g_Huffman.Compress(pPacket->m_aChunkData, pPacket->m_DataSize, &aBuffer[NET_PACKETHEADERSIZE], NET_MAX_PAYLOAD);
+		if(pPolicy)
+			pPolicy->Update(pPacket->m_DataSize, CompressedSize > 0);
+	}
 
 	// check if the compression was enabled, successful and good enough
 	if(CompressedSize > 0 && CompressedSize < pPacket->m_DataSize)
@@ -157,50 +713,45 @@ void SendPacket(const NETADDR *pAddr, CNetPacketConstruct *pPacket)
 		aBuffer[i++] = (pPacket->m_Token>>8)&0xff;
 		aBuffer[i++] = (pPacket->m_Token)&0xff;
 
-		net_udp_send(g_Socket, pAddr, aBuffer, FinalSize);
+		pSend->addr = *pAddr;
+		pSend->size = FinalSize;
+		m_NumSend++;
+
+#if !defined(CONF_NO_PACKETLOG)
+		if(m_Trace.Active())
+			m_Trace.Add(NET_TRACE_SEND, pAddr, aBuffer, FinalSize);
+		if(m_Capture.Active())
+			m_Capture.Write(NET_TRACE_SEND, pAddr, aBuffer, FinalSize);
+		if(m_LogLevel > NET_LOG_NONE)
+			LogPacket(NET_TRACE_SEND, pAddr, FinalSize, pPacket, pPacket->m_aChunkData);
+#endif
 	}
 	else
 		dbg_msg("libtwnetwork", "Could not send packet with FinalSize=%d", FinalSize);
 }
 
-extern "C" {
-
-void Connect(const char *pIp, int Port)
-{
-	init_network();
-	dbg_msg("libtwnetwork", "connecting to ip=%s port=%d", pIp, Port);
-	if(net_addr_from_str(&g_ServerAddr, pIp) != 0)
-	{
-		dbg_msg("libtwnetwork", "could not find the address of %s, connecting to localhost", pIp);
-		net_host_lookup("localhost", &g_ServerAddr, g_Socket.type);
-	}
-	g_ServerAddr.port = Port;
-}
-
-void Send(CNetPacketConstruct *pPacket)
-{
-	SendPacket(&g_ServerAddr, pPacket);
-}
+/*
+	Function: ParsePacket
+		Parses a received packet.
 
-void SendSample()
-{
-	int ExtraSize = sizeof(g_aRequestTokenBuf);
-	CNetPacketConstruct Construct;
-	Construct.m_Token = NET_TOKEN_NONE;
-	Construct.m_Flags = NET_PACKETFLAG_CONTROL;
-	Construct.m_Ack = 0;
-	Construct.m_NumChunks = 0;
-	Construct.m_DataSize = 1+ExtraSize;
-	Construct.m_aChunkData[0] = NET_CTRLMSG_TOKEN;
+	Parameters:
+		pBuffer - The received datagram
+		Size - Size of the datagram
+		pPacket - Receives the header and, if needed, the payload
+		ppData - Receives a pointer to the payload, 0 to copy it into pPacket->m_aChunkData
 
-	SendPacket(&g_ServerAddr, &Construct);
-}
+	Returns:
+		0 on success, -1 if the packet is invalid.
 
-int UnpackPacket(NETADDR *pAddr, unsigned char *pBuffer, CNetPacketConstruct *pPacket)
+	Remarks:
+		- With ppData the payload is only copied if it has to be decompressed.
+		  *ppData then points into pBuffer for uncompressed packets and into
+		  pPacket->m_aChunkData for compressed ones, so it stays valid as long as
+		  neither of them is reused for the next packet.
+*/
+int ParsePacket(unsigned char *pBuffer, int Size, CNetPacketConstruct *pPacket, const unsigned char **ppData)
 {
-	int Size = net_udp_recv(g_Socket, pAddr, pBuffer, NET_MAX_PACKETSIZE);
-	if(Size <= 0)
-		return 1;
+	const unsigned char *pData = pPacket->m_aChunkData;
 
 	if(Size < NET_PACKETHEADERSIZE || Size > NET_MAX_PACKETSIZE)
 	{
@@ -233,7 +784,10 @@ int UnpackPacket(NETADDR *pAddr, unsigned char *pBuffer, CNetPacketConstruct *pP
 		// TTTTTTTT TTTTTTTT TTTTTTTT TTTTTTTT
 		pPacket->m_ResponseToken = (pBuffer[5]<<24) | (pBuffer[6]<<16) | (pBuffer[7]<<8) | pBuffer[8];
 		// RRRRRRRR RRRRRRRR RRRRRRRR RRRRRRRR
-		mem_copy(pPacket->m_aChunkData, &pBuffer[NET_PACKETHEADERSIZE_CONNLESS], pPacket->m_DataSize);
+		if(ppData)
+			pData = &pBuffer[NET_PACKETHEADERSIZE_CONNLESS];
+		else
+			mem_copy(pPacket->m_aChunkData, &pBuffer[NET_PACKETHEADERSIZE_CONNLESS], pPacket->m_DataSize);
 	}
 	else
 	{
@@ -255,6 +809,8 @@ int UnpackPacket(NETADDR *pAddr, unsigned char *pBuffer, CNetPacketConstruct *pP
 
 		if(pPacket->m_Flags&NET_PACKETFLAG_COMPRESSION)
 			pPacket->m_DataSize = g_Huffman.Decompress(&pBuffer[NET_PACKETHEADERSIZE], pPacket->m_DataSize, pPacket->m_aChunkData, sizeof(pPacket->m_aChunkData));
+		else if(ppData)
+			pData = &pBuffer[NET_PACKETHEADERSIZE];
 		else
 			mem_copy(pPacket->m_aChunkData, &pBuffer[NET_PACKETHEADERSIZE], pPacket->m_DataSize);
 	}
@@ -271,99 +827,524 @@ int UnpackPacket(NETADDR *pAddr, unsigned char *pBuffer, CNetPacketConstruct *pP
 	{
 		if(pPacket->m_DataSize >= 5) // control byte + token
 		{
-			if(pPacket->m_aChunkData[0] == NET_CTRLMSG_CONNECT
-				|| pPacket->m_aChunkData[0] == NET_CTRLMSG_TOKEN)
+			if(pData[0] == NET_CTRLMSG_CONNECT
+				|| pData[0] == NET_CTRLMSG_TOKEN)
 			{
-				pPacket->m_ResponseToken = (pPacket->m_aChunkData[1]<<24) | (pPacket->m_aChunkData[2]<<16)
-					| (pPacket->m_aChunkData[3]<<8) | pPacket->m_aChunkData[4];
+				pPacket->m_ResponseToken = (pData[1]<<24) | (pData[2]<<16)
+					| (pData[3]<<8) | pData[4];
 			}
 		}
 	}
 
-	// chiller debug start
-	char aAddrStr[NETADDR_MAXSTRSIZE];
-	net_addr_str(pAddr, aAddrStr, sizeof(aAddrStr), true);
-	if(str_startswith(aAddrStr, "[0:0:0:0:0:0:0:1]:") || str_startswith(aAddrStr, "127.0.0.1:"))
-	{
-		char aFlags[512];
-		aFlags[0] = '\0';
-		if(pPacket->m_Flags&NET_PACKETFLAG_CONTROL)
-			str_append(aFlags, "CONTROL", sizeof(aFlags));
-		if(pPacket->m_Flags&NET_PACKETFLAG_RESEND)
-			str_append(aFlags, aFlags[0] ? "|RESEND" : "RESEND", sizeof(aFlags));
-		if(pPacket->m_Flags&NET_PACKETFLAG_COMPRESSION)
-			str_append(aFlags, aFlags[0] ? "|COMPRESSION" : "COMPRESSION", sizeof(aFlags));
-		if(pPacket->m_Flags&NET_PACKETFLAG_CONNLESS)
-			str_append(aFlags, aFlags[0] ? "|CONNLESS" : "CONNLESS", sizeof(aFlags));
-		char aBuf[512];
-		aBuf[0] = '\0';
-		if(aFlags[0])
-			str_format(aBuf, sizeof(aBuf), " (%s)", aFlags);
-		char aHexData[1024];
-		str_hex(aHexData, sizeof(aHexData), pPacket->m_aChunkData, pPacket->m_DataSize);
-		char aRawData[1024];
-		for(int i = 0; i < pPacket->m_DataSize; i++)
-			aRawData[i] = pPacket->m_aChunkData[i] < 32 ? '.' : pPacket->m_aChunkData[i];
-		dbg_msg("network", "%s size=%d flags=%d%s", aAddrStr, Size, pPacket->m_Flags, aBuf);
-		dbg_msg("network", "  data: %s", aHexData);
-		dbg_msg("network", "  data_raw: %s", aRawData);
-	}
-	// chiller debug end
+	if(ppData)
+		*ppData = pData;
 	return 0;
 }
 
-// CNetRecvUnpacker::m_Data
-CNetPacketConstruct g_Data;
-// CNetRecvUnpacker::m_aBuffer
-unsigned char g_aBuffer[NET_MAX_PACKETSIZE];
+// receives the next batch once the last one was handed out, returns
+// how many datagrams are left in it
+int CNetBase::RecvBatch()
+{
+	if(m_RecvIndex < m_NumRecv)
+		return m_NumRecv - m_RecvIndex;
+	if(!m_pBatchBuffers)
+		return 0;
+	m_RecvIndex = 0;
+	if(m_Uring.Active())
+	{
+		m_NumRecv = m_Uring.Recv(m_aRecvBatch, NET_BATCH_SIZE);
+		return m_NumRecv;
+	}
+	if(m_pGroBuffers)
+		return RecvGroBatch();
+	for(int i = 0; i < NET_BATCH_SIZE; i++)
+		m_aRecvBatch[i].size = NET_MAX_PACKETSIZE;
+	m_NumRecv = net_udp_recv_batch(m_Socket, m_aRecvBatch, NET_BATCH_SIZE, &m_RecvTypes);
+	return m_NumRecv;
+}
+
+// fills the batch with the datagrams of the coalesced receives
+int CNetBase::RecvGroBatch()
+{
+	m_NumRecv = 0;
+	while(m_NumRecv < NET_BATCH_SIZE)
+	{
+		if(m_GroIndex == m_NumGro)
+		{
+			// the batch may still point into the buffers
+			if(m_NumRecv)
+				break;
+			for(int i = 0; i < NET_GRO_BUFFERS; i++)
+				m_aGroRecv[i].size = NET_GRO_BUFFER_SIZE;
+			m_NumGro = net_udp_recv_batch_gro(m_Socket, m_aGroRecv, m_aGroSegments, NET_GRO_BUFFERS, &m_RecvTypes);
+			m_GroIndex = 0;
+			m_GroOffset = 0;
+			if(!m_NumGro)
+				break;
+		}
 
+		const NETPACKET *pGro = &m_aGroRecv[m_GroIndex];
+		int Offset = m_GroOffset;
+		int Size = pGro->size - Offset;
+		if(m_aGroSegments[m_GroIndex] > 0 && Size > m_aGroSegments[m_GroIndex])
+			Size = m_aGroSegments[m_GroIndex];
+		m_GroOffset += Size;
+		if(m_GroOffset >= pGro->size)
+		{
+			m_GroIndex++;
+			m_GroOffset = 0;
+		}
 
-int FetchChunk(CNetChunk *pChunk)
+		// the gro buffers take datagrams of any size, the plain receive
+		// truncates what doesn't fit into NET_MAX_PACKETSIZE. those are
+		// dropped here
+		if(Size > NET_MAX_PACKETSIZE)
+			continue;
+		NETPACKET *pRecv = &m_aRecvBatch[m_NumRecv++];
+		pRecv->addr = pGro->addr;
+		pRecv->data = (unsigned char *)pGro->data + Offset;
+		pRecv->size = Size;
+	}
+	return m_NumRecv;
+}
+
+// takes the next datagram of the receive batch, see ParsePacket for *ppData
+int CNetBase::UnpackPacket(NETADDR *pAddr, CNetPacketConstruct *pPacket, const unsigned char **ppData)
 {
-	CNetChunkHeader Header;
-	unsigned char *pEnd = g_Data.m_aChunkData + g_Data.m_DataSize;
-	while(1)
+	// the datagrams of a batch stay untouched until all of them were
+	// handed out, the next batch is received over them
+	if(m_RecvIndex == m_NumRecv && !RecvBatch())
+		return 1;
+
+	NETPACKET *pRecv = &m_aRecvBatch[m_RecvIndex++];
+	*pAddr = pRecv->addr;
+	return UnpackDatagram(pAddr, (unsigned char *)pRecv->data, pRecv->size, pPacket, ppData);
+}
+
+// the part of UnpackPacket after the socket, replays enter here
+int CNetBase::UnpackDatagram(const NETADDR *pAddr, unsigned char *pBuffer, int Size, CNetPacketConstruct *pPacket, const unsigned char **ppData)
+{
+#if !defined(CONF_NO_PACKETLOG)
+	// traced before parsing, broken packets are interesting too
+	if(m_Trace.Active())
+		m_Trace.Add(NET_TRACE_RECV, pAddr, pBuffer, Size);
+	if(m_Capture.Active())
+		m_Capture.Write(NET_TRACE_RECV, pAddr, pBuffer, Size);
+#else
+	(void)pAddr;
+#endif
+
+	const unsigned char *pData;
+	if(ParsePacket(pBuffer, Size, pPacket, &pData) != 0)
+		return -1;
+	if(ppData)
+		*ppData = pData;
+	else if(pData != pPacket->m_aChunkData)
+		mem_copy(pPacket->m_aChunkData, pData, pPacket->m_DataSize);
+
+#if !defined(CONF_NO_PACKETLOG)
+	if(m_LogLevel > NET_LOG_NONE)
+		LogPacket(NET_TRACE_RECV, pAddr, Size, pPacket, pData);
+#endif
+	return 0;
+}
+
+void CNetBase::LogPacket(int Direction, const NETADDR *pAddr, int Size, const CNetPacketConstruct *pPacket, const unsigned char *pData)
+{
+	char aAddrStr[NETADDR_MAXSTRSIZE];
+	net_addr_str(pAddr, aAddrStr, sizeof(aAddrStr), true);
+	char aFlags[64];
+	aFlags[0] = '\0';
+	if(pPacket->m_Flags&NET_PACKETFLAG_CONTROL)
+		str_append(aFlags, "CONTROL", sizeof(aFlags));
+	if(pPacket->m_Flags&NET_PACKETFLAG_RESEND)
+		str_append(aFlags, aFlags[0] ? "|RESEND" : "RESEND", sizeof(aFlags));
+	if(pPacket->m_Flags&NET_PACKETFLAG_COMPRESSION)
+		str_append(aFlags, aFlags[0] ? "|COMPRESSION" : "COMPRESSION", sizeof(aFlags));
+	if(pPacket->m_Flags&NET_PACKETFLAG_CONNLESS)
+		str_append(aFlags, aFlags[0] ? "|CONNLESS" : "CONNLESS", sizeof(aFlags));
+	char aBuf[128];
+	aBuf[0] = '\0';
+	if(aFlags[0])
+		str_format(aBuf, sizeof(aBuf), " (%s)", aFlags);
+	dbg_msg("network", "%s %s size=%d flags=%d%s", Direction == NET_TRACE_SEND ? "send" : "recv", aAddrStr, Size, pPacket->m_Flags, aBuf);
+
+	if(m_LogLevel < NET_LOG_PAYLOAD)
+		return;
+	char aHexData[1024];
+	str_hex(aHexData, sizeof(aHexData), pData, pPacket->m_DataSize);
+	char aRawData[NET_MAX_PACKETSIZE+1];
+	for(int i = 0; i < pPacket->m_DataSize; i++)
+		aRawData[i] = pData[i] < 32 ? '.' : pData[i];
+	aRawData[pPacket->m_DataSize] = '\0';
+	dbg_msg("network", "  data: %s", aHexData);
+	dbg_msg("network", "  data_raw: %s", aRawData);
+}
+
+int CNetBase::StartCapture(const char *pFilename)
+{
+#if !defined(CONF_NO_PACKETLOG)
+	// the local side of the made up ip headers, the address is only
+	// known if the socket was bound to one
+	NETADDR aLocalAddr[2];
+	int aSockets[2] = { m_Socket.ipv4sock, m_Socket.ipv6sock };
+	for(int i = 0; i < 2; i++)
 	{
-		unsigned char *pData = g_Data.m_aChunkData;
+		mem_zero(&aLocalAddr[i], sizeof(aLocalAddr[i]));
+		aLocalAddr[i].type = i == 0 ? NETTYPE_IPV4 : NETTYPE_IPV6;
+		struct sockaddr_storage Addr;
+		socklen_t AddrLen = sizeof(Addr);
+		if(aSockets[i] >= 0 && getsockname(aSockets[i], (struct sockaddr *)&Addr, &AddrLen) == 0)
+			sockaddr_to_netaddr((struct sockaddr *)&Addr, &aLocalAddr[i]);
+	}
+	return m_Capture.Open(pFilename, &aLocalAddr[0], &aLocalAddr[1]);
+#else
+	(void)pFilename;
+	return -1;
+#endif
+}
 
-		// TODO: this is incomplete
-		pData = Header.Unpack(pData);
+int CNetBase::EnableTrace(int NumRecords)
+{
+#if !defined(CONF_NO_PACKETLOG)
+	if(NumRecords <= 0)
+	{
+		m_Trace.Free();
 		return 0;
 	}
-	return 0;
+	return m_Trace.Init(NumRecords);
+#else
+	(void)NumRecords;
+	return -1;
+#endif
 }
 
-int Recv(CNetChunk *pChunk, TOKEN *pResponseToken)
+extern "C" {
+
+/*
+	Function: Create
+		Opens a socket for up to MaxConnections connections.
+
+	Returns:
+		A handle for the other functions or 0 on error. Each handle must
+		only be used by one thread at a time, unless StartIoThread runs
+		it.
+*/
+CNetClient *Create(int MaxConnections)
 {
-	while(1)
+	NETADDR BindAddr;
+	mem_zero(&BindAddr, sizeof(BindAddr));
+	BindAddr.type = NETTYPE_ALL;
+
+	CNetClient *pClient = new CNetClient();
+	if(pClient->Open(BindAddr, MaxConnections, 0) != 0)
 	{
-		// check for a chunk
-		if(FetchChunk(pChunk))
-			return 1;
+		dbg_msg("libtwnetwork", "could not open a socket for %d connections", MaxConnections);
+		delete pClient;
+		return 0;
+	}
+	return pClient;
+}
 
-		NETADDR Addr;
-		unsigned char aBuffer[NET_MAX_PACKETSIZE];
-		int Result = UnpackPacket(&Addr, g_aBuffer, &g_Data);
-		// no more packets for now
-		if(Result > 0)
-			break;
+void Destroy(CNetClient *pClient)
+{
+	delete pClient;
+}
 
-		if(!Result)
-		{
-			return 0; // TODO: implement this
-		}
+static void LookupAddr(NETADDR *pAddr, const char *pIp, int Port)
+{
+	if(net_addr_from_str(pAddr, pIp) != 0)
+	{
+		dbg_msg("libtwnetwork", "could not find the address of %s, connecting to localhost", pIp);
+		net_host_lookup("localhost", pAddr, NETTYPE_IPV4);
 	}
-	return 0;
+	pAddr->port = Port;
+}
+
+// returns the connection id or -1
+int Connect(CNetClient *pClient, const char *pIp, int Port)
+{
+	dbg_msg("libtwnetwork", "connecting to ip=%s port=%d", pIp, Port);
+	NETADDR Addr;
+	LookupAddr(&Addr, pIp, Port);
+	CNetIoPause Pause(pClient);
+	return pClient->Connect(&Addr);
+}
+
+void Disconnect(CNetClient *pClient, int ConnID, const char *pReason)
+{
+	CNetIoPause Pause(pClient);
+	pClient->Disconnect(ConnID, pReason);
+}
+
+int Send(CNetClient *pClient, int ConnID, const void *pData, int DataSize, int Flags)
+{
+	if(pClient->IoThread())
+		return pClient->IoThread()->Send(ConnID, pData, DataSize, Flags);
+	return pClient->Send(ConnID, pData, DataSize, Flags);
 }
 
-void PumpNetwork()
+int Recv(CNetClient *pClient, CNetChunk *pChunk, TOKEN *pResponseToken)
 {
+	if(pClient->IoThread())
+		return pClient->IoThread()->Recv(pChunk, pResponseToken);
+	return pClient->Recv(pChunk, pResponseToken);
+}
+
+int ConnectionState(CNetClient *pClient, int ConnID)
+{
+	if(pClient->IoThread())
+		return pClient->IoThread()->ConnState(ConnID);
+	CNetConnection *pConn = pClient->Connection(ConnID);
+	return pConn ? pConn->State() : -1;
+}
+
+// the string stays valid until the next call on the same thread
+const char *ConnectionError(CNetClient *pClient, int ConnID)
+{
+	static __thread char s_aError[128];
+	CNetIoPause Pause(pClient);
+	CNetConnection *pConn = pClient->Connection(ConnID);
+	str_copy(s_aError, pConn ? pConn->ErrorString() : "", sizeof(s_aError));
+	return s_aError;
+}
+
+void SetFlushDelay(CNetClient *pClient, int ConnID, int Milliseconds)
+{
+	CNetIoPause Pause(pClient);
+	CNetConnection *pConn = pClient->Connection(ConnID);
+	if(pConn)
+		pConn->SetFlushDelay(time_freq()*Milliseconds/1000);
+}
+
+// see the NET_LOG_* levels
+void SetLogLevel(CNetClient *pClient, int Level)
+{
+	CNetIoPause Pause(pClient);
+	pClient->SetLogLevel(Level);
+}
+
+// keeps the last NumRecords datagrams for DumpTrace, 0 stops tracing
+int EnableTrace(CNetClient *pClient, int NumRecords)
+{
+	CNetIoPause Pause(pClient);
+	return pClient->EnableTrace(NumRecords);
+}
+
+// may be called from another thread than the one pumping the client,
+// also while EnableTrace runs
+int DumpTrace(CNetClient *pClient, const char *pFilename)
+{
+	return pClient->DumpTrace(pFilename);
+}
+
+// see CNetPcapWriter
+int StartCapture(CNetClient *pClient, const char *pFilename)
+{
+	CNetIoPause Pause(pClient);
+	return pClient->StartCapture(pFilename);
+}
+
+void StopCapture(CNetClient *pClient)
+{
+	CNetIoPause Pause(pClient);
+	pClient->StopCapture();
+}
+
+void PumpNetwork(CNetClient *pClient)
+{
+	// only connections with expired timers get touched, the I/O thread
+	// runs them by itself
+	if(!pClient->IoThread())
+		pClient->Update();
+
 	CNetChunk Packet;
-	while(Recv(&Packet, 0))
+	while(Recv(pClient, &Packet, 0))
 	{
 		// if(!(Packet.m_Flags&NETSENDFLAG_CONNLESS))
 		// 	ProcessServerPacket(&Packet);
 	}
 }
 
+/*
+	Function: WaitNetwork
+		Sleeps until PumpNetwork has something to do: a datagram arrived
+		or a timer of a connection is due.
+
+	Parameters:
+		TimeoutMs - Longest time to sleep, -1 to wait without a limit.
+
+	Returns:
+		>0 if PumpNetwork should be called, 0 on timeout, -1 on error.
+*/
+int WaitNetwork(CNetClient *pClient, int TimeoutMs)
+{
+	if(pClient->IoThread())
+		return pClient->IoThread()->Wait(TimeoutMs);
+	return pClient->Wait(TimeoutMs);
+}
+
+/*
+	Function: NetworkFd
+		An fd that is readable as long as PumpNetwork has something to
+		do, for event loops that wait on many fds.
+
+	Remarks:
+		- It's only to poll on, never read from it or close it.
+		- The fd follows the timers after every call into the handle, so
+		  nothing else has to be done with it. Call PumpNetwork when it's
+		  readable.
+*/
+int NetworkFd(CNetClient *pClient)
+{
+	if(pClient->IoThread())
+		return pClient->IoThread()->EventFd();
+	pClient->ArmWakeup();
+	return pClient->WaitFd();
+}
+
+/*
+	Function: SetBusyPoll
+		Makes WaitNetwork spin on the sockets for SpinUs microseconds
+		before it sleeps, and lets the kernel busy poll the device queue
+		as well. 0 turns it off.
+
+	Remarks:
+		- For bots where the reaction time counts, an idle bot keeps a
+		  core busy with it. Best combined with PinThread.
+*/
+void SetBusyPoll(CNetClient *pClient, int SpinUs)
+{
+	CNetIoPause Pause(pClient);
+	pClient->SetBusyPoll(SpinUs);
+}
+
+/*
+	Function: SetIoBackend
+		Switches the handle between the socket calls and io_uring, see
+		the NET_BACKEND_* values.
+
+	Returns:
+		The backend in use, NET_BACKEND_SOCKET if io_uring isn't available.
+
+	Remarks:
+		- Best called right after Create, datagrams that were received
+		  but not pumped yet are dropped.
+*/
+int SetIoBackend(CNetClient *pClient, int Backend)
+{
+	CNetIoPause Pause(pClient);
+	return pClient->SetBackend(Backend);
+}
+
+/*
+	Function: EnableGro
+		Receives the datagrams of a peer coalesced with UDP_GRO and splits
+		them up again, one receive for a whole burst.
+
+	Returns:
+		0 on success, -1 if the system doesn't support it or the handle
+		uses io_uring.
+
+	Remarks:
+		- Takes NET_GRO_BUFFERS*64 KiB for the receive buffers.
+		- Sending with UDP_SEGMENT needs nothing, it's used when available.
+*/
+int EnableGro(CNetClient *pClient, int Enable)
+{
+	CNetIoPause Pause(pClient);
+	return pClient->EnableGro(Enable != 0);
+}
+
+/*
+	Function: CreateShards
+		Opens NumShards handles for up to MaxConnections connections
+		each, to be pumped by one worker thread per shard.
+
+	Parameters:
+		Port - 0 gives every shard its own port. Otherwise all shards
+		share it and the kernel steers the datagrams of a server to the
+		shard ShardOf names for it.
+
+	Returns:
+		0 on error.
+
+	Remarks:
+		- Shard gives the handle of a shard, it works with all other
+		  functions but must only be used by its worker.
+		- A worker can pin itself with PinThread.
+*/
+CNetShards *CreateShards(int NumShards, int MaxConnections, int Port)
+{
+	CNetShards *pShards = new CNetShards();
+	if(pShards->Open(NumShards, MaxConnections, Port) != 0)
+	{
+		dbg_msg("libtwnetwork", "could not open %d shards on port %d", NumShards, Port);
+		delete pShards;
+		return 0;
+	}
+	return pShards;
+}
+
+// closes the shards and their handles, the workers have to be stopped
+void DestroyShards(CNetShards *pShards)
+{
+	delete pShards;
+}
+
+// the handle of a shard, 0 if Index isn't valid
+CNetClient *Shard(CNetShards *pShards, int Index)
+{
+	return pShards->Shard(Index);
+}
+
+// the shard that connects to the server, connections of a server are kept together
+int ShardOf(CNetShards *pShards, const char *pIp, int Port)
+{
+	NETADDR Addr;
+	LookupAddr(&Addr, pIp, Port);
+	return pShards->ShardOf(&Addr);
+}
+
+/*
+	Function: StartIoThread
+		Runs the handle on a thread of its own, pinned to Cpu unless it's
+		-1. The thread receives, acks, resends and keeps the connections
+		alive, the protocol timing doesn't depend on the caller anymore.
+
+	Returns:
+		0 on success, -1 on error or if the thread runs already.
+
+	Remarks:
+		- Send and Recv go through lock-free queues. Send may be called
+		  from any thread then, Recv, PumpNetwork and WaitNetwork from
+		  one at a time.
+		- PumpNetwork only takes the received chunks. NetworkFd is
+		  readable while there are some, call NetworkFd again after
+		  starting the thread.
+		- The other functions park the thread while they run.
+*/
+int StartIoThread(CNetClient *pClient, int Cpu)
+{
+	return pClient->StartIoThread(Cpu);
+}
+
+// the caller runs the handle again, chunks that weren't received are dropped
+void StopIoThread(CNetClient *pClient)
+{
+	pClient->StopIoThread();
+}
+
+// pins the calling thread, the one pumping the handles, to a cpu. -1 unpins it
+int PinThread(int Cpu)
+{
+	return thread_pin_cpu(Cpu);
+}
+
+// runs the calling thread under SCHED_FIFO, 0 switches back. see thread_set_realtime
+int SetRealtime(int Priority)
+{
+	return thread_set_realtime(Priority);
+}
+
 }
@@ -56,6 +56,7 @@ enum
 	NETBANTYPE_DROP=2,
 
 	NETCREATE_FLAG_RANDOMPORT=1,
+	NETCREATE_FLAG_REUSEPORT=2, // the port is shared with the other shards, see CNetShards
 };
 
 
@@ -86,6 +87,23 @@ enum
 	NET_TOKENCACHE_SIZE = 64,
 	NET_TOKENCACHE_ADDRESSEXPIRY = NET_SEEDTIME,
 	NET_TOKENCACHE_PACKETEXPIRY = 5,
+
+	// datagrams per recvmmsg/sendmmsg
+	NET_BATCH_SIZE = 32,
+	// coalesced receives per recvmmsg, each takes NET_GRO_BUFFER_SIZE
+	NET_GRO_BUFFERS = 4,
+
+	// queues of CNetIoThread
+	NET_THREAD_COMMANDS = 256,
+	NET_THREAD_EVENT_BYTES = 256*1024,
+};
+
+// how a CNetBase talks to its socket
+enum
+{
+	NET_BACKEND_SOCKET=0, // recvmmsg/sendmmsg
+	NET_BACKEND_URING, // see CNetUring
+	NET_BACKEND_URING_SQPOLL,
 };
 enum
 {
@@ -125,6 +143,18 @@ enum
 
 	NET_CONN_BUFFERSIZE=1024*32,
 
+	// resend timeout in milliseconds
+	NET_RTO_INITIAL=1000,
+	NET_RTO_MIN=100,
+	NET_RTO_MAX=4000,
+	NET_RESEND_GIVEUP=10000, // a vital chunk not acked after this breaks the connection
+
+	// connection timers in milliseconds
+	NET_KEEPALIVE_INTERVAL=500,
+	NET_CONN_TIMEOUT=100000,
+	NET_CONNECT_RETRY=500,
+	NET_CONNECT_TIMEOUT=10000,
+
 	NET_ENUM_TERMINATOR
 };
 
@@ -160,7 +190,7 @@ public:
 		}
 		return pData + 2;
 	}
-	unsigned char *Unpack(unsigned char *pData)
+	const unsigned char *Unpack(const unsigned char *pData)
 	{
 		m_Flags = (pData[0]>>6)&0x03;
 		m_Size = ((pData[0]&0x3F)<<6) | (pData[1]&0x3F);
@@ -197,3 +227,1229 @@ public:
 	int m_DataSize;
 	unsigned char m_aChunkData[NET_MAX_PAYLOAD];
 };
+
+// decides per destination whether trying to compress a packet is worth it.
+// packets are put into classes by payload size, a class that keeps failing
+// to get smaller is skipped for a while and then probed again.
+class CNetCompressionPolicy
+{
+	enum
+	{
+		NUM_CLASSES=4,
+		MAX_MISSES=8, // failed tries in a row before a class gets skipped
+		MIN_BACKOFF=16, // packets skipped before the first probe
+		MAX_BACKOFF=1024,
+	};
+
+	struct CClass
+	{
+		int m_Misses;
+		int m_Skip;
+		int m_Backoff;
+	};
+
+	CClass m_aClasses[NUM_CLASSES];
+
+	static int Class(int DataSize)
+	{
+		if(DataSize < 32)
+			return 0;
+		if(DataSize < 128)
+			return 1;
+		if(DataSize < 512)
+			return 2;
+		return 3;
+	}
+
+public:
+	CNetCompressionPolicy() { Reset(); }
+
+	void Reset()
+	{
+		for(int i = 0; i < NUM_CLASSES; i++)
+		{
+			m_aClasses[i].m_Misses = 0;
+			m_aClasses[i].m_Skip = 0;
+			m_aClasses[i].m_Backoff = MIN_BACKOFF;
+		}
+	}
+
+	// returns false while the class of the packet is skipped
+	bool ShouldTry(int DataSize)
+	{
+		CClass *pClass = &m_aClasses[Class(DataSize)];
+		if(pClass->m_Skip > 0)
+		{
+			pClass->m_Skip--;
+			return false;
+		}
+		return true;
+	}
+
+	// reports whether a tried packet got smaller
+	void Update(int DataSize, bool Compressed)
+	{
+		CClass *pClass = &m_aClasses[Class(DataSize)];
+		if(Compressed)
+		{
+			pClass->m_Misses = 0;
+			pClass->m_Backoff = MIN_BACKOFF;
+			return;
+		}
+
+		// a failed probe doubles the backoff
+		if(++pClass->m_Misses < MAX_MISSES)
+			return;
+		if(pClass->m_Misses > MAX_MISSES && pClass->m_Backoff < MAX_BACKOFF)
+			pClass->m_Backoff *= 2;
+		pClass->m_Skip = pClass->m_Backoff;
+	}
+};
+
+// keeps track of the vital chunks received from a peer. vital chunks are
+// only accepted in order, so the received sequences are always the ack and
+// the half of the sequence space before it. a set bit in m_aBackroom means
+// the same as CNetBase::IsSeqInBackroom(Seq, m_Ack) upstream
+class CNetSequenceWindow
+{
+	enum
+	{
+		NUM_WORDS=NET_MAX_SEQUENCE/64,
+	};
+
+	uint64_t m_aBackroom[NUM_WORDS];
+
+	void Set(int Seq) { m_aBackroom[Seq>>6] |= (uint64_t)1<<(Seq&63); }
+	void Unset(int Seq) { m_aBackroom[Seq>>6] &= ~((uint64_t)1<<(Seq&63)); }
+	bool IsSet(int Seq) const { return (m_aBackroom[Seq>>6]>>(Seq&63))&1; }
+
+public:
+	enum
+	{
+		SEQUENCE_NEXT=0, // in order, the ack moved forward
+		SEQUENCE_OLD, // already received
+		SEQUENCE_MISSING, // chunks before it got lost
+	};
+
+	int m_Ack;
+	bool m_ResendRequested;
+
+	CNetSequenceWindow() { Reset(); }
+
+	void Reset()
+	{
+		m_Ack = 0;
+		m_ResendRequested = false;
+		mem_zero(m_aBackroom, sizeof(m_aBackroom));
+		for(int i = 0; i <= NET_MAX_SEQUENCE/2; i++)
+			Set((m_Ack-i)&NET_SEQUENCE_MASK);
+	}
+
+	int Feed(int Sequence)
+	{
+		int Next = (m_Ack+1)&NET_SEQUENCE_MASK;
+		if(Sequence == Next)
+		{
+			// the oldest sequence leaves the backroom
+			Unset((Next-NET_MAX_SEQUENCE/2-1)&NET_SEQUENCE_MASK);
+			Set(Next);
+			m_Ack = Next;
+			return SEQUENCE_NEXT;
+		}
+		if(IsSet(Sequence))
+			return SEQUENCE_OLD;
+		m_ResendRequested = true;
+		return SEQUENCE_MISSING;
+	}
+};
+
+// walks the chunks of a received packet in place
+class CNetRecvUnpacker
+{
+	const unsigned char *m_pCurrent;
+	const unsigned char *m_pEnd;
+	int m_ChunksLeft;
+
+public:
+	NETADDR m_Addr;
+	CNetSequenceWindow *m_pSequence;
+	int m_ClientID;
+
+	CNetPacketConstruct m_Data;
+	// for callers that receive datagrams themselves
+	unsigned char m_aBuffer[NET_MAX_PACKETSIZE];
+	// payload of m_Data, points into the received datagram unless the packet was compressed
+	const unsigned char *m_pData;
+
+	CNetRecvUnpacker()
+	{
+		m_pSequence = 0;
+		m_ClientID = -1;
+		m_pData = m_Data.m_aChunkData;
+		Clear();
+	}
+
+	void Clear()
+	{
+		m_pCurrent = 0;
+		m_pEnd = 0;
+		m_ChunksLeft = 0;
+	}
+
+	bool Pending() const { return m_ChunksLeft > 0; }
+
+	// the chunks returned by FetchChunk point into the datagram or m_Data,
+	// so they stay valid until the next packet is received
+	void Start(const NETADDR *pAddr, CNetSequenceWindow *pSequence, int ClientID)
+	{
+		m_Addr = *pAddr;
+		m_pSequence = pSequence;
+		m_ClientID = ClientID;
+		m_pCurrent = m_pData;
+		m_pEnd = m_pData + m_Data.m_DataSize;
+		m_ChunksLeft = m_Data.m_NumChunks;
+	}
+
+	int FetchChunk(CNetChunk *pChunk)
+	{
+		CNetChunkHeader Header;
+		while(m_ChunksLeft > 0)
+		{
+			m_ChunksLeft--;
+
+			// the header and the data have to be inside of the packet
+			if(m_pEnd - m_pCurrent < 2 || ((m_pCurrent[0]>>6)&NET_CHUNKFLAG_VITAL && m_pEnd - m_pCurrent < 3))
+				break;
+			const unsigned char *pData = Header.Unpack(m_pCurrent);
+			if(Header.m_Size > m_pEnd - pData)
+				break;
+			m_pCurrent = pData + Header.m_Size;
+
+			// handle sequence stuff
+			if(m_pSequence && (Header.m_Flags&NET_CHUNKFLAG_VITAL))
+			{
+				// take the next chunk if this one was old or came too early
+				if(m_pSequence->Feed(Header.m_Sequence) != CNetSequenceWindow::SEQUENCE_NEXT)
+					continue;
+			}
+
+			// fill in the info
+			pChunk->m_ClientID = m_ClientID;
+			pChunk->m_Address = m_Addr;
+			pChunk->m_Flags = (Header.m_Flags&NET_CHUNKFLAG_VITAL) ? NETSENDFLAG_VITAL : 0;
+			pChunk->m_DataSize = Header.m_Size;
+			pChunk->m_pData = pData;
+			return 1;
+		}
+
+		Clear();
+		return 0;
+	}
+};
+
+// hands out blocks of one size. they are cut from bigger slabs, freed
+// blocks are kept for reuse and the slabs are only given back at the end
+class CNetBlockPool
+{
+	struct CFreeBlock
+	{
+		CFreeBlock *m_pNext;
+	};
+
+	union CSlab
+	{
+		CSlab *m_pNext;
+		int64_t m_Align;
+	};
+
+	int m_BlockSize;
+	int m_BlocksPerSlab;
+	CFreeBlock *m_pFirstFree;
+	CSlab *m_pFirstSlab;
+	int m_NumSlabs;
+	int m_NumUsed;
+
+public:
+	CNetBlockPool(int BlockSize, int BlocksPerSlab)
+	{
+		m_BlockSize = (BlockSize+sizeof(CSlab)-1)&~(int)(sizeof(CSlab)-1);
+		m_BlocksPerSlab = BlocksPerSlab;
+		m_pFirstFree = 0;
+		m_pFirstSlab = 0;
+		m_NumSlabs = 0;
+		m_NumUsed = 0;
+	}
+
+	~CNetBlockPool()
+	{
+		while(m_pFirstSlab)
+		{
+			CSlab *pNext = m_pFirstSlab->m_pNext;
+			mem_free(m_pFirstSlab);
+			m_pFirstSlab = pNext;
+		}
+	}
+
+	// 0 if there is no memory left
+	void *Allocate()
+	{
+		if(!m_pFirstFree)
+		{
+			CSlab *pSlab = (CSlab *)mem_alloc(sizeof(CSlab) + m_BlockSize*m_BlocksPerSlab);
+			if(!pSlab)
+				return 0;
+			pSlab->m_pNext = m_pFirstSlab;
+			m_pFirstSlab = pSlab;
+			m_NumSlabs++;
+
+			unsigned char *pBlocks = (unsigned char *)(pSlab+1);
+			for(int i = m_BlocksPerSlab-1; i >= 0; i--)
+			{
+				CFreeBlock *pFree = (CFreeBlock *)&pBlocks[i*m_BlockSize];
+				pFree->m_pNext = m_pFirstFree;
+				m_pFirstFree = pFree;
+			}
+		}
+
+		CFreeBlock *pBlock = m_pFirstFree;
+		m_pFirstFree = pBlock->m_pNext;
+		m_NumUsed++;
+		return pBlock;
+	}
+
+	void Free(void *pBlock)
+	{
+		CFreeBlock *pFree = (CFreeBlock *)pBlock;
+		pFree->m_pNext = m_pFirstFree;
+		m_pFirstFree = pFree;
+		m_NumUsed--;
+	}
+
+	int NumUsed() const { return m_NumUsed; }
+	int64_t AllocatedBytes() const { return (int64_t)m_NumSlabs*(sizeof(CSlab) + m_BlockSize*m_BlocksPerSlab); }
+};
+
+// holds the vital chunks that weren't acked yet. entries and their data
+// share one fixed buffer, entries have consecutive sequences and the
+// offset of each one is looked up by its sequence. the buffer is taken
+// from the pool with the first entry and given back with the last one
+class CNetResendBuffer
+{
+	enum
+	{
+		ALIGNMENT=8,
+		// acks are only understood for half of the sequence space
+		MAX_ENTRIES=NET_MAX_SEQUENCE/2,
+	};
+
+	struct CStorage
+	{
+		union
+		{
+			unsigned char m_aData[NET_CONN_BUFFERSIZE];
+			int64_t m_Align;
+		};
+		unsigned short m_aOffsets[NET_MAX_SEQUENCE];
+	};
+
+	CNetBlockPool *m_pPool;
+	CStorage *m_pStorage; // 0 while there are no entries
+	int m_Head; // start of the oldest entry
+	int m_Tail; // end of the newest entry
+	int m_FirstSequence;
+	int m_NumEntries;
+
+	CNetChunkResend *Entry(int Sequence) { return (CNetChunkResend *)&m_pStorage->m_aData[m_pStorage->m_aOffsets[Sequence&NET_SEQUENCE_MASK]]; }
+
+public:
+	static int StorageSize() { return sizeof(CStorage); }
+
+	CNetResendBuffer()
+	{
+		m_pPool = 0;
+		m_pStorage = 0;
+		Clear();
+	}
+
+	~CNetResendBuffer() { Clear(); }
+
+	void Init(CNetBlockPool *pPool)
+	{
+		Clear();
+		m_pPool = pPool;
+	}
+
+	void Clear()
+	{
+		if(m_pStorage)
+		{
+			m_pPool->Free(m_pStorage);
+			m_pStorage = 0;
+		}
+		m_Head = 0;
+		m_Tail = 0;
+		m_FirstSequence = 0;
+		m_NumEntries = 0;
+	}
+
+	int NumEntries() const { return m_NumEntries; }
+
+	// returns the Index-th oldest entry
+	CNetChunkResend *Get(int Index) { return Entry(m_FirstSequence+Index); }
+
+	// returns the entry with this sequence, 0 if it isn't stored
+	CNetChunkResend *Find(int Sequence)
+	{
+		if(((Sequence-m_FirstSequence)&NET_SEQUENCE_MASK) >= m_NumEntries)
+			return 0;
+		return Entry(Sequence);
+	}
+
+	// returns an entry with m_pData pointing to DataSize bytes behind it,
+	// Sequence has to follow the one of the newest entry. 0 if it's full
+	CNetChunkResend *Allocate(int Sequence, int DataSize)
+	{
+		if(m_NumEntries && Sequence != ((m_FirstSequence+m_NumEntries)&NET_SEQUENCE_MASK))
+			return 0;
+		if(m_NumEntries == MAX_ENTRIES)
+			return 0;
+		if(!m_pStorage)
+		{
+			if(!m_pPool || !(m_pStorage = (CStorage *)m_pPool->Allocate()))
+				return 0;
+		}
+
+		int Size = (sizeof(CNetChunkResend)+DataSize+ALIGNMENT-1)&~(ALIGNMENT-1);
+		int Offset;
+		if(!m_NumEntries)
+			Offset = 0;
+		else if(m_Tail > m_Head)
+		{
+			// free space at the end, otherwise wrap around
+			if(m_Tail+Size <= NET_CONN_BUFFERSIZE)
+				Offset = m_Tail;
+			else if(Size <= m_Head)
+				Offset = 0;
+			else
+				return 0;
+		}
+		else if(m_Tail+Size <= m_Head)
+			Offset = m_Tail;
+		else
+			return 0;
+		if(Offset+Size > NET_CONN_BUFFERSIZE)
+			return 0;
+
+		if(!m_NumEntries)
+		{
+			m_Head = Offset;
+			m_FirstSequence = Sequence&NET_SEQUENCE_MASK;
+		}
+		m_Tail = Offset+Size;
+		m_pStorage->m_aOffsets[Sequence&NET_SEQUENCE_MASK] = Offset;
+		m_NumEntries++;
+
+		CNetChunkResend *pResend = (CNetChunkResend *)&m_pStorage->m_aData[Offset];
+		pResend->m_Sequence = Sequence;
+		pResend->m_DataSize = DataSize;
+		pResend->m_pData = (unsigned char *)(pResend+1);
+		return pResend;
+	}
+
+	// drops all entries up to and including Ack
+	void Release(int Ack)
+	{
+		int NumAcked = ((Ack-m_FirstSequence)&NET_SEQUENCE_MASK)+1;
+		if(NumAcked > m_NumEntries)
+			return;
+
+		m_NumEntries -= NumAcked;
+		m_FirstSequence = (Ack+1)&NET_SEQUENCE_MASK;
+		if(m_NumEntries)
+			m_Head = m_pStorage->m_aOffsets[m_FirstSequence];
+		else
+			Clear();
+	}
+};
+
+// remembers the tokens servers gave us, the server keeps accepting a
+// token for NET_TOKENCACHE_ADDRESSEXPIRY seconds
+class CNetTokenCache
+{
+	struct CAddressInfo
+	{
+		NETADDR m_Addr;
+		TOKEN m_Token;
+		int64_t m_Expiry;
+	};
+
+	CAddressInfo m_aTokens[NET_TOKENCACHE_SIZE];
+	int m_NumTokens;
+
+	int Find(const NETADDR *pAddr) const
+	{
+		for(int i = 0; i < m_NumTokens; i++)
+			if(net_addr_comp(&m_aTokens[i].m_Addr, pAddr) == 0)
+				return i;
+		return -1;
+	}
+
+public:
+	CNetTokenCache() { m_NumTokens = 0; }
+
+	void AddToken(const NETADDR *pAddr, TOKEN Token, int64_t Now)
+	{
+		int Index = Find(pAddr);
+		if(Index < 0)
+		{
+			if(m_NumTokens < NET_TOKENCACHE_SIZE)
+				Index = m_NumTokens++;
+			else
+			{
+				// replace the one that expires first
+				Index = 0;
+				for(int i = 1; i < m_NumTokens; i++)
+					if(m_aTokens[i].m_Expiry < m_aTokens[Index].m_Expiry)
+						Index = i;
+			}
+		}
+		m_aTokens[Index].m_Addr = *pAddr;
+		m_aTokens[Index].m_Token = Token;
+		m_aTokens[Index].m_Expiry = Now + time_freq()*NET_TOKENCACHE_ADDRESSEXPIRY;
+	}
+
+	// NET_TOKEN_NONE if there is no valid token for the address
+	TOKEN GetToken(const NETADDR *pAddr, int64_t Now) const
+	{
+		int Index = Find(pAddr);
+		if(Index < 0 || m_aTokens[Index].m_Expiry <= Now)
+			return NET_TOKEN_NONE;
+		return m_aTokens[Index].m_Token;
+	}
+
+	void RemoveToken(const NETADDR *pAddr)
+	{
+		int Index = Find(pAddr);
+		if(Index >= 0)
+			m_aTokens[Index] = m_aTokens[--m_NumTokens];
+	}
+};
+
+/*
+	packet logging and tracing are compiled in unless CONF_NO_PACKETLOG
+	is defined. compiled in and switched off they cost one branch per
+	packet
+*/
+enum
+{
+	NET_LOG_NONE=0,
+	NET_LOG_PACKETS, // one line per packet
+	NET_LOG_PAYLOAD, // and a dump of the payload
+
+	NET_TRACE_RECV=0,
+	NET_TRACE_SEND,
+	NET_TRACE_HEADERSIZE=16,
+};
+
+// one datagram in the trace, written to the dump as it is
+struct CNetTraceRecord
+{
+	int64_t m_Time; // time_get()
+	unsigned char m_aIp[16];
+	unsigned short m_Port;
+	unsigned short m_Size; // of the whole datagram
+	unsigned char m_Direction; // NET_TRACE_RECV or NET_TRACE_SEND
+	unsigned char m_Type; // NETTYPE_IPV4 or NETTYPE_IPV6
+	unsigned char m_HeaderSize; // used bytes of m_aHeader
+	unsigned char m_Reserved;
+	unsigned char m_aHeader[NET_TRACE_HEADERSIZE]; // first bytes of the datagram
+};
+
+/*
+	Class: CNetTraceRing
+		Keeps the last records of the traffic of a socket.
+
+	Remarks:
+		- Add only stores the record and publishes it, the oldest record is
+		  overwritten when the ring is full.
+		- Dump can run on another thread while records are added, records
+		  that got overwritten while they were copied are dropped.
+		- Dump files start with "TWTRACE1", time_freq() as int64 and the
+		  record size and count as int32, then the records follow. All
+		  fields are in host byte order, scripts/decode_trace.py reads them.
+*/
+class CNetTraceRing
+{
+	CNetTraceRecord *m_pRecords;
+	unsigned m_Size; // a power of two
+	uint64_t m_Head; // records added so far
+	// Dump runs on any thread, it must not copy from records Init or Free
+	// give back. Add is on the thread of Init and Free and doesn't lock
+	pthread_mutex_t m_Lock;
+
+	// swaps the records and returns the old ones
+	CNetTraceRecord *Replace(CNetTraceRecord *pRecords, unsigned Size)
+	{
+		pthread_mutex_lock(&m_Lock);
+		CNetTraceRecord *pOld = m_pRecords;
+		m_pRecords = pRecords;
+		m_Size = Size;
+		m_Head = 0;
+		pthread_mutex_unlock(&m_Lock);
+		return pOld;
+	}
+
+public:
+	CNetTraceRing()
+	{
+		m_pRecords = 0;
+		m_Size = 0;
+		m_Head = 0;
+		pthread_mutex_init(&m_Lock, 0);
+	}
+
+	~CNetTraceRing()
+	{
+		Free();
+		pthread_mutex_destroy(&m_Lock);
+	}
+
+	// NumRecords is rounded up to a power of two
+	int Init(int NumRecords)
+	{
+		unsigned Size = 1;
+		while(Size < (unsigned)NumRecords)
+			Size <<= 1;
+		CNetTraceRecord *pRecords = (CNetTraceRecord *)mem_alloc(Size*sizeof(CNetTraceRecord));
+		if(!pRecords)
+		{
+			Free();
+			return -1;
+		}
+		mem_free(Replace(pRecords, Size));
+		return 0;
+	}
+
+	void Free() { mem_free(Replace(0, 0)); }
+
+	bool Active() const { return m_pRecords != 0; }
+
+	void Add(int Direction, const NETADDR *pAddr, const unsigned char *pData, int Size)
+	{
+		uint64_t Head = m_Head;
+		CNetTraceRecord *pRecord = &m_pRecords[Head&(m_Size-1)];
+		pRecord->m_Time = time_get();
+		mem_copy(pRecord->m_aIp, pAddr->ip, sizeof(pRecord->m_aIp));
+		pRecord->m_Port = pAddr->port;
+		pRecord->m_Size = Size;
+		pRecord->m_Direction = Direction;
+		pRecord->m_Type = pAddr->type;
+		pRecord->m_HeaderSize = Size < NET_TRACE_HEADERSIZE ? Size : NET_TRACE_HEADERSIZE;
+		pRecord->m_Reserved = 0;
+		mem_copy(pRecord->m_aHeader, pData, pRecord->m_HeaderSize);
+		__atomic_store_n(&m_Head, Head+1, __ATOMIC_RELEASE);
+	}
+
+	// writes the records to pFilename, returns how many or -1
+	int Dump(const char *pFilename)
+	{
+		pthread_mutex_lock(&m_Lock);
+		if(!m_pRecords)
+		{
+			pthread_mutex_unlock(&m_Lock);
+			return -1;
+		}
+
+		uint64_t Head = __atomic_load_n(&m_Head, __ATOMIC_ACQUIRE);
+		uint64_t First = Head > m_Size ? Head-m_Size : 0;
+		CNetTraceRecord *pCopy = (CNetTraceRecord *)mem_alloc((Head-First)*sizeof(CNetTraceRecord)+1);
+		if(!pCopy)
+		{
+			pthread_mutex_unlock(&m_Lock);
+			return -1;
+		}
+		for(uint64_t i = First; i < Head; i++)
+			pCopy[i-First] = m_pRecords[i&(m_Size-1)];
+
+		// the writer is on the slot of record Head2 already
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		uint64_t Head2 = __atomic_load_n(&m_Head, __ATOMIC_ACQUIRE);
+		uint64_t Valid = Head2+1 > m_Size ? Head2+1-m_Size : 0;
+		uint64_t Skip = Valid > First ? Valid-First : 0;
+		if(Skip > Head-First)
+			Skip = Head-First;
+		pthread_mutex_unlock(&m_Lock);
+
+		FILE *pFile = fopen(pFilename, "wb");
+		if(!pFile)
+		{
+			mem_free(pCopy);
+			return -1;
+		}
+		int64_t Freq = time_freq();
+		int RecordSize = sizeof(CNetTraceRecord);
+		int NumRecords = (int)(Head-First-Skip);
+		fwrite("TWTRACE1", 1, 8, pFile);
+		fwrite(&Freq, sizeof(Freq), 1, pFile);
+		fwrite(&RecordSize, sizeof(RecordSize), 1, pFile);
+		fwrite(&NumRecords, sizeof(NumRecords), 1, pFile);
+		fwrite(pCopy+Skip, sizeof(CNetTraceRecord), NumRecords, pFile);
+		fclose(pFile);
+		mem_free(pCopy);
+		return NumRecords;
+	}
+};
+
+/*
+	Class: CNetPcapWriter
+		Writes datagrams to a pcap file as raw IP packets.
+
+	Remarks:
+		- The IP and UDP headers are made up from the addresses, the UDP
+		  checksum is left empty.
+		- Records are collected in a buffer and written when it's full or
+		  the file is closed.
+		- Packets are cut at the snaplen, the record keeps their original
+		  length.
+*/
+class CNetPcapWriter
+{
+	enum
+	{
+		BUFFER_SIZE=64*1024,
+		LINKTYPE_RAW=101,
+		IPV4_HEADERSIZE=20,
+		IPV6_HEADERSIZE=40,
+		UDP_HEADERSIZE=8,
+		RECORD_HEADERSIZE=16,
+		// a whole record always fits into the buffer
+		SNAPLEN=BUFFER_SIZE-RECORD_HEADERSIZE,
+		MAX_LENGTH=0xffff, // of the length fields
+	};
+
+	FILE *m_pFile;
+	unsigned char *m_pBuffer;
+	int m_BufferSize;
+	NETADDR m_aLocalAddr[2]; // ipv4 and ipv6 side of the socket
+
+	void FlushBuffer()
+	{
+		fwrite(m_pBuffer, 1, m_BufferSize, m_pFile);
+		m_BufferSize = 0;
+	}
+
+	static unsigned char *WriteInt(unsigned char *pDst, unsigned Value, int Size)
+	{
+		// network byte order
+		for(int i = Size-1; i >= 0; i--)
+			*pDst++ = (Value>>(i*8))&0xff;
+		return pDst;
+	}
+
+public:
+	CNetPcapWriter()
+	{
+		m_pFile = 0;
+		m_pBuffer = 0;
+		m_BufferSize = 0;
+	}
+
+	~CNetPcapWriter() { Close(); }
+
+	bool Active() const { return m_pFile != 0; }
+
+	int Open(const char *pFilename, const NETADDR *pLocalAddr4, const NETADDR *pLocalAddr6)
+	{
+		Close();
+		m_pBuffer = (unsigned char *)mem_alloc(BUFFER_SIZE);
+		if(!m_pBuffer)
+			return -1;
+		m_pFile = fopen(pFilename, "wb");
+		if(!m_pFile)
+		{
+			Close();
+			return -1;
+		}
+		m_aLocalAddr[0] = *pLocalAddr4;
+		m_aLocalAddr[1] = *pLocalAddr6;
+
+		// global header, version 2.4 in host byte order
+		unsigned aHeader[6] = { 0xa1b2c3d4, 2|(4<<16), 0, 0, SNAPLEN, LINKTYPE_RAW };
+		fwrite(aHeader, sizeof(aHeader), 1, m_pFile);
+		return 0;
+	}
+
+	void Close()
+	{
+		if(m_pFile)
+		{
+			FlushBuffer();
+			fclose(m_pFile);
+			m_pFile = 0;
+		}
+		mem_free(m_pBuffer);
+		m_pBuffer = 0;
+		m_BufferSize = 0;
+	}
+
+	void Write(int Direction, const NETADDR *pPeer, const unsigned char *pData, int Size)
+	{
+		bool Ipv6 = pPeer->type&NETTYPE_IPV6;
+		int IpHeaderSize = Ipv6 ? IPV6_HEADERSIZE : IPV4_HEADERSIZE;
+		int PacketSize = IpHeaderSize + UDP_HEADERSIZE + Size;
+		int CapturedSize = PacketSize < SNAPLEN ? PacketSize : SNAPLEN;
+		int UdpSize = UDP_HEADERSIZE + Size < MAX_LENGTH ? UDP_HEADERSIZE + Size : MAX_LENGTH;
+		if(m_BufferSize + RECORD_HEADERSIZE + CapturedSize > BUFFER_SIZE)
+			FlushBuffer();
+
+		struct timeval Time;
+		gettimeofday(&Time, 0);
+		unsigned aRecord[4] = { (unsigned)Time.tv_sec, (unsigned)Time.tv_usec, (unsigned)CapturedSize, (unsigned)PacketSize };
+		mem_copy(&m_pBuffer[m_BufferSize], aRecord, sizeof(aRecord));
+		unsigned char *pDst = &m_pBuffer[m_BufferSize+RECORD_HEADERSIZE];
+
+		const NETADDR *pLocal = &m_aLocalAddr[Ipv6 ? 1 : 0];
+		const NETADDR *pSrcAddr = Direction == NET_TRACE_SEND ? pLocal : pPeer;
+		const NETADDR *pDstAddr = Direction == NET_TRACE_SEND ? pPeer : pLocal;
+		if(Ipv6)
+		{
+			pDst = WriteInt(pDst, 0x60000000, 4); // version
+			pDst = WriteInt(pDst, UdpSize, 2);
+			*pDst++ = 17; // udp
+			*pDst++ = 64; // hop limit
+			mem_copy(pDst, pSrcAddr->ip, 16);
+			mem_copy(pDst+16, pDstAddr->ip, 16);
+			pDst += 32;
+		}
+		else
+		{
+			unsigned char *pIp = pDst;
+			pDst = WriteInt(pDst, 0x4500, 2); // version, header length
+			pDst = WriteInt(pDst, PacketSize < MAX_LENGTH ? PacketSize : MAX_LENGTH, 2);
+			pDst = WriteInt(pDst, 0x00004000, 4); // id, don't fragment
+			*pDst++ = 64; // ttl
+			*pDst++ = 17; // udp
+			pDst = WriteInt(pDst, 0, 2); // checksum
+			mem_copy(pDst, pSrcAddr->ip, 4);
+			mem_copy(pDst+4, pDstAddr->ip, 4);
+			pDst += 8;
+
+			unsigned Sum = 0;
+			for(int i = 0; i < IPV4_HEADERSIZE; i += 2)
+				Sum += (pIp[i]<<8) | pIp[i+1];
+			while(Sum>>16)
+				Sum = (Sum&0xffff) + (Sum>>16);
+			WriteInt(&pIp[10], ~Sum&0xffff, 2);
+		}
+		pDst = WriteInt(pDst, pSrcAddr->port, 2);
+		pDst = WriteInt(pDst, pDstAddr->port, 2);
+		pDst = WriteInt(pDst, UdpSize, 2);
+		pDst = WriteInt(pDst, 0, 2); // no checksum
+		mem_copy(pDst, pData, CapturedSize - IpHeaderSize - UDP_HEADERSIZE);
+
+		m_BufferSize += RECORD_HEADERSIZE + CapturedSize;
+	}
+};
+
+// the socket and what all connections on it share. one instance must
+// only be used by one thread at a time
+class CNetBase
+{
+protected:
+	NETSOCKET m_Socket;
+	CTimerWheel m_Timers;
+	CNetTokenCache m_TokenCache;
+	// buffers connections only hold while they have something in flight
+	CNetBlockPool m_ResendPool;
+	CNetBlockPool m_ConstructPool;
+
+	int m_LogLevel;
+	CNetTraceRing m_Trace;
+	CNetPcapWriter m_Capture;
+
+	// datagrams are received and sent NET_BATCH_SIZE at a time
+	unsigned char *m_pBatchBuffers;
+	NETPACKET m_aRecvBatch[NET_BATCH_SIZE];
+	int m_NumRecv;
+	int m_RecvIndex;
+	NETPACKET m_aSendBatch[NET_BATCH_SIZE];
+	int m_NumSend;
+
+	// the sockets and the timer fd, readable when there's work to do
+	int m_EpollFd;
+	int m_TimerFd;
+	int64_t m_ArmedExpiry; // what m_TimerFd is set to, -1 if disarmed
+	int64_t m_SpinTime; // Wait polls the sockets this long before sleeping
+	int m_RecvTypes; // NETTYPE_* of the sockets that weren't drained yet, see net_udp_recv_batch
+
+	int m_Backend;
+	CNetUring m_Uring;
+	int OpenBackend();
+
+	int m_Features; // NETSOCKET_*, GSO is dropped when the system refuses it
+	// coalesced receives, split up into m_aRecvBatch
+	bool m_Gro;
+	unsigned char *m_pGroBuffers;
+	NETPACKET m_aGroRecv[NET_GRO_BUFFERS];
+	int m_aGroSegments[NET_GRO_BUFFERS];
+	int m_NumGro;
+	int m_GroIndex;
+	int m_GroOffset;
+
+	int RecvBatch();
+	int RecvGroBatch();
+
+	void LogPacket(int Direction, const NETADDR *pAddr, int Size, const CNetPacketConstruct *pPacket, const unsigned char *pData);
+
+public:
+	CNetBase();
+	~CNetBase() { Close(); }
+
+	int Open(NETADDR BindAddr, int Flags);
+	void Close();
+
+	NETSOCKET Socket() const { return m_Socket; }
+	CTimerWheel *Timers() { return &m_Timers; }
+	CNetTokenCache *TokenCache() { return &m_TokenCache; }
+	CNetBlockPool *ResendPool() { return &m_ResendPool; }
+	CNetBlockPool *ConstructPool() { return &m_ConstructPool; }
+	int64_t PoolBytes() const { return m_ResendPool.AllocatedBytes() + m_ConstructPool.AllocatedBytes(); }
+
+	void SetLogLevel(int Level) { m_LogLevel = Level; }
+	// NumRecords 0 stops the trace
+	int EnableTrace(int NumRecords);
+	int DumpTrace(const char *pFilename) { return m_Trace.Dump(pFilename); }
+	// writes all datagrams of the socket to a pcap file
+	int StartCapture(const char *pFilename);
+	void StopCapture() { m_Capture.Close(); }
+
+	// queues the packet, it's sent with the next FlushSend
+	void SendPacket(const NETADDR *pAddr, CNetPacketConstruct *pPacket, CNetCompressionPolicy *pPolicy);
+	void FlushSend();
+	// *ppData stays valid until the next call, see ParsePacket
+	int UnpackPacket(NETADDR *pAddr, CNetPacketConstruct *pPacket, const unsigned char **ppData);
+	int UnpackDatagram(const NETADDR *pAddr, unsigned char *pBuffer, int Size, CNetPacketConstruct *pPacket, const unsigned char **ppData);
+
+	// sets the timer fd to the next timer, call after the timers changed
+	void ArmWakeup();
+	// readable while a datagram is waiting or a timer is due
+	int WaitFd() const { return m_EpollFd; }
+	// Wait returns as well when Fd gets readable
+	void WatchFd(int Fd, bool Watch);
+	// sleeps at most TimeoutMs, -1 for no limit. returns >0 if there is
+	// something to receive or a timer is due, 0 on timeout, -1 on error
+	int Wait(int TimeoutMs);
+	// NET_BACKEND_*, falls back to the socket calls if io_uring can't be
+	// used. returns the backend in use. datagrams that were received but
+	// not unpacked yet are lost when it changes
+	int SetBackend(int Backend);
+	int Backend() const { return m_Backend; }
+	// coalesced receiving with UDP_GRO, only with NET_BACKEND_SOCKET.
+	// -1 if the system doesn't support it
+	int EnableGro(bool Enable);
+	int Features() const { return m_Features; }
+
+	// Wait spins on the sockets for SpinUs before it sleeps, for a lower
+	// wakeup latency at the cost of a busy core. 0 turns it off
+	void SetBusyPoll(int SpinUs);
+};
+
+class CNetConnection
+{
+	int m_State;
+	char m_aErrorString[128];
+
+	TOKEN m_Token; // ours, the peer puts it into every packet
+	TOKEN m_PeerToken;
+	bool m_CachedPeerToken; // m_PeerToken came from the token cache
+
+	int m_Sequence;
+	int64_t m_LastSendTime;
+	int64_t m_LastRecvTime;
+	int64_t m_FlushDelay;
+
+	CNetBase *m_pNetBase;
+	CTimerWheel *m_pTimers;
+	CTimer m_ResendTimer;
+	CTimer m_KeepaliveTimer;
+	CTimer m_TimeoutTimer;
+	CTimer m_FlushTimer;
+	CTimer m_ConnectTimer;
+
+	NETADDR m_PeerAddr;
+	CNetPacketConstruct *m_pConstruct; // only while chunks wait for the flush
+	CNetResendBuffer m_Buffer;
+	int m_NumUnsent; // newest entries of m_Buffer that still wait in m_pConstruct
+
+	// rtt estimation, in ticks of time_freq()
+	int64_t m_SmoothedRtt; // 0 until the first sample
+	int64_t m_RttVar;
+	int64_t m_Rto;
+
+	static void ResendTimerCallback(CTimer *pTimer, void *pUser);
+	static void KeepaliveTimerCallback(CTimer *pTimer, void *pUser);
+	static void TimeoutTimerCallback(CTimer *pTimer, void *pUser);
+	static void FlushTimerCallback(CTimer *pTimer, void *pUser);
+	static void ConnectTimerCallback(CTimer *pTimer, void *pUser);
+
+	void CancelTimers();
+	void FreeBuffers();
+	void SetError(const char *pString);
+	void SendControl(int ControlMsg, const void *pExtra, int ExtraSize, TOKEN Token);
+	void SendControlWithToken(int ControlMsg);
+	void SetOnline();
+	void UpdateRtt(int64_t Rtt);
+	void AckChunks(int Ack);
+	int ResendChunk(CNetChunkResend *pResend);
+	void ResendChunks();
+	int QueueChunkEx(int Flags, int DataSize, const void *pData, int Sequence);
+
+public:
+	CNetCompressionPolicy m_Compression;
+	CNetSequenceWindow m_RecvSequence;
+
+	CNetConnection();
+
+	// the connection sends through pNetBase and runs its timers there
+	void Init(CNetBase *pNetBase);
+	void Reset();
+	// starts the handshake, the state tells when it's done
+	int Connect(const NETADDR *pAddr);
+	void Disconnect(const char *pReason);
+	const NETADDR *PeerAddress() const { return &m_PeerAddr; }
+	int State() const { return m_State; }
+	const char *ErrorString() const { return m_aErrorString; }
+	int64_t Rtt() const { return m_SmoothedRtt; }
+	int64_t Rto() const { return m_Rto; }
+
+	// queued chunks are sent at the latest after this many ticks of time_freq()
+	void SetFlushDelay(int64_t Delay) { m_FlushDelay = Delay; }
+
+	int Flush();
+	int QueueChunk(int Flags, int DataSize, const void *pData);
+	// handles the connection part of a packet received from the peer,
+	// returns 1 if its chunks should be unpacked
+	int Feed(const CNetPacketConstruct *pPacket, const unsigned char *pData);
+};
+
+class CNetIoThread;
+
+/*
+	Class: CNetClient
+		Client side connections sharing one socket.
+
+	Remarks:
+		- The server tells its clients apart by address, so one socket can
+		  only hold one connection per server. Bots on the same server each
+		  need their own CNetClient, see CNetShards as well.
+		- There is no state shared between instances except the read-only
+		  huffman tables, different threads can run different instances.
+*/
+class CNetClient : public CNetBase
+{
+	CNetConnection *m_pConnections;
+	// copies of the peer addresses, the receive lookup scans them
+	// without touching the connections
+	NETADDR *m_pPeerAddrs;
+	int m_MaxConnections;
+	CNetRecvUnpacker m_RecvUnpacker;
+	// set while the port is shared, Connect only takes the servers
+	// whose datagrams are steered to this shard
+	int m_Shard;
+	int m_NumShards;
+	CNetIoThread *m_pIoThread; // 0 while the caller runs the client
+
+	int RecvImpl(CNetChunk *pChunk, TOKEN *pResponseToken);
+
+public:
+	CNetClient();
+	~CNetClient() { Close(); }
+
+	int Open(NETADDR BindAddr, int MaxConnections, int Flags);
+	void Close();
+
+	// returns the connection id or -1
+	int Connect(const NETADDR *pAddr);
+	void Disconnect(int ConnID, const char *pReason);
+
+	int Send(int ConnID, const void *pData, int DataSize, int Flags);
+	int Recv(CNetChunk *pChunk, TOKEN *pResponseToken);
+	// fires the timers of all connections
+	void Update();
+	// see CNetBase::Wait, also returns if Recv has chunks left
+	int Wait(int TimeoutMs);
+
+	// bytes held for the connections, including the pooled buffers
+	int64_t MemoryUsage() const;
+
+	void SetShard(int Shard, int NumShards)
+	{
+		m_Shard = Shard;
+		m_NumShards = NumShards;
+	}
+
+	// hands the client to a thread of its own, pinned to Cpu unless it's -1
+	int StartIoThread(int Cpu);
+	void StopIoThread();
+	CNetIoThread *IoThread() { return m_pIoThread; }
+
+	int MaxConnections() const { return m_MaxConnections; }
+
+	// 0 if ConnID isn't a valid connection id
+	CNetConnection *Connection(int ConnID)
+	{
+		if(ConnID < 0 || ConnID >= m_MaxConnections)
+			return 0;
+		return &m_pConnections[ConnID];
+	}
+};
+
+/*
+	Class: CNetShards
+		Spreads the connections over several CNetClient, one per worker
+		thread.
+
+	Remarks:
+		- Each shard has its own socket, timers and pools and is only
+		  touched by its worker, nothing is locked.
+		- ShardOf hashes the server address, a server always goes to the
+		  same shard.
+		- With a port given, all shards share it with SO_REUSEPORT and a
+		  steering program puts the datagrams of a server on the socket
+		  of the shard ShardOf picks. Otherwise each shard has a port of
+		  its own and any shard can take any server.
+*/
+class CNetShards
+{
+	CNetClient *m_pShards;
+	int m_NumShards;
+	bool m_SharedPort;
+
+public:
+	CNetShards();
+	~CNetShards() { Close(); }
+
+	// Port 0 gives each shard its own random port
+	int Open(int NumShards, int MaxConnections, int Port);
+	void Close();
+
+	int NumShards() const { return m_NumShards; }
+	int ShardOf(const NETADDR *pAddr) const { return net_addr_hash(pAddr)%m_NumShards; }
+
+	// 0 if Index isn't a valid shard
+	CNetClient *Shard(int Index)
+	{
+		if(Index < 0 || Index >= m_NumShards)
+			return 0;
+		return &m_pShards[Index];
+	}
+};
+
+/*
+	Class: CNetIoThread
+		Runs a CNetClient on a thread of its own. Receiving, acks,
+		resends and keepalives go on however slow the caller is.
+
+	Remarks:
+		- Send queues the chunk for the thread, Recv takes the chunks the
+		  thread received. Both queues are lock-free, a system call is
+		  only made to wake the thread when it sleeps.
+		- EventFd is readable while chunks wait for Recv.
+		- Everything else is done with the thread parked, see Pause.
+		- Send can be called by any thread, Recv and Wait by one thread
+		  at a time.
+		- When Recv falls behind and the chunk queue is full, the thread
+		  stops receiving but keeps running the timers.
+*/
+class CNetIoThread
+{
+	enum
+	{
+		CMD_SEND=0,
+		CMD_PAUSE,
+		CMD_STOP,
+
+		STATE_AWAKE=0,
+		STATE_SLEEPING, // waits for commands, datagrams and timers
+		STATE_FULL, // waits for commands and room in m_Events
+	};
+
+	// a queued command or a received chunk
+	struct CMessage
+	{
+		int m_Type;
+		int m_ConnID;
+		int m_Flags;
+		int m_DataSize;
+		NETADDR m_Addr;
+		TOKEN m_ResponseToken;
+		unsigned char m_aData[NET_MAX_PAYLOAD];
+	};
+
+	CNetClient *m_pClient;
+	void *m_pThread;
+	int m_Cpu;
+
+	CNetMpscQueue m_Commands;
+	CNetSpscQueue m_Events;
+	int m_CommandFd; // wakes the thread
+	int m_EventFd; // readable while there are events
+	int m_State; // STATE_*, set by the thread before it sleeps
+	bool m_HoldingEvent; // the chunk of the front event is handed out
+
+	int *m_pConnStates; // copies for the callers
+	sem_t m_Paused;
+	sem_t m_Resume;
+
+	static void ThreadFunc(void *pUser);
+	void Run();
+	bool RunCommands();
+	void WaitForRoom();
+	void PublishStates();
+	void PushCommand(int Type);
+	void WakeThread();
+
+public:
+	CNetIoThread();
+	~CNetIoThread() { Stop(); }
+
+	int Start(CNetClient *pClient, int Cpu);
+	// chunks that weren't received yet are dropped
+	void Stop();
+
+	// -1 if the queue is full or the chunk can't be sent at all, other
+	// errors only show in the connection state
+	int Send(int ConnID, const void *pData, int DataSize, int Flags);
+	// the chunk stays valid until the next Recv
+	int Recv(CNetChunk *pChunk, TOKEN *pResponseToken);
+	// sleeps at most TimeoutMs until there are chunks, see CNetBase::Wait
+	int Wait(int TimeoutMs);
+	int EventFd() const { return m_EventFd; }
+	// the state of the connection after the last round of the thread, -1 if ConnID isn't valid
+	int ConnState(int ConnID) const;
+
+	// parks the thread after the commands queued so far, the client can
+	// be used directly until Resume
+	void Pause();
+	void Resume();
+};
+
+// parks the I/O thread of the client, if it has one, while in scope
+class CNetIoPause
+{
+	CNetIoThread *m_pThread;
+
+public:
+	CNetIoPause(CNetClient *pClient)
+	{
+		m_pThread = pClient->IoThread();
+		if(m_pThread)
+			m_pThread->Pause();
+	}
+
+	~CNetIoPause()
+	{
+		if(m_pThread)
+			m_pThread->Resume();
+	}
+};
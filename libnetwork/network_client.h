@@ -0,0 +1,262 @@
+/* (c) Magnus Auvinen. See licence.txt in the root of the distribution for more information. */
+/* If you are missing that file, acquire a complete release at teeworlds.com.                */
+
+CNetClient::CNetClient()
+{
+	m_pConnections = 0;
+	m_pPeerAddrs = 0;
+	m_MaxConnections = 0;
+	m_Shard = 0;
+	m_NumShards = 0;
+	m_pIoThread = 0;
+}
+
+int CNetClient::Open(NETADDR BindAddr, int MaxConnections, int Flags)
+{
+	Close();
+	if(MaxConnections <= 0 || CNetBase::Open(BindAddr, Flags) != 0)
+		return -1;
+
+	m_pConnections = new CNetConnection[MaxConnections];
+	m_pPeerAddrs = new NETADDR[MaxConnections];
+	mem_zero(m_pPeerAddrs, sizeof(NETADDR)*MaxConnections);
+	m_MaxConnections = MaxConnections;
+	for(int i = 0; i < m_MaxConnections; i++)
+		m_pConnections[i].Init(this);
+	m_RecvUnpacker.Clear();
+	return 0;
+}
+
+void CNetClient::Close()
+{
+	StopIoThread();
+	m_Timers.RefreshTime();
+	for(int i = 0; i < m_MaxConnections; i++)
+		m_pConnections[i].Disconnect("disconnect");
+	delete[] m_pConnections;
+	delete[] m_pPeerAddrs;
+	m_pConnections = 0;
+	m_pPeerAddrs = 0;
+	m_MaxConnections = 0;
+	m_RecvUnpacker.Clear();
+	CNetBase::Close();
+}
+
+int CNetClient::Connect(const NETADDR *pAddr)
+{
+	for(int i = 0; i < m_MaxConnections; i++)
+	{
+		if(net_addr_comp(&m_pPeerAddrs[i], pAddr) == 0 && m_pConnections[i].State() != NET_CONNSTATE_OFFLINE)
+		{
+			dbg_msg("libtwnetwork", "there is a connection to this address on the socket already, id=%d", i);
+			return -1;
+		}
+	}
+
+	// the steering program decides which shard receives from the server
+	int Shard = m_NumShards > 1 ? net_addr_hash(pAddr)%m_NumShards : m_Shard;
+	if(Shard != m_Shard)
+	{
+		dbg_msg("libtwnetwork", "the datagrams of this address go to shard %d, not %d", Shard, m_Shard);
+		return -1;
+	}
+
+	int Free = -1;
+	for(int i = 0; i < m_MaxConnections && Free < 0; i++)
+		if(m_pConnections[i].State() == NET_CONNSTATE_OFFLINE)
+			Free = i;
+
+	if(Free < 0)
+	{
+		dbg_msg("libtwnetwork", "no free connection slot, max=%d", m_MaxConnections);
+		return -1;
+	}
+
+	m_Timers.RefreshTime();
+	if(m_pConnections[Free].Connect(pAddr) != 0)
+		return -1;
+	m_pPeerAddrs[Free] = *pAddr;
+	FlushSend();
+	ArmWakeup();
+	return Free;
+}
+
+void CNetClient::Disconnect(int ConnID, const char *pReason)
+{
+	CNetConnection *pConn = Connection(ConnID);
+	if(!pConn)
+		return;
+
+	m_Timers.RefreshTime();
+	pConn->Disconnect(pReason);
+	FlushSend();
+	ArmWakeup();
+	if(m_RecvUnpacker.m_ClientID == ConnID)
+		m_RecvUnpacker.Clear();
+}
+
+int CNetClient::Send(int ConnID, const void *pData, int DataSize, int Flags)
+{
+	if(Flags&NETSENDFLAG_CONNLESS)
+	{
+		dbg_msg("libtwnetwork", "connless chunks are not supported, dropping chunk");
+		return -1;
+	}
+
+	CNetConnection *pConn = Connection(ConnID);
+	if(!pConn)
+		return -1;
+
+	m_Timers.RefreshTime();
+	if(pConn->QueueChunk((Flags&NETSENDFLAG_VITAL) ? NET_CHUNKFLAG_VITAL : 0, DataSize, pData) != 0)
+		return -1;
+	if(Flags&NETSENDFLAG_FLUSH)
+	{
+		pConn->Flush();
+		FlushSend();
+	}
+	ArmWakeup();
+	return 0;
+}
+
+int CNetClient::Recv(CNetChunk *pChunk, TOKEN *pResponseToken)
+{
+	int Result = RecvImpl(pChunk, pResponseToken);
+	// answers to the packets, e.g. the connect after a token
+	FlushSend();
+	ArmWakeup();
+	return Result;
+}
+
+int CNetClient::RecvImpl(CNetChunk *pChunk, TOKEN *pResponseToken)
+{
+	while(1)
+	{
+		// check for a chunk
+		if(m_RecvUnpacker.FetchChunk(pChunk))
+			return 1;
+
+		NETADDR Addr;
+		int Result = UnpackPacket(&Addr, &m_RecvUnpacker.m_Data, &m_RecvUnpacker.m_pData);
+		// no more packets for now
+		if(Result > 0)
+			break;
+
+		if(!Result)
+		{
+			if(m_RecvUnpacker.m_Data.m_Flags&NET_PACKETFLAG_CONNLESS)
+			{
+				pChunk->m_Flags = NETSENDFLAG_CONNLESS;
+				pChunk->m_ClientID = -1;
+				pChunk->m_Address = Addr;
+				pChunk->m_DataSize = m_RecvUnpacker.m_Data.m_DataSize;
+				pChunk->m_pData = m_RecvUnpacker.m_pData;
+				if(pResponseToken)
+					*pResponseToken = m_RecvUnpacker.m_Data.m_ResponseToken;
+				return 1;
+			}
+
+			for(int i = 0; i < m_MaxConnections; i++)
+			{
+				if(net_addr_comp(&Addr, &m_pPeerAddrs[i]) != 0)
+					continue;
+				// the address stays behind when the connection goes offline
+				CNetConnection *pConn = &m_pConnections[i];
+				if(pConn->State() == NET_CONNSTATE_OFFLINE)
+					continue;
+				if(pConn->Feed(&m_RecvUnpacker.m_Data, m_RecvUnpacker.m_pData))
+					m_RecvUnpacker.Start(&Addr, &pConn->m_RecvSequence, i);
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+void CNetClient::Update()
+{
+	// everything the timers send goes out in one batch
+	m_Timers.Advance(time_get());
+	FlushSend();
+	ArmWakeup();
+}
+
+int CNetClient::Wait(int TimeoutMs)
+{
+	if(m_RecvUnpacker.Pending())
+		return 1;
+	return CNetBase::Wait(TimeoutMs);
+}
+
+int CNetClient::StartIoThread(int Cpu)
+{
+	if(m_pIoThread || !m_MaxConnections)
+		return -1;
+	m_pIoThread = new CNetIoThread();
+	if(m_pIoThread->Start(this, Cpu) != 0)
+	{
+		delete m_pIoThread;
+		m_pIoThread = 0;
+		return -1;
+	}
+	return 0;
+}
+
+void CNetClient::StopIoThread()
+{
+	delete m_pIoThread;
+	m_pIoThread = 0;
+}
+
+int64_t CNetClient::MemoryUsage() const
+{
+	return (int64_t)m_MaxConnections*(sizeof(CNetConnection)+sizeof(NETADDR)) + PoolBytes();
+}
+
+CNetShards::CNetShards()
+{
+	m_pShards = 0;
+	m_NumShards = 0;
+	m_SharedPort = false;
+}
+
+int CNetShards::Open(int NumShards, int MaxConnections, int Port)
+{
+	Close();
+	if(NumShards <= 0)
+		return -1;
+
+	NETADDR BindAddr;
+	mem_zero(&BindAddr, sizeof(BindAddr));
+	BindAddr.type = NETTYPE_ALL;
+	BindAddr.port = Port;
+	m_pShards = new CNetClient[NumShards];
+	m_NumShards = NumShards;
+	m_SharedPort = Port != 0;
+	for(int i = 0; i < NumShards; i++)
+	{
+		if(m_pShards[i].Open(BindAddr, MaxConnections, m_SharedPort ? NETCREATE_FLAG_REUSEPORT : 0) != 0)
+		{
+			Close();
+			return -1;
+		}
+		if(m_SharedPort)
+			m_pShards[i].SetShard(i, NumShards);
+	}
+
+	// the socket of shard i is the i-th one bound to the port
+	if(m_SharedPort && net_udp_steer_reuseport(m_pShards[0].Socket(), NumShards) != 0)
+	{
+		Close();
+		return -1;
+	}
+	return 0;
+}
+
+void CNetShards::Close()
+{
+	delete[] m_pShards;
+	m_pShards = 0;
+	m_NumShards = 0;
+	m_SharedPort = false;
+}
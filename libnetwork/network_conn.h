@@ -0,0 +1,500 @@
+/* (c) Magnus Auvinen. See licence.txt in the root of the distribution for more information. */
+/* If you are missing that file, acquire a complete release at teeworlds.com.                */
+
+CNetConnection::CNetConnection()
+{
+	m_pNetBase = 0;
+	m_pTimers = 0;
+	m_pConstruct = 0;
+	m_ResendTimer.Init(ResendTimerCallback, this);
+	m_KeepaliveTimer.Init(KeepaliveTimerCallback, this);
+	m_TimeoutTimer.Init(TimeoutTimerCallback, this);
+	m_FlushTimer.Init(FlushTimerCallback, this);
+	m_ConnectTimer.Init(ConnectTimerCallback, this);
+	Reset();
+}
+
+void CNetConnection::Init(CNetBase *pNetBase)
+{
+	Reset();
+	m_pNetBase = pNetBase;
+	m_pTimers = pNetBase->Timers();
+	m_Buffer.Init(pNetBase->ResendPool());
+}
+
+void CNetConnection::Reset()
+{
+	CancelTimers();
+	m_State = NET_CONNSTATE_OFFLINE;
+	m_aErrorString[0] = 0;
+	m_Sequence = 0;
+	m_LastSendTime = 0;
+	m_LastRecvTime = 0;
+	m_FlushDelay = time_freq()/50;
+	m_Token = NET_TOKEN_NONE;
+	m_PeerToken = NET_TOKEN_NONE;
+	m_CachedPeerToken = false;
+	mem_zero(&m_PeerAddr, sizeof(m_PeerAddr));
+	FreeBuffers();
+	m_Compression.Reset();
+	m_RecvSequence.Reset();
+	m_SmoothedRtt = 0;
+	m_RttVar = 0;
+	m_Rto = time_freq()*NET_RTO_INITIAL/1000;
+}
+
+void CNetConnection::CancelTimers()
+{
+	if(!m_pTimers)
+		return;
+	m_pTimers->Cancel(&m_ResendTimer);
+	m_pTimers->Cancel(&m_KeepaliveTimer);
+	m_pTimers->Cancel(&m_TimeoutTimer);
+	m_pTimers->Cancel(&m_FlushTimer);
+	m_pTimers->Cancel(&m_ConnectTimer);
+}
+
+void CNetConnection::FreeBuffers()
+{
+	if(m_pConstruct)
+	{
+		m_pNetBase->ConstructPool()->Free(m_pConstruct);
+		m_pConstruct = 0;
+	}
+	m_Buffer.Clear();
+	m_NumUnsent = 0;
+}
+
+int CNetConnection::Connect(const NETADDR *pAddr)
+{
+	if(State() != NET_CONNSTATE_OFFLINE)
+		return -1;
+
+	// init connection
+	Reset();
+	m_PeerAddr = *pAddr;
+	do
+	{
+		if(secure_random_fill(&m_Token, sizeof(m_Token)) != 0)
+			m_Token = (TOKEN)time_get();
+	}
+	while(m_Token == NET_TOKEN_NONE);
+
+	int64_t Now = m_pTimers->Now();
+	m_LastRecvTime = Now;
+	m_pTimers->Insert(&m_TimeoutTimer, Now + time_freq()*NET_CONNECT_TIMEOUT/1000);
+	m_pTimers->Insert(&m_ConnectTimer, Now + time_freq()*NET_CONNECT_RETRY/1000);
+
+	// with a token from the last seconds the connect can go out right away.
+	// the token request is sent anyway in case the server restarted, then
+	// its answer brings the new token without waiting for a retry. a
+	// cached token that doesn't get us in is dropped by SetError
+	m_PeerToken = m_pNetBase->TokenCache()->GetToken(pAddr, Now);
+	m_CachedPeerToken = m_PeerToken != NET_TOKEN_NONE;
+	if(m_CachedPeerToken)
+	{
+		m_State = NET_CONNSTATE_CONNECT;
+		SendControlWithToken(NET_CTRLMSG_CONNECT);
+	}
+	else
+		m_State = NET_CONNSTATE_TOKEN;
+	SendControlWithToken(NET_CTRLMSG_TOKEN);
+	return 0;
+}
+
+void CNetConnection::Disconnect(const char *pReason)
+{
+	if(State() == NET_CONNSTATE_OFFLINE)
+		return;
+
+	if(State() == NET_CONNSTATE_ONLINE)
+	{
+		Flush();
+		SendControl(NET_CTRLMSG_CLOSE, pReason, pReason ? str_length(pReason)+1 : 0, m_PeerToken);
+	}
+	Reset();
+}
+
+void CNetConnection::SetOnline()
+{
+	m_State = NET_CONNSTATE_ONLINE;
+	m_pTimers->Cancel(&m_ConnectTimer);
+
+	int64_t Now = m_pTimers->Now();
+	m_LastRecvTime = Now;
+	m_pTimers->Insert(&m_KeepaliveTimer, m_LastSendTime + time_freq()*NET_KEEPALIVE_INTERVAL/1000);
+	m_pTimers->Insert(&m_TimeoutTimer, Now + time_freq()*NET_CONN_TIMEOUT/1000);
+}
+
+void CNetConnection::SetError(const char *pString)
+{
+	// the next connect shouldn't try the cached token again
+	if(m_CachedPeerToken && (m_State == NET_CONNSTATE_TOKEN || m_State == NET_CONNSTATE_CONNECT))
+		m_pNetBase->TokenCache()->RemoveToken(&m_PeerAddr);
+	m_State = NET_CONNSTATE_ERROR;
+	str_copy(m_aErrorString, pString, sizeof(m_aErrorString));
+	dbg_msg("connection", "%s", pString);
+	CancelTimers();
+	// nothing is sent anymore, the pools can have the buffers back
+	FreeBuffers();
+}
+
+void CNetConnection::SendControl(int ControlMsg, const void *pExtra, int ExtraSize, TOKEN Token)
+{
+	CNetPacketConstruct Construct;
+	Construct.m_Token = Token;
+	Construct.m_Flags = NET_PACKETFLAG_CONTROL;
+	Construct.m_Ack = m_RecvSequence.m_Ack;
+	Construct.m_NumChunks = 0;
+	Construct.m_DataSize = 1+ExtraSize;
+	Construct.m_aChunkData[0] = ControlMsg;
+	if(ExtraSize > 0)
+		mem_copy(&Construct.m_aChunkData[1], pExtra, ExtraSize);
+
+	// send the control message
+	m_pNetBase->SendPacket(&m_PeerAddr, &Construct, 0);
+	m_LastSendTime = m_pTimers->Now();
+	m_pTimers->Insert(&m_KeepaliveTimer, m_LastSendTime + time_freq()*NET_KEEPALIVE_INTERVAL/1000);
+}
+
+void CNetConnection::SendControlWithToken(int ControlMsg)
+{
+	// token and connect requests are padded, so the server doesn't answer
+	// more than it got
+	unsigned char aBuf[NET_TOKENREQUEST_DATASIZE];
+	mem_zero(aBuf, sizeof(aBuf));
+	aBuf[0] = (m_Token>>24)&0xff;
+	aBuf[1] = (m_Token>>16)&0xff;
+	aBuf[2] = (m_Token>>8)&0xff;
+	aBuf[3] = (m_Token)&0xff;
+	// a server drops token requests that carry a token it doesn't know,
+	// like a cached one from before its restart
+	SendControl(ControlMsg, aBuf, sizeof(aBuf), ControlMsg == NET_CTRLMSG_TOKEN ? NET_TOKEN_NONE : m_PeerToken);
+}
+
+int CNetConnection::Flush()
+{
+	if(!m_pConstruct)
+		return 0;
+	int NumChunks = m_pConstruct->m_NumChunks;
+	if(!NumChunks && !m_pConstruct->m_Flags)
+		return 0;
+
+	// ask the peer to resend if we missed vital chunks
+	if(m_RecvSequence.m_ResendRequested)
+	{
+		m_pConstruct->m_Flags |= NET_PACKETFLAG_RESEND;
+		m_RecvSequence.m_ResendRequested = false;
+	}
+
+	// send of the packets
+	m_pConstruct->m_Ack = m_RecvSequence.m_Ack;
+	m_pConstruct->m_Token = m_PeerToken;
+	m_pNetBase->SendPacket(&m_PeerAddr, m_pConstruct, &m_Compression);
+
+	// update send times, the rtt of the new chunks counts from here and
+	// not from when they were queued
+	m_LastSendTime = m_pTimers->Now();
+	int NumEntries = m_Buffer.NumEntries();
+	int First = m_NumUnsent < NumEntries ? NumEntries-m_NumUnsent : 0;
+	for(int i = First; i < NumEntries; i++)
+	{
+		CNetChunkResend *pResend = m_Buffer.Get(i);
+		if(pResend->m_LastSendTime == pResend->m_FirstSendTime)
+			pResend->m_LastSendTime = m_LastSendTime;
+		pResend->m_FirstSendTime = m_LastSendTime;
+	}
+	m_NumUnsent = 0;
+	m_pTimers->Cancel(&m_FlushTimer);
+	m_pTimers->Insert(&m_KeepaliveTimer, m_LastSendTime + time_freq()*NET_KEEPALIVE_INTERVAL/1000);
+
+	// the next chunk takes a new construct
+	m_pNetBase->ConstructPool()->Free(m_pConstruct);
+	m_pConstruct = 0;
+	return NumChunks;
+}
+
+int CNetConnection::QueueChunkEx(int Flags, int DataSize, const void *pData, int Sequence)
+{
+	// check if we have space for it, if not, flush the connection
+	if(m_pConstruct && (m_pConstruct->m_DataSize + DataSize + NET_MAX_CHUNKHEADERSIZE > (int)sizeof(m_pConstruct->m_aChunkData) || m_pConstruct->m_NumChunks == NET_MAX_PACKET_CHUNKS))
+		Flush();
+
+	if(!m_pConstruct)
+	{
+		m_pConstruct = (CNetPacketConstruct *)m_pNetBase->ConstructPool()->Allocate();
+		if(!m_pConstruct)
+		{
+			SetError("out of memory");
+			return -1;
+		}
+		m_pConstruct->m_Flags = 0;
+		m_pConstruct->m_NumChunks = 0;
+		m_pConstruct->m_DataSize = 0;
+
+		// the first chunk of a packet decides when it has to go out
+		m_pTimers->Insert(&m_FlushTimer, m_pTimers->Now() + m_FlushDelay);
+	}
+
+	// pack all the data
+	CNetChunkHeader Header;
+	Header.m_Flags = Flags;
+	Header.m_Size = DataSize;
+	Header.m_Sequence = Sequence;
+	unsigned char *pChunkData = &m_pConstruct->m_aChunkData[m_pConstruct->m_DataSize];
+	pChunkData = Header.Pack(pChunkData);
+	mem_copy(pChunkData, pData, DataSize);
+	pChunkData += DataSize;
+
+	m_pConstruct->m_NumChunks++;
+	m_pConstruct->m_DataSize = (int)(pChunkData-m_pConstruct->m_aChunkData);
+
+	if(Flags&NET_CHUNKFLAG_VITAL && !(Flags&NET_CHUNKFLAG_RESEND))
+	{
+		// save packet if we need to resend
+		CNetChunkResend *pResend = m_Buffer.Allocate(Sequence, DataSize);
+		if(!pResend)
+		{
+			SetError("too weak connection (out of buffer)");
+			return -1;
+		}
+		pResend->m_Flags = Flags;
+		mem_copy(pResend->m_pData, pData, DataSize);
+		pResend->m_FirstSendTime = m_pTimers->Now();
+		pResend->m_LastSendTime = pResend->m_FirstSendTime;
+		m_NumUnsent++;
+
+		if(!m_ResendTimer.Pending())
+			m_pTimers->Insert(&m_ResendTimer, pResend->m_FirstSendTime + m_Rto);
+	}
+	return 0;
+}
+
+int CNetConnection::QueueChunk(int Flags, int DataSize, const void *pData)
+{
+	if(m_State != NET_CONNSTATE_ONLINE)
+		return -1;
+
+	if(DataSize > NET_MAX_PAYLOAD - NET_MAX_CHUNKHEADERSIZE)
+	{
+		dbg_msg("connection", "chunk payload too big. %d. dropping chunk", DataSize);
+		return -1;
+	}
+
+	if(Flags&NET_CHUNKFLAG_VITAL)
+		m_Sequence = (m_Sequence+1)%NET_MAX_SEQUENCE;
+	return QueueChunkEx(Flags, DataSize, pData, m_Sequence);
+}
+
+// rfc 6298
+void CNetConnection::UpdateRtt(int64_t Rtt)
+{
+	if(!m_SmoothedRtt)
+	{
+		m_SmoothedRtt = Rtt > 0 ? Rtt : 1;
+		m_RttVar = Rtt/2;
+	}
+	else
+	{
+		int64_t Diff = m_SmoothedRtt > Rtt ? m_SmoothedRtt-Rtt : Rtt-m_SmoothedRtt;
+		m_RttVar = (3*m_RttVar + Diff)/4;
+		m_SmoothedRtt = (7*m_SmoothedRtt + Rtt)/8;
+	}
+
+	m_Rto = m_SmoothedRtt + 4*m_RttVar;
+	if(m_Rto < time_freq()*NET_RTO_MIN/1000)
+		m_Rto = time_freq()*NET_RTO_MIN/1000;
+	if(m_Rto > time_freq()*NET_RTO_MAX/1000)
+		m_Rto = time_freq()*NET_RTO_MAX/1000;
+}
+
+void CNetConnection::AckChunks(int Ack)
+{
+	// karn: only chunks that weren't resent tell how long the ack took
+	CNetChunkResend *pResend = m_Buffer.Find(Ack);
+	if(pResend && pResend->m_LastSendTime == pResend->m_FirstSendTime)
+		UpdateRtt(m_pTimers->Now()-pResend->m_FirstSendTime);
+
+	m_Buffer.Release(Ack);
+
+	// the oldest chunk left can't be due before this, the timer finds out
+	// the exact time when it fires
+	if(m_Buffer.NumEntries())
+		m_pTimers->Insert(&m_ResendTimer, m_Buffer.Get(0)->m_FirstSendTime + m_Rto + 1);
+	else
+		m_pTimers->Cancel(&m_ResendTimer);
+}
+
+// a failed resend may have broken the connection, the resend buffer is
+// gone then and pResend with it
+int CNetConnection::ResendChunk(CNetChunkResend *pResend)
+{
+	if(QueueChunkEx(pResend->m_Flags|NET_CHUNKFLAG_RESEND, pResend->m_DataSize, pResend->m_pData, pResend->m_Sequence) != 0)
+		return -1;
+	pResend->m_LastSendTime = m_pTimers->Now();
+	return 0;
+}
+
+void CNetConnection::ResendChunks()
+{
+	for(int i = 0; i < m_Buffer.NumEntries() && m_State == NET_CONNSTATE_ONLINE; i++)
+		if(ResendChunk(m_Buffer.Get(i)) != 0)
+			break;
+}
+
+int CNetConnection::Feed(const CNetPacketConstruct *pPacket, const unsigned char *pData)
+{
+	if(State() == NET_CONNSTATE_OFFLINE || State() == NET_CONNSTATE_ERROR)
+		return 0;
+	if(pPacket->m_Flags&NET_PACKETFLAG_CONNLESS)
+		return 0;
+
+	// the peer has to know our token
+	if(pPacket->m_Token != m_Token)
+		return 0;
+
+	if(pPacket->m_Flags&NET_PACKETFLAG_CONTROL)
+	{
+		int CtrlMsg = pPacket->m_DataSize > 0 ? pData[0] : -1;
+		if(CtrlMsg == NET_CTRLMSG_CLOSE)
+		{
+			char aReason[128] = "closed by peer";
+			if(pPacket->m_DataSize > 1)
+			{
+				int Size = pPacket->m_DataSize-1 < (int)sizeof(aReason)-1 ? pPacket->m_DataSize-1 : (int)sizeof(aReason)-1;
+				mem_copy(aReason, &pData[1], Size);
+				aReason[Size] = 0;
+			}
+			SetError(aReason);
+			return 0;
+		}
+		else if(CtrlMsg == NET_CTRLMSG_TOKEN)
+		{
+			// send the connect right away, a token equal to the cached one
+			// means the connect is already on its way
+			if((State() == NET_CONNSTATE_TOKEN || State() == NET_CONNSTATE_CONNECT)
+				&& pPacket->m_ResponseToken != NET_TOKEN_NONE && pPacket->m_ResponseToken != m_PeerToken)
+			{
+				m_PeerToken = pPacket->m_ResponseToken;
+				m_CachedPeerToken = false;
+				m_pNetBase->TokenCache()->AddToken(&m_PeerAddr, m_PeerToken, m_pTimers->Now());
+				m_State = NET_CONNSTATE_CONNECT;
+				SendControlWithToken(NET_CTRLMSG_CONNECT);
+				m_pTimers->Insert(&m_ConnectTimer, m_pTimers->Now() + time_freq()*NET_CONNECT_RETRY/1000);
+			}
+		}
+		else if(CtrlMsg == NET_CTRLMSG_ACCEPT && State() == NET_CONNSTATE_CONNECT)
+		{
+			// connection made
+			if(!m_CachedPeerToken)
+				m_pNetBase->TokenCache()->AddToken(&m_PeerAddr, m_PeerToken, m_pTimers->Now());
+			SetOnline();
+		}
+	}
+
+	if(State() != NET_CONNSTATE_ONLINE)
+		return 0;
+
+	// the timeout timer checks this when it fires
+	m_LastRecvTime = m_pTimers->Now();
+
+	AckChunks(pPacket->m_Ack);
+
+	// the peer missed some of our vital chunks
+	if(pPacket->m_Flags&NET_PACKETFLAG_RESEND)
+		ResendChunks();
+
+	return !(pPacket->m_Flags&NET_PACKETFLAG_CONTROL);
+}
+
+void CNetConnection::ResendTimerCallback(CTimer *pTimer, void *pUser)
+{
+	CNetConnection *pThis = (CNetConnection *)pUser;
+	if(pThis->m_State != NET_CONNSTATE_ONLINE || !pThis->m_Buffer.NumEntries())
+		return;
+
+	int64_t Now = pThis->m_pTimers->Now();
+
+	// check if we have some really old stuff laying around and abort if not acked
+	int64_t GiveUp = pThis->m_Buffer.Get(0)->m_FirstSendTime + time_freq()*NET_RESEND_GIVEUP/1000;
+	if(Now > GiveUp)
+	{
+		char aBuf[128];
+		str_format(aBuf, sizeof(aBuf), "too weak connection (not acked for %d seconds)", NET_RESEND_GIVEUP/1000);
+		pThis->SetError(aBuf);
+		return;
+	}
+
+	// resend vital chunks that weren't acked within the timeout. the entries
+	// are ordered by their first send time, so the scan stops at the first
+	// one that is too young to be due
+	bool Resent = false;
+	int64_t NextSend = -1;
+	for(int i = 0; i < pThis->m_Buffer.NumEntries(); i++)
+	{
+		CNetChunkResend *pResend = pThis->m_Buffer.Get(i);
+		if(Now-pResend->m_FirstSendTime <= pThis->m_Rto)
+		{
+			if(NextSend < 0 || pResend->m_FirstSendTime < NextSend)
+				NextSend = pResend->m_FirstSendTime;
+			break;
+		}
+		if(Now-pResend->m_LastSendTime > pThis->m_Rto)
+		{
+			// the error cancelled the timer already
+			if(pThis->ResendChunk(pResend) != 0 || pThis->m_State != NET_CONNSTATE_ONLINE)
+				return;
+			Resent = true;
+		}
+		else if(NextSend < 0 || pResend->m_LastSendTime < NextSend)
+			NextSend = pResend->m_LastSendTime;
+	}
+
+	// back off until a chunk gets through without being resent
+	if(Resent)
+	{
+		pThis->m_Rto *= 2;
+		if(pThis->m_Rto > time_freq()*NET_RTO_MAX/1000)
+			pThis->m_Rto = time_freq()*NET_RTO_MAX/1000;
+		if(NextSend < 0 || Now < NextSend)
+			NextSend = Now;
+	}
+
+	int64_t Next = NextSend + pThis->m_Rto + 1;
+	pThis->m_pTimers->Insert(pTimer, Next < GiveUp+1 ? Next : GiveUp+1);
+}
+
+void CNetConnection::KeepaliveTimerCallback(CTimer *, void *pUser)
+{
+	CNetConnection *pThis = (CNetConnection *)pUser;
+	if(pThis->m_State == NET_CONNSTATE_ONLINE)
+		pThis->SendControl(NET_CTRLMSG_KEEPALIVE, 0, 0, pThis->m_PeerToken);
+}
+
+void CNetConnection::TimeoutTimerCallback(CTimer *pTimer, void *pUser)
+{
+	CNetConnection *pThis = (CNetConnection *)pUser;
+	bool Connecting = pThis->m_State == NET_CONNSTATE_TOKEN || pThis->m_State == NET_CONNSTATE_CONNECT;
+	int64_t Timeout = pThis->m_LastRecvTime + time_freq()*(Connecting ? NET_CONNECT_TIMEOUT : NET_CONN_TIMEOUT)/1000;
+	if(pThis->m_pTimers->Now() > Timeout)
+		pThis->SetError(Connecting ? "Unable to connect to the server" : "Timeout");
+	else
+		pThis->m_pTimers->Insert(pTimer, Timeout+1);
+}
+
+void CNetConnection::ConnectTimerCallback(CTimer *pTimer, void *pUser)
+{
+	// the request or its answer got lost, ask again
+	CNetConnection *pThis = (CNetConnection *)pUser;
+	if(pThis->m_State == NET_CONNSTATE_CONNECT)
+		pThis->SendControlWithToken(NET_CTRLMSG_CONNECT);
+	if(pThis->m_State == NET_CONNSTATE_TOKEN || pThis->m_CachedPeerToken)
+		pThis->SendControlWithToken(NET_CTRLMSG_TOKEN);
+	pThis->m_pTimers->Insert(pTimer, pThis->m_pTimers->Now() + time_freq()*NET_CONNECT_RETRY/1000);
+}
+
+void CNetConnection::FlushTimerCallback(CTimer *, void *pUser)
+{
+	// send the queued chunks once the oldest one waited long enough
+	((CNetConnection *)pUser)->Flush();
+}
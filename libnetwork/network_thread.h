@@ -0,0 +1,286 @@
+/* (c) Magnus Auvinen. See licence.txt in the root of the distribution for more information. */
+/* If you are missing that file, acquire a complete release at teeworlds.com.                */
+
+CNetIoThread::CNetIoThread()
+{
+	m_pClient = 0;
+	m_pThread = 0;
+	m_Cpu = -1;
+	m_CommandFd = -1;
+	m_EventFd = -1;
+	m_State = STATE_AWAKE;
+	m_HoldingEvent = false;
+	m_pConnStates = 0;
+}
+
+int CNetIoThread::Start(CNetClient *pClient, int Cpu)
+{
+	Stop();
+	m_pClient = pClient;
+	m_Cpu = Cpu;
+	m_State = STATE_AWAKE;
+	m_HoldingEvent = false;
+	if(m_Commands.Init(sizeof(CMessage), NET_THREAD_COMMANDS) != 0 || m_Events.Init(NET_THREAD_EVENT_BYTES) != 0)
+		return -1;
+	m_CommandFd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	m_EventFd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if(m_CommandFd < 0 || m_EventFd < 0)
+	{
+		dbg_msg("libtwnetwork", "could not create the thread fds (%d '%s')", errno, strerror(errno));
+		Stop();
+		return -1;
+	}
+	m_pConnStates = new int[pClient->MaxConnections()];
+	PublishStates();
+	sem_init(&m_Paused, 0, 0);
+	sem_init(&m_Resume, 0, 0);
+
+	pClient->WatchFd(m_CommandFd, true);
+	m_pThread = thread_init(ThreadFunc, this);
+	if(!m_pThread)
+	{
+		Stop();
+		return -1;
+	}
+	return 0;
+}
+
+void CNetIoThread::Stop()
+{
+	if(m_pThread)
+	{
+		PushCommand(CMD_STOP);
+		thread_wait(m_pThread);
+		m_pThread = 0;
+	}
+	if(m_pConnStates)
+	{
+		sem_destroy(&m_Paused);
+		sem_destroy(&m_Resume);
+		delete[] m_pConnStates;
+		m_pConnStates = 0;
+	}
+	if(m_CommandFd >= 0)
+	{
+		m_pClient->WatchFd(m_CommandFd, false);
+		close(m_CommandFd);
+	}
+	if(m_EventFd >= 0)
+		close(m_EventFd);
+	m_CommandFd = -1;
+	m_EventFd = -1;
+	m_Commands.Free();
+	m_Events.Free();
+}
+
+void CNetIoThread::ThreadFunc(void *pUser)
+{
+	((CNetIoThread *)pUser)->Run();
+}
+
+void CNetIoThread::Run()
+{
+	if(m_Cpu >= 0)
+		thread_pin_cpu(m_Cpu);
+
+	while(1)
+	{
+		// announce the sleep before the last look at the queues, a
+		// command or a free event slot either shows up here or the
+		// caller sees the state and rings m_CommandFd
+		__atomic_store_n(&m_State, STATE_FULL, __ATOMIC_SEQ_CST);
+		bool Room = m_Events.CanPush(sizeof(CMessage));
+		if(Room)
+			__atomic_store_n(&m_State, STATE_SLEEPING, __ATOMIC_SEQ_CST);
+		if(!m_Commands.Front())
+		{
+			if(Room)
+				m_pClient->Wait(-1);
+			else
+				WaitForRoom();
+		}
+		__atomic_store_n(&m_State, STATE_AWAKE, __ATOMIC_SEQ_CST);
+		eventfd_t Value;
+		eventfd_read(m_CommandFd, &Value);
+
+		if(!RunCommands())
+			break;
+		m_pClient->Update();
+
+		// chunks stay with the client while there's no room for them
+		int NumEvents = 0;
+		CMessage *pEvent;
+		CNetChunk Chunk;
+		TOKEN ResponseToken = NET_TOKEN_NONE;
+		while((pEvent = (CMessage *)m_Events.BeginPush(sizeof(CMessage))) && m_pClient->Recv(&Chunk, &ResponseToken))
+		{
+			pEvent->m_ConnID = Chunk.m_ClientID;
+			pEvent->m_Flags = Chunk.m_Flags;
+			pEvent->m_DataSize = Chunk.m_DataSize;
+			pEvent->m_Addr = Chunk.m_Address;
+			pEvent->m_ResponseToken = ResponseToken;
+			mem_copy(pEvent->m_aData, Chunk.m_pData, Chunk.m_DataSize);
+			m_Events.EndPush(offsetof(CMessage, m_aData)+Chunk.m_DataSize);
+			NumEvents++;
+		}
+		PublishStates();
+		if(NumEvents)
+			eventfd_write(m_EventFd, 1);
+	}
+}
+
+bool CNetIoThread::RunCommands()
+{
+	CMessage *pCommand;
+	while((pCommand = (CMessage *)m_Commands.Front()))
+	{
+		int Type = pCommand->m_Type;
+		if(Type == CMD_SEND)
+		{
+			// everything flushed in this round goes out in one batch with the update
+			int Flags = pCommand->m_Flags;
+			if(m_pClient->Send(pCommand->m_ConnID, pCommand->m_aData, pCommand->m_DataSize, Flags&~NETSENDFLAG_FLUSH) == 0 && Flags&NETSENDFLAG_FLUSH)
+				m_pClient->Connection(pCommand->m_ConnID)->Flush();
+		}
+		m_Commands.Pop();
+
+		if(Type == CMD_PAUSE)
+		{
+			m_pClient->FlushSend();
+			sem_post(&m_Paused);
+			while(sem_wait(&m_Resume) != 0)
+				;
+		}
+		else if(Type == CMD_STOP)
+			return false;
+	}
+	return true;
+}
+
+void CNetIoThread::WaitForRoom()
+{
+	// the timers still have to run
+	int64_t Expiry = m_pClient->Timers()->NextExpiry();
+	int TimeoutMs = -1;
+	if(Expiry >= 0)
+	{
+		int64_t Left = Expiry - time_get();
+		TimeoutMs = Left > 0 ? (int)((Left*1000+time_freq()-1)/time_freq()) : 0;
+	}
+	struct pollfd Fd;
+	Fd.fd = m_CommandFd;
+	Fd.events = POLLIN;
+	Fd.revents = 0;
+	poll(&Fd, 1, TimeoutMs);
+}
+
+void CNetIoThread::PublishStates()
+{
+	for(int i = 0; i < m_pClient->MaxConnections(); i++)
+		__atomic_store_n(&m_pConnStates[i], m_pClient->Connection(i)->State(), __ATOMIC_RELAXED);
+}
+
+void CNetIoThread::PushCommand(int Type)
+{
+	CMessage *pCommand;
+	while(!(pCommand = (CMessage *)m_Commands.BeginPush()))
+		sched_yield();
+	pCommand->m_Type = Type;
+	m_Commands.EndPush(pCommand);
+	WakeThread();
+}
+
+void CNetIoThread::WakeThread()
+{
+	if(__atomic_exchange_n(&m_State, (int)STATE_AWAKE, __ATOMIC_SEQ_CST) != STATE_AWAKE)
+		eventfd_write(m_CommandFd, 1);
+}
+
+int CNetIoThread::Send(int ConnID, const void *pData, int DataSize, int Flags)
+{
+	if(Flags&NETSENDFLAG_CONNLESS)
+	{
+		dbg_msg("libtwnetwork", "connless chunks are not supported, dropping chunk");
+		return -1;
+	}
+	if(ConnID < 0 || ConnID >= m_pClient->MaxConnections() || DataSize < 0 || DataSize > NET_MAX_PAYLOAD)
+		return -1;
+
+	CMessage *pCommand = (CMessage *)m_Commands.BeginPush();
+	if(!pCommand)
+		return -1;
+	pCommand->m_Type = CMD_SEND;
+	pCommand->m_ConnID = ConnID;
+	pCommand->m_Flags = Flags;
+	pCommand->m_DataSize = DataSize;
+	mem_copy(pCommand->m_aData, pData, DataSize);
+	m_Commands.EndPush(pCommand);
+	WakeThread();
+	return 0;
+}
+
+int CNetIoThread::Recv(CNetChunk *pChunk, TOKEN *pResponseToken)
+{
+	if(m_HoldingEvent)
+	{
+		m_Events.Pop();
+		m_HoldingEvent = false;
+		int Full = STATE_FULL;
+		if(__atomic_compare_exchange_n(&m_State, &Full, (int)STATE_AWAKE, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			eventfd_write(m_CommandFd, 1);
+	}
+
+	CMessage *pEvent = (CMessage *)m_Events.Front();
+	if(!pEvent)
+	{
+		// reset the fd before the last look, an event pushed after that sets it again
+		eventfd_t Value;
+		eventfd_read(m_EventFd, &Value);
+		pEvent = (CMessage *)m_Events.Front();
+		if(!pEvent)
+			return 0;
+	}
+
+	pChunk->m_ClientID = pEvent->m_ConnID;
+	pChunk->m_Address = pEvent->m_Addr;
+	pChunk->m_Flags = pEvent->m_Flags;
+	pChunk->m_DataSize = pEvent->m_DataSize;
+	pChunk->m_pData = pEvent->m_aData;
+	if(pResponseToken)
+		*pResponseToken = pEvent->m_ResponseToken;
+	m_HoldingEvent = true;
+	return 1;
+}
+
+int CNetIoThread::Wait(int TimeoutMs)
+{
+	// the held event may not be the last one
+	if(m_HoldingEvent || m_Events.Front())
+		return 1;
+	struct pollfd Fd;
+	Fd.fd = m_EventFd;
+	Fd.events = POLLIN;
+	Fd.revents = 0;
+	return poll(&Fd, 1, TimeoutMs);
+}
+
+int CNetIoThread::ConnState(int ConnID) const
+{
+	if(ConnID < 0 || ConnID >= m_pClient->MaxConnections())
+		return -1;
+	return __atomic_load_n(&m_pConnStates[ConnID], __ATOMIC_RELAXED);
+}
+
+void CNetIoThread::Pause()
+{
+	PushCommand(CMD_PAUSE);
+	while(sem_wait(&m_Paused) != 0)
+		;
+}
+
+void CNetIoThread::Resume()
+{
+	// the thread is parked, the states can be copied from here
+	PublishStates();
+	sem_post(&m_Resume);
+}
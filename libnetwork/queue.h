@@ -0,0 +1,241 @@
+/* (c) Magnus Auvinen. See licence.txt in the root of the distribution for more information. */
+/* If you are missing that file, acquire a complete release at teeworlds.com.                */
+
+/*
+	Lock-free queues between the I/O thread of a client and its callers.
+
+	CNetSpscQueue is a byte ring for records of any size with one writer
+	and one reader, laid out like the log queues of system.h.
+	CNetMpscQueue has slots of one size and takes any number of writers,
+	every slot carries a sequence that tells whether it's free or filled
+	(the bounded queue of Dmitry Vyukov).
+
+	Both hand out pointers into the ring: the writer fills a record in
+	place and publishes it, the reader pops it once it's done with it.
+	Publishing and the last look of the reader are sequentially
+	consistent, so a "sleeping" flag next to the queue works like
+	log_sleeping does.
+*/
+
+class CNetSpscQueue
+{
+	enum
+	{
+		ALIGNMENT=8,
+		HEADERSIZE=8, // the size of the record, padded to the alignment
+		WRAP=0xffffffff, // rest of the ring is unused, go on at the start
+	};
+
+	unsigned char *m_pData;
+	unsigned m_Size; // a power of two
+	unsigned m_PushHead; // head after the record of BeginPush
+	unsigned m_PopTail; // tail after the record of Front
+	// each one is written by one side only, they get their own cache lines
+	alignas(64) unsigned m_Head;
+	alignas(64) unsigned m_Tail;
+
+	static unsigned RecordSize(int Size) { return (HEADERSIZE+Size+ALIGNMENT-1)&~(ALIGNMENT-1); }
+
+	// where a record of Size goes, ~0 if there's no room
+	unsigned Reserve(int Size) const
+	{
+		unsigned Head = m_Head;
+		unsigned Tail = __atomic_load_n(&m_Tail, __ATOMIC_SEQ_CST);
+		unsigned Need = RecordSize(Size);
+		unsigned Contiguous = m_Size-(Head&(m_Size-1));
+		unsigned Total = Need <= Contiguous ? Need : Contiguous+Need;
+		if(m_Size-(Head-Tail) < Total)
+			return ~0u;
+		return Need <= Contiguous ? Head : Head+Contiguous;
+	}
+
+public:
+	CNetSpscQueue()
+	{
+		m_pData = 0;
+		m_Size = 0;
+		m_Head = 0;
+		m_Tail = 0;
+		m_PushHead = 0;
+		m_PopTail = 0;
+	}
+
+	~CNetSpscQueue() { Free(); }
+
+	// Size is rounded up to a power of two
+	int Init(int Size)
+	{
+		Free();
+		unsigned RingSize = 64;
+		while(RingSize < (unsigned)Size)
+			RingSize <<= 1;
+		m_pData = (unsigned char *)mem_alloc(RingSize);
+		if(!m_pData)
+			return -1;
+		m_Size = RingSize;
+		m_Head = 0;
+		m_Tail = 0;
+		return 0;
+	}
+
+	void Free()
+	{
+		mem_free(m_pData);
+		m_pData = 0;
+		m_Size = 0;
+	}
+
+	// writer side. room for MaxSize bytes, 0 if the ring is full. nothing
+	// is visible to the reader until EndPush
+	void *BeginPush(int MaxSize)
+	{
+		unsigned Pos = Reserve(MaxSize);
+		if(Pos == ~0u)
+			return 0;
+		if(Pos != m_Head)
+		{
+			unsigned Wrap = WRAP;
+			mem_copy(&m_pData[m_Head&(m_Size-1)], &Wrap, sizeof(Wrap));
+		}
+		m_PushHead = Pos;
+		return &m_pData[(Pos&(m_Size-1))+HEADERSIZE];
+	}
+
+	// publishes the record, Size can be less than the MaxSize of BeginPush
+	void EndPush(int Size)
+	{
+		unsigned RecordBytes = Size;
+		mem_copy(&m_pData[m_PushHead&(m_Size-1)], &RecordBytes, sizeof(RecordBytes));
+		__atomic_store_n(&m_Head, m_PushHead+RecordSize(Size), __ATOMIC_SEQ_CST);
+	}
+
+	bool CanPush(int Size) const { return Reserve(Size) != ~0u; }
+
+	// reader side. the oldest record, 0 if there is none. it stays valid
+	// until Pop
+	void *Front(int *pSize = 0)
+	{
+		unsigned Tail = m_Tail;
+		unsigned Head = __atomic_load_n(&m_Head, __ATOMIC_SEQ_CST);
+		while(Tail != Head)
+		{
+			unsigned Pos = Tail&(m_Size-1);
+			unsigned Size;
+			mem_copy(&Size, &m_pData[Pos], sizeof(Size));
+			if(Size == WRAP)
+			{
+				Tail += m_Size-Pos;
+				continue;
+			}
+			m_PopTail = Tail+RecordSize(Size);
+			if(pSize)
+				*pSize = Size;
+			return &m_pData[Pos+HEADERSIZE];
+		}
+		return 0;
+	}
+
+	// drops the record of the last Front
+	void Pop() { __atomic_store_n(&m_Tail, m_PopTail, __ATOMIC_SEQ_CST); }
+};
+
+class CNetMpscQueue
+{
+	struct CSlotHeader
+	{
+		unsigned m_Sequence; // position+1 once filled, position+NumSlots once free again
+		unsigned m_Position; // set by the writer that took the slot
+	};
+
+	unsigned char *m_pSlots;
+	unsigned m_SlotSize;
+	unsigned m_NumSlots; // a power of two
+	alignas(64) unsigned m_EnqueuePos;
+	alignas(64) unsigned m_DequeuePos;
+
+	CSlotHeader *Slot(unsigned Pos) const { return (CSlotHeader *)&m_pSlots[(Pos&(m_NumSlots-1))*m_SlotSize]; }
+
+public:
+	CNetMpscQueue()
+	{
+		m_pSlots = 0;
+		m_SlotSize = 0;
+		m_NumSlots = 0;
+		m_EnqueuePos = 0;
+		m_DequeuePos = 0;
+	}
+
+	~CNetMpscQueue() { Free(); }
+
+	// NumSlots is rounded up to a power of two
+	int Init(int RecordSize, int NumSlots)
+	{
+		Free();
+		unsigned Slots = 1;
+		while(Slots < (unsigned)NumSlots)
+			Slots <<= 1;
+		m_SlotSize = (sizeof(CSlotHeader)+RecordSize+63)&~63;
+		m_pSlots = (unsigned char *)mem_alloc(Slots*m_SlotSize);
+		if(!m_pSlots)
+			return -1;
+		m_NumSlots = Slots;
+		for(unsigned i = 0; i < Slots; i++)
+			Slot(i)->m_Sequence = i;
+		m_EnqueuePos = 0;
+		m_DequeuePos = 0;
+		return 0;
+	}
+
+	void Free()
+	{
+		mem_free(m_pSlots);
+		m_pSlots = 0;
+		m_NumSlots = 0;
+	}
+
+	// writer side, any thread. a free record, 0 if the queue is full
+	void *BeginPush()
+	{
+		unsigned Pos = __atomic_load_n(&m_EnqueuePos, __ATOMIC_RELAXED);
+		while(1)
+		{
+			CSlotHeader *pSlot = Slot(Pos);
+			int Diff = (int)(__atomic_load_n(&pSlot->m_Sequence, __ATOMIC_ACQUIRE)-Pos);
+			if(Diff == 0)
+			{
+				if(__atomic_compare_exchange_n(&m_EnqueuePos, &Pos, Pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				{
+					pSlot->m_Position = Pos;
+					return pSlot+1;
+				}
+			}
+			else if(Diff < 0)
+				return 0;
+			else
+				Pos = __atomic_load_n(&m_EnqueuePos, __ATOMIC_RELAXED);
+		}
+	}
+
+	// publishes a record of BeginPush
+	void EndPush(void *pRecord)
+	{
+		CSlotHeader *pSlot = (CSlotHeader *)pRecord-1;
+		__atomic_store_n(&pSlot->m_Sequence, pSlot->m_Position+1, __ATOMIC_SEQ_CST);
+	}
+
+	// reader side, one thread. the oldest record, 0 if there is none. it
+	// stays valid until Pop
+	void *Front()
+	{
+		CSlotHeader *pSlot = Slot(m_DequeuePos);
+		if(__atomic_load_n(&pSlot->m_Sequence, __ATOMIC_SEQ_CST) != m_DequeuePos+1)
+			return 0;
+		return pSlot+1;
+	}
+
+	void Pop()
+	{
+		__atomic_store_n(&Slot(m_DequeuePos)->m_Sequence, m_DequeuePos+m_NumSlots, __ATOMIC_RELEASE);
+		m_DequeuePos++;
+	}
+};
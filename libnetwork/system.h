@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
@@ -25,9 +26,17 @@
 #include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/timerfd.h>
 #include <arpa/inet.h>
+#include <linux/filter.h>
 
 #include <dirent.h>
 
@@ -60,6 +69,27 @@ typedef struct
 	unsigned short reserved;
 } NETADDR;
 
+/* one datagram of net_udp_recv_batch and net_udp_send_batch */
+typedef struct
+{
+	NETADDR addr;
+	void *data;
+	int size; /* for receiving the size of the buffer, then the size of the datagram */
+} NETPACKET;
+
+enum
+{
+	NET_BATCH_MAX = 64, /* most datagrams per batch call */
+
+	/* offloads of net_udp_features */
+	NETSOCKET_GSO = 1, /* UDP_SEGMENT, one send for many datagrams to a peer */
+	NETSOCKET_GRO = 2, /* UDP_GRO, one receive for many datagrams from a peer */
+
+	NET_GSO_MAX_SEGMENTS = 64,
+	NET_GSO_MAX_BYTES = 65000, /* the udp length has to fit into 16 bits with the headers */
+	NET_GRO_BUFFER_SIZE = 65536,
+};
+
 void *mem_alloc(unsigned size)
 {
 	return malloc(size);
@@ -85,6 +115,11 @@ void mem_zero(void *block,unsigned size)
 	memset(block, 0, size);
 }
 
+int mem_comp(const void *a, const void *b, int size)
+{
+	return memcmp(a,b,size);
+}
+
 int str_length(const char *str)
 {
 	return (int)strlen(str);
@@ -108,6 +143,13 @@ void str_append(char *dst, const char *src, int dst_size)
 	dst[dst_size-1] = 0; /* assure null termination */
 }
 
+void str_copy(char *dst, const char *src, int dst_size)
+{
+	size_t len = strnlen(src, dst_size-1);
+	memcpy(dst, src, len);
+	dst[len] = 0; /* assure null termination */
+}
+
 void str_format(char *buffer, int buffer_size, const char *format, ...)
 {
 	va_list ap;
@@ -263,6 +305,8 @@ void str_hex(char *dst, int dst_size, const void *data, int data_size)
 	static const char hex[] = "0123456789ABCDEF";
 	int b;
 
+	if(dst_size > 0)
+		dst[0] = 0;
 	for(b = 0; b < data_size && b < dst_size/4-4; b++)
 	{
 		dst[b*3] = hex[((const unsigned char *)data)[b]>>4];
@@ -303,17 +347,202 @@ void str_timestamp(char *buffer, int buffer_size)
 #pragma GCC diagnostic pop
 #endif
 
+/*
+	dbg_msg only formats the line and puts it into a queue of the calling
+	thread, a background thread writes the queues to stdout. every queue
+	is a byte ring with one writer and one reader. when it's full the line
+	is dropped and counted, the writer reports the drops.
+*/
+enum
+{
+	LOG_QUEUE_SIZE = 64*1024, /* bytes, a power of two */
+	LOG_MAX_LINE = 1024*4,
+	LOG_WRAP = 0xffffffff, /* rest of the ring is unused, go on at the start */
+};
+
+typedef struct LOG_QUEUE
+{
+	struct LOG_QUEUE *next;
+	int in_use; /* owned by a thread */
+	unsigned head; /* written by the owner */
+	unsigned tail; /* written by the log thread */
+	unsigned dropped;
+	char data[LOG_QUEUE_SIZE];
+} LOG_QUEUE;
+
+static LOG_QUEUE *log_queues = 0;
+static __thread LOG_QUEUE *log_thread_queue = 0;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_queue_key;
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t log_sem;
+static int log_sleeping = 0; /* the log thread waits for log_sem */
+static int log_async = 0;
+
+static void log_drain()
+{
+	LOG_QUEUE *queue;
+	pthread_mutex_lock(&log_drain_lock);
+	for(queue = __atomic_load_n(&log_queues, __ATOMIC_ACQUIRE); queue; queue = queue->next)
+	{
+		unsigned tail = queue->tail;
+		unsigned head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+		unsigned dropped;
+		while(tail != head)
+		{
+			unsigned pos = tail&(LOG_QUEUE_SIZE-1);
+			unsigned len;
+			mem_copy(&len, &queue->data[pos], sizeof(len));
+			if(len == LOG_WRAP)
+			{
+				tail += LOG_QUEUE_SIZE-pos;
+				continue;
+			}
+			fwrite(&queue->data[pos+sizeof(len)], 1, len, stdout);
+			fputc('\n', stdout);
+			tail += (sizeof(len)+len+3)&~3;
+		}
+		__atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+
+		dropped = __atomic_exchange_n(&queue->dropped, 0, __ATOMIC_RELAXED);
+		if(dropped)
+			printf("[log]: dropped %u messages\n", dropped);
+	}
+	fflush(stdout);
+	pthread_mutex_unlock(&log_drain_lock);
+}
+
+static int log_pending()
+{
+	LOG_QUEUE *queue;
+	for(queue = __atomic_load_n(&log_queues, __ATOMIC_ACQUIRE); queue; queue = queue->next)
+		if(__atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) != queue->tail)
+			return 1;
+	return 0;
+}
+
+static void *log_thread(void *)
+{
+	while(1)
+	{
+		/* announce the sleep before the last look, so a line pushed in
+		   between either is seen here or wakes us up */
+		__atomic_store_n(&log_sleeping, 1, __ATOMIC_SEQ_CST);
+		if(!log_pending())
+		{
+			while(sem_wait(&log_sem) != 0)
+				;
+		}
+		__atomic_store_n(&log_sleeping, 0, __ATOMIC_SEQ_CST);
+		log_drain();
+	}
+	return 0;
+}
+
+static void log_release_queue(void *queue)
+{
+	/* the lines stay until they are written, the next thread reuses the queue */
+	__atomic_store_n(&((LOG_QUEUE *)queue)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void log_init()
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	if(sem_init(&log_sem, 0, 0) != 0 || pthread_key_create(&log_queue_key, log_release_queue) != 0)
+		return;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&thread, &attr, log_thread, 0) == 0)
+	{
+		log_async = 1;
+		atexit(log_drain);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static LOG_QUEUE *log_get_queue()
+{
+	LOG_QUEUE *queue;
+	if(log_thread_queue)
+		return log_thread_queue;
+
+	/* take over the queue of a thread that ended or add a new one */
+	for(queue = __atomic_load_n(&log_queues, __ATOMIC_ACQUIRE); queue; queue = queue->next)
+	{
+		int expected = 0;
+		if(__atomic_compare_exchange_n(&queue->in_use, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			break;
+	}
+	if(!queue)
+	{
+		queue = (LOG_QUEUE *)calloc(1, sizeof(LOG_QUEUE));
+		if(!queue)
+			return 0;
+		queue->in_use = 1;
+		queue->next = __atomic_load_n(&log_queues, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&log_queues, &queue->next, queue, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+	pthread_setspecific(log_queue_key, queue);
+	log_thread_queue = queue;
+	return queue;
+}
+
+static void log_push(LOG_QUEUE *queue, const char *line, unsigned len)
+{
+	unsigned need = (sizeof(len)+len+3)&~3;
+	unsigned head = queue->head;
+	unsigned tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+	unsigned pos = head&(LOG_QUEUE_SIZE-1);
+	unsigned contiguous = LOG_QUEUE_SIZE-pos;
+	unsigned total = need <= contiguous ? need : contiguous+need;
+
+	if(LOG_QUEUE_SIZE-(head-tail) < total)
+	{
+		__atomic_fetch_add(&queue->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if(need > contiguous)
+	{
+		unsigned wrap = LOG_WRAP;
+		mem_copy(&queue->data[pos], &wrap, sizeof(wrap));
+		head += contiguous;
+		pos = 0;
+	}
+	mem_copy(&queue->data[pos], &len, sizeof(len));
+	mem_copy(&queue->data[pos+sizeof(len)], line, len);
+	__atomic_store_n(&queue->head, head+need, __ATOMIC_SEQ_CST);
+	if(__atomic_exchange_n(&log_sleeping, 0, __ATOMIC_SEQ_CST))
+		sem_post(&log_sem);
+}
+
+/* the formatted time only changes once per second */
+static const char *log_timestamp()
+{
+	static __thread time_t last_time = 0;
+	static __thread char timestr[80];
+	time_t now = time(0);
+	if(now != last_time || !timestr[0])
+	{
+		struct tm time_info;
+		localtime_r(&now, &time_info);
+		strftime(timestr, sizeof(timestr), FORMAT_SPACE, &time_info);
+		last_time = now;
+	}
+	return timestr;
+}
+
 void dbg_msg(const char *sys, const char *fmt, ...)
 {
 	va_list args;
-	char str[1024*4];
+	char str[LOG_MAX_LINE];
 	char *msg;
-	int i, len;
+	int len;
+	LOG_QUEUE *queue;
 
-	char timestr[80];
-	str_timestamp_format(timestr, sizeof(timestr), FORMAT_SPACE);
-
-	str_format(str, sizeof(str), "[%s][%s]: ", timestr, sys);
+	str_format(str, sizeof(str), "[%s][%s]: ", log_timestamp(), sys);
 
 	len = str_length(str);
 	msg = (char *)str + len;
@@ -326,7 +555,33 @@ void dbg_msg(const char *sys, const char *fmt, ...)
 #endif
 	va_end(args);
 
-    puts(str);
+	pthread_once(&log_once, log_init);
+	queue = log_async ? log_get_queue() : 0;
+	if(queue)
+		log_push(queue, str, str_length(str));
+	else
+		puts(str);
+}
+
+/* writes everything that was logged so far */
+void dbg_msg_flush()
+{
+	if(log_async)
+		log_drain();
+	else
+		fflush(stdout);
+}
+
+int64_t time_get()
+{
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return (int64_t)spec.tv_sec*(int64_t)1000000+(int64_t)spec.tv_nsec/1000;
+}
+
+int64_t time_freq()
+{
+	return 1000000;
 }
 
 static void netaddr_to_sockaddr_in(const NETADDR *src, struct sockaddr_in *dest)
@@ -601,7 +856,7 @@ int net_addr_from_str(NETADDR *addr, const char *string)
 	return 0;
 }
 
-static int priv_net_create_socket(int domain, int type, struct sockaddr *addr, int sockaddrlen, int use_random_port)
+static int priv_net_create_socket(int domain, int type, struct sockaddr *addr, int sockaddrlen, int use_random_port, int reuse_port)
 {
 	int sock, e;
 
@@ -632,6 +887,14 @@ static int priv_net_create_socket(int domain, int type, struct sockaddr *addr, i
 	}
 #endif
 
+	/* share the port with the other sockets of the group */
+	if(reuse_port)
+	{
+		int reuse = 1;
+		if(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0)
+			dbg_msg("net", "could not set SO_REUSEPORT (%d '%s')", errno, strerror(errno));
+	}
+
 	/* bind the socket */
 	while(1)
 	{
@@ -674,7 +937,7 @@ static int priv_net_create_socket(int domain, int type, struct sockaddr *addr, i
 	return sock;
 }
 
-NETSOCKET net_udp_create(NETADDR bindaddr, int use_random_port)
+NETSOCKET net_udp_create(NETADDR bindaddr, int use_random_port, int reuse_port)
 {
 	NETSOCKET sock = invalid_socket;
 	NETADDR tmpbindaddr = bindaddr;
@@ -689,7 +952,7 @@ NETSOCKET net_udp_create(NETADDR bindaddr, int use_random_port)
 		/* bind, we should check for error */
 		tmpbindaddr.type = NETTYPE_IPV4;
 		netaddr_to_sockaddr_in(&tmpbindaddr, &addr);
-		socket = priv_net_create_socket(AF_INET, SOCK_DGRAM, (struct sockaddr *)&addr, sizeof(addr), use_random_port);
+		socket = priv_net_create_socket(AF_INET, SOCK_DGRAM, (struct sockaddr *)&addr, sizeof(addr), use_random_port, reuse_port);
 		if(socket >= 0)
 		{
 			sock.type |= NETTYPE_IPV4;
@@ -711,7 +974,7 @@ NETSOCKET net_udp_create(NETADDR bindaddr, int use_random_port)
 		/* bind, we should check for error */
 		tmpbindaddr.type = NETTYPE_IPV6;
 		netaddr_to_sockaddr_in6(&tmpbindaddr, &addr);
-		socket = priv_net_create_socket(AF_INET6, SOCK_DGRAM, (struct sockaddr *)&addr, sizeof(addr), use_random_port);
+		socket = priv_net_create_socket(AF_INET6, SOCK_DGRAM, (struct sockaddr *)&addr, sizeof(addr), use_random_port, reuse_port);
 		if(socket >= 0)
 		{
 			sock.type |= NETTYPE_IPV6;
@@ -732,6 +995,242 @@ NETSOCKET net_udp_create(NETADDR bindaddr, int use_random_port)
 	return sock;
 }
 
+int net_udp_close(NETSOCKET sock)
+{
+	if(sock.ipv4sock >= 0)
+		priv_net_close_socket(sock.ipv4sock);
+	if(sock.ipv6sock >= 0)
+		priv_net_close_socket(sock.ipv6sock);
+	return 0;
+}
+
+#if !defined(SO_PREFER_BUSY_POLL)
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+/* lets the kernel poll the device queue for usecs when a receive finds
+   the socket empty, 0 turns it off. values above the net.core.busy_read
+   sysctl need CAP_NET_ADMIN */
+int net_udp_set_busy_poll(NETSOCKET sock, int usecs)
+{
+	int prefer = usecs > 0;
+	int socks[2] = {sock.ipv4sock, sock.ipv6sock};
+	int result = 0;
+	for(int i = 0; i < 2; i++)
+	{
+		if(socks[i] < 0)
+			continue;
+		if(setsockopt(socks[i], SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) != 0)
+		{
+			dbg_msg("net", "could not set SO_BUSY_POLL to %d (%d '%s')", usecs, errno, strerror(errno));
+			result = -1;
+		}
+		/* older kernels only have SO_BUSY_POLL */
+		setsockopt(socks[i], SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+	}
+	return result;
+}
+
+/* the offloads the system supports for the socket, NETSOCKET_* */
+int net_udp_features(NETSOCKET sock)
+{
+	int socks[2] = {sock.ipv4sock, sock.ipv6sock};
+	int features = NETSOCKET_GSO|NETSOCKET_GRO;
+	int found = 0;
+	for(int i = 0; i < 2; i++)
+	{
+		int value;
+		socklen_t size = sizeof(value);
+		if(socks[i] < 0)
+			continue;
+		found = 1;
+		if(getsockopt(socks[i], SOL_UDP, UDP_SEGMENT, &value, &size) != 0)
+			features &= ~NETSOCKET_GSO;
+		size = sizeof(value);
+		if(getsockopt(socks[i], SOL_UDP, UDP_GRO, &value, &size) != 0)
+			features &= ~NETSOCKET_GRO;
+	}
+	return found ? features : 0;
+}
+
+/* coalesced receiving, the buffers have to hold NET_GRO_BUFFER_SIZE bytes
+   then. see net_udp_recv_batch_gro */
+int net_udp_set_gro(NETSOCKET sock, int enable)
+{
+	int socks[2] = {sock.ipv4sock, sock.ipv6sock};
+	for(int i = 0; i < 2; i++)
+	{
+		if(socks[i] >= 0 && setsockopt(socks[i], SOL_UDP, UDP_GRO, &enable, sizeof(enable)) != 0)
+		{
+			dbg_msg("net", "could not set UDP_GRO to %d (%d '%s')", enable, errno, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* the flow hash of a peer, the same as the one the programs of
+   net_udp_steer_reuseport compute from a received datagram */
+unsigned net_addr_hash(const NETADDR *addr)
+{
+	unsigned hash = 0;
+	int words = addr->type == NETTYPE_IPV4 ? 1 : 4;
+	for(int i = 0; i < words; i++)
+		hash ^= (addr->ip[i*4]<<24) | (addr->ip[i*4+1]<<16) | (addr->ip[i*4+2]<<8) | addr->ip[i*4+3];
+	hash ^= addr->port;
+	hash *= 0x9e3779b1u;
+	return hash>>16;
+}
+
+/* the datagrams of a peer go to the socket net_addr_hash(addr)%num of
+   the SO_REUSEPORT group, in the order the sockets were bound. sock can
+   be any socket of the group */
+int net_udp_steer_reuseport(NETSOCKET sock, int num)
+{
+	/* classic bpf, the packet starts at the udp payload then. the ip
+	   header is read relative to SKF_NET_OFF, ipv6 extension headers
+	   aren't followed */
+	struct sock_filter prog4[] = {
+		BPF_STMT(BPF_LDX|BPF_B|BPF_MSH, (unsigned)SKF_NET_OFF), /* x = ip header length */
+		BPF_STMT(BPF_LD|BPF_H|BPF_IND, (unsigned)SKF_NET_OFF), /* source port */
+		BPF_STMT(BPF_MISC|BPF_TAX, 0),
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, (unsigned)SKF_NET_OFF+12), /* source address */
+		BPF_STMT(BPF_ALU|BPF_XOR|BPF_X, 0),
+		BPF_STMT(BPF_ALU|BPF_MUL|BPF_K, 0x9e3779b1u),
+		BPF_STMT(BPF_ALU|BPF_RSH|BPF_K, 16),
+		BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, (unsigned)num),
+		BPF_STMT(BPF_RET|BPF_A, 0),
+	};
+	struct sock_filter prog6[] = {
+		BPF_STMT(BPF_LD|BPF_H|BPF_ABS, (unsigned)SKF_NET_OFF+40), /* source port */
+		BPF_STMT(BPF_MISC|BPF_TAX, 0),
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, (unsigned)SKF_NET_OFF+8), /* source address */
+		BPF_STMT(BPF_ALU|BPF_XOR|BPF_X, 0),
+		BPF_STMT(BPF_MISC|BPF_TAX, 0),
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, (unsigned)SKF_NET_OFF+12),
+		BPF_STMT(BPF_ALU|BPF_XOR|BPF_X, 0),
+		BPF_STMT(BPF_MISC|BPF_TAX, 0),
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, (unsigned)SKF_NET_OFF+16),
+		BPF_STMT(BPF_ALU|BPF_XOR|BPF_X, 0),
+		BPF_STMT(BPF_MISC|BPF_TAX, 0),
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, (unsigned)SKF_NET_OFF+20),
+		BPF_STMT(BPF_ALU|BPF_XOR|BPF_X, 0),
+		BPF_STMT(BPF_ALU|BPF_MUL|BPF_K, 0x9e3779b1u),
+		BPF_STMT(BPF_ALU|BPF_RSH|BPF_K, 16),
+		BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, (unsigned)num),
+		BPF_STMT(BPF_RET|BPF_A, 0),
+	};
+	struct sock_fprog progs[2] = {
+		{sizeof(prog4)/sizeof(prog4[0]), prog4},
+		{sizeof(prog6)/sizeof(prog6[0]), prog6},
+	};
+	int socks[2] = {sock.ipv4sock, sock.ipv6sock};
+	if(num <= 0)
+		return -1;
+	for(int i = 0; i < 2; i++)
+	{
+		if(socks[i] >= 0 && setsockopt(socks[i], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &progs[i], sizeof(progs[i])) != 0)
+		{
+			dbg_msg("net", "could not attach the reuseport program (%d '%s')", errno, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+typedef struct
+{
+	void (*threadfunc)(void *);
+	void *user;
+} THREAD_RUN;
+
+/* pthread wants a function returning a pointer */
+static void *thread_run(void *user)
+{
+	THREAD_RUN run = *(THREAD_RUN *)user;
+	mem_free(user);
+	run.threadfunc(run.user);
+	return 0;
+}
+
+/* runs threadfunc(user) on a new thread, 0 on error */
+void *thread_init(void (*threadfunc)(void *), void *user)
+{
+	THREAD_RUN *run = (THREAD_RUN *)mem_alloc(sizeof(*run));
+	if(!run)
+		return 0;
+	run->threadfunc = threadfunc;
+	run->user = user;
+
+	pthread_t id;
+	int result = pthread_create(&id, 0, thread_run, run);
+	if(result != 0)
+	{
+		dbg_msg("thread", "could not create a thread (%d '%s')", result, strerror(result));
+		mem_free(run);
+		return 0;
+	}
+	return (void *)id;
+}
+
+/* waits until the thread of thread_init returned */
+void thread_wait(void *thread)
+{
+	pthread_join((pthread_t)thread, 0);
+}
+
+/* pins the calling thread to one cpu, -1 allows all of them again */
+int thread_pin_cpu(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if(cpu < 0)
+	{
+		for(int i = 0; i < CPU_SETSIZE; i++)
+			CPU_SET(i, &set);
+	}
+	else
+		CPU_SET(cpu, &set);
+	int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if(result != 0)
+	{
+		dbg_msg("thread", "could not pin the thread to cpu %d (%d '%s')", cpu, result, strerror(result));
+		return -1;
+	}
+	return 0;
+}
+
+/* runs the calling thread under SCHED_FIFO with the priority, 0 goes back
+   to the normal scheduler. needs CAP_SYS_NICE or an rtprio limit */
+int thread_set_realtime(int priority)
+{
+	struct sched_param param;
+	mem_zero(&param, sizeof(param));
+	param.sched_priority = priority;
+	int result = pthread_setschedparam(pthread_self(), priority > 0 ? SCHED_FIFO : SCHED_OTHER, &param);
+	if(result != 0)
+	{
+		dbg_msg("thread", "could not set the realtime priority %d (%d '%s')", priority, result, strerror(result));
+		return -1;
+	}
+	return 0;
+}
+
+int secure_random_fill(void *bytes, unsigned length)
+{
+	FILE *urandom = fopen("/dev/urandom", "rb");
+	if(!urandom)
+		return 1;
+	int result = fread(bytes, 1, length, urandom) != length;
+	fclose(urandom);
+	return result;
+}
+
+int net_addr_comp(const NETADDR *a, const NETADDR *b)
+{
+	return mem_comp(a, b, sizeof(NETADDR));
+}
+
 void net_addr_str(const NETADDR *addr, char *string, int max_length, int add_port)
 {
 	if(addr->type == NETTYPE_IPV4)
@@ -0,0 +1,205 @@
+/* (c) Magnus Auvinen. See licence.txt in the root of the distribution for more information. */
+/* If you are missing that file, acquire a complete release at teeworlds.com.                */
+
+/*
+	Hierarchical timer wheel.
+
+	Time is split into ticks of TICK_MS milliseconds. Level 0 holds the
+	timers of the next 64 ticks, every further level covers 64 times the
+	range of the one below. Timers are linked into the slot of their
+	expiry, so inserting and cancelling only touch the list. When the wheel
+	advances, a level 0 slot is expired in one go and higher slots are
+	moved down once the lower level wrapped around.
+*/
+
+class CTimer
+{
+	friend class CTimerWheel;
+
+	CTimer *m_pNext;
+	CTimer **m_ppPrev; // 0 if the timer isn't pending
+	int64_t m_Expiry; // in ticks
+
+public:
+	typedef void (*FCallback)(CTimer *pTimer, void *pUser);
+
+	FCallback m_pfnCallback;
+	void *m_pUser;
+
+	CTimer()
+	{
+		m_pNext = 0;
+		m_ppPrev = 0;
+		m_Expiry = 0;
+		m_pfnCallback = 0;
+		m_pUser = 0;
+	}
+
+	void Init(FCallback pfnCallback, void *pUser)
+	{
+		m_pfnCallback = pfnCallback;
+		m_pUser = pUser;
+	}
+
+	bool Pending() const { return m_ppPrev != 0; }
+};
+
+class CTimerWheel
+{
+	enum
+	{
+		TICK_MS=1,
+		LEVEL_BITS=6,
+		NUM_SLOTS=1<<LEVEL_BITS,
+		SLOT_MASK=NUM_SLOTS-1,
+		NUM_LEVELS=4,
+	};
+
+	CTimer *m_aapSlots[NUM_LEVELS][NUM_SLOTS];
+	int64_t m_Tick; // last tick that was expired
+	int64_t m_Time; // cached time_get()
+
+	int64_t TimeToTick(int64_t Time) const { return Time*1000/(time_freq()*TICK_MS); }
+
+	// Current is set while cascading, timers of the current tick stay in it
+	void Link(CTimer *pTimer, bool Current)
+	{
+		int64_t Delta = pTimer->m_Expiry - m_Tick;
+		if(Delta < 0 || (Delta == 0 && !Current))
+		{
+			pTimer->m_Expiry = m_Tick+1;
+			Delta = 1;
+		}
+		else if(Delta >= (int64_t)1<<(LEVEL_BITS*NUM_LEVELS))
+		{
+			// too far away, fire at the end of the range
+			pTimer->m_Expiry = m_Tick + ((int64_t)1<<(LEVEL_BITS*NUM_LEVELS)) - 1;
+			Delta = pTimer->m_Expiry - m_Tick;
+		}
+
+		int Level = 0;
+		while(Delta >= (int64_t)1<<(LEVEL_BITS*(Level+1)))
+			Level++;
+
+		CTimer **ppSlot = &m_aapSlots[Level][(pTimer->m_Expiry>>(LEVEL_BITS*Level))&SLOT_MASK];
+		pTimer->m_pNext = *ppSlot;
+		if(*ppSlot)
+			(*ppSlot)->m_ppPrev = &pTimer->m_pNext;
+		pTimer->m_ppPrev = ppSlot;
+		*ppSlot = pTimer;
+	}
+
+	// moves the timers of a higher level slot down
+	void Cascade(int Level)
+	{
+		int Index = (m_Tick>>(LEVEL_BITS*Level))&SLOT_MASK;
+		CTimer *pTimer = m_aapSlots[Level][Index];
+		m_aapSlots[Level][Index] = 0;
+		while(pTimer)
+		{
+			CTimer *pNext = pTimer->m_pNext;
+			Link(pTimer, true);
+			pTimer = pNext;
+		}
+	}
+
+public:
+	CTimerWheel() { Reset(time_get()); }
+
+	void Reset(int64_t Now)
+	{
+		mem_zero(m_aapSlots, sizeof(m_aapSlots));
+		m_Time = Now;
+		m_Tick = TimeToTick(Now);
+	}
+
+	// the cached clock, only changes in RefreshTime and Advance
+	int64_t Now() const { return m_Time; }
+	void RefreshTime() { m_Time = time_get(); }
+
+	// schedules the timer at Time, reschedules it if it's already pending
+	void Insert(CTimer *pTimer, int64_t Time)
+	{
+		Cancel(pTimer);
+		pTimer->m_Expiry = TimeToTick(Time);
+		// round up, a timer never fires before its time
+		if(pTimer->m_Expiry*time_freq()*TICK_MS/1000 < Time)
+			pTimer->m_Expiry++;
+		Link(pTimer, false);
+	}
+
+	void Cancel(CTimer *pTimer)
+	{
+		if(!pTimer->m_ppPrev)
+			return;
+		*pTimer->m_ppPrev = pTimer->m_pNext;
+		if(pTimer->m_pNext)
+			pTimer->m_pNext->m_ppPrev = pTimer->m_ppPrev;
+		pTimer->m_pNext = 0;
+		pTimer->m_ppPrev = 0;
+	}
+
+	// time at which Advance has something to do next, -1 if nothing is
+	// pending. for a timer of a higher level that's when it's cascaded,
+	// which can be before it expires
+	int64_t NextExpiry() const
+	{
+		int64_t Next = -1;
+		for(int Level = 0; Level < NUM_LEVELS; Level++)
+		{
+			int64_t Current = m_Tick>>(LEVEL_BITS*Level);
+			for(int i = 1; i <= NUM_SLOTS; i++)
+			{
+				if(!m_aapSlots[Level][(Current+i)&SLOT_MASK])
+					continue;
+				int64_t Tick = (Current+i)<<(LEVEL_BITS*Level);
+				if(Next < 0 || Tick < Next)
+					Next = Tick;
+				break;
+			}
+			// higher levels only hold later timers
+			if(Next >= 0 && Next <= ((Current+1)<<(LEVEL_BITS*Level)))
+				break;
+		}
+		return Next < 0 ? -1 : Next*time_freq()*TICK_MS/1000;
+	}
+
+	// fires all timers that expired until Now, returns how many fired
+	int Advance(int64_t Now)
+	{
+		m_Time = Now;
+		int64_t Target = TimeToTick(Now);
+		int NumFired = 0;
+		while(m_Tick < Target)
+		{
+			m_Tick++;
+
+			// bring the timers of the next range down
+			for(int Level = 1; Level < NUM_LEVELS; Level++)
+			{
+				if((m_Tick>>(LEVEL_BITS*(Level-1)))&SLOT_MASK)
+					break;
+				Cascade(Level);
+			}
+
+			// take the whole slot first, callbacks may insert timers again
+			CTimer **ppSlot = &m_aapSlots[0][m_Tick&SLOT_MASK];
+			CTimer *pTimer = *ppSlot;
+			*ppSlot = 0;
+			if(pTimer)
+				pTimer->m_ppPrev = &pTimer;
+			while(pTimer)
+			{
+				CTimer *pFired = pTimer;
+				pTimer = pTimer->m_pNext;
+				if(pTimer)
+					pTimer->m_ppPrev = &pTimer;
+				pFired->m_pNext = 0;
+				pFired->m_ppPrev = 0;
+				pFired->m_pfnCallback(pFired, pFired->m_pUser);
+				NumFired++;
+			}
+		}
+		return NumFired;
+	}
+};
@@ -0,0 +1,438 @@
+/* (c) Magnus Auvinen. See licence.txt in the root of the distribution for more information. */
+/* If you are missing that file, acquire a complete release at teeworlds.com.                */
+
+/*
+	io_uring backend for the batched socket calls.
+
+	Every socket has one multishot recvmsg running. The kernel takes a
+	buffer out of a provided buffer ring for each datagram and posts a
+	completion. Receiving only reads the completion queue, with no system
+	call, and hands out pointers into the buffers. They go back to the
+	ring on the next Recv.
+
+	Sending queues one sendmsg per datagram. The batch goes out with one
+	io_uring_enter, and with SQPOLL a kernel thread picks it up by itself.
+	Send returns once the kernel is done with the data, the callers reuse
+	their buffers right away.
+
+	Talks to the kernel with the raw system calls, there is no liburing.
+*/
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+class CNetUring
+{
+	enum
+	{
+		NUM_ENTRIES=128,
+		NUM_COMPLETIONS=512,
+		NUM_BUFFERS=128, // power of two
+		BUFFER_SIZE=2048,
+		BUFFER_GROUP=0,
+		SQPOLL_IDLE_MS=50,
+
+		// user_data of the requests, receives add the socket index
+		REQ_SEND=0,
+		REQ_RECV=1,
+	};
+
+	int m_Fd;
+	bool m_Sqpoll;
+	int m_aSocks[2]; // ipv4, ipv6
+
+	void *m_pRingMem;
+	size_t m_RingMemSize;
+	struct io_uring_sqe *m_pSqes;
+	size_t m_SqesSize;
+
+	unsigned *m_pSqHead;
+	unsigned *m_pSqTail;
+	unsigned *m_pSqFlags;
+	unsigned *m_pSqArray;
+	unsigned m_SqMask;
+	unsigned m_SqTail; // ours, the kernel sees it after Submit
+	unsigned m_NumToSubmit;
+
+	unsigned *m_pCqHead;
+	unsigned *m_pCqTail;
+	struct io_uring_cqe *m_pCqes;
+	unsigned m_CqMask;
+
+	struct io_uring_buf_ring *m_pBufRing;
+	unsigned char *m_pBuffers;
+	unsigned short m_BufTail;
+
+	// received datagrams that weren't handed out yet
+	unsigned short m_aReadyBuffers[NUM_BUFFERS];
+	int m_ReadyStart;
+	int m_NumReady;
+	// handed out by the last Recv
+	unsigned short m_aLentBuffers[NET_BATCH_MAX];
+	int m_NumLent;
+
+	struct msghdr m_aRecvMsgs[2];
+	bool m_aRecvArmed[2];
+
+	struct msghdr m_aSendMsgs[NET_BATCH_MAX];
+	struct iovec m_aSendIovecs[NET_BATCH_MAX];
+	struct sockaddr_in6 m_aSendAddrs[NET_BATCH_MAX];
+	int m_NumSendsPending;
+
+	static int Enter(int Fd, unsigned ToSubmit, unsigned MinComplete, unsigned Flags)
+	{
+		return (int)syscall(__NR_io_uring_enter, Fd, ToSubmit, MinComplete, Flags, (void *)0, 0);
+	}
+
+	struct io_uring_sqe *GetSqe()
+	{
+		if(m_SqTail - __atomic_load_n(m_pSqHead, __ATOMIC_ACQUIRE) == m_SqMask+1)
+			Submit();
+		struct io_uring_sqe *pSqe = &m_pSqes[m_SqTail&m_SqMask];
+		m_pSqArray[m_SqTail&m_SqMask] = m_SqTail&m_SqMask;
+		m_SqTail++;
+		m_NumToSubmit++;
+		mem_zero(pSqe, sizeof(*pSqe));
+		return pSqe;
+	}
+
+	void Submit()
+	{
+		__atomic_store_n(m_pSqTail, m_SqTail, __ATOMIC_RELEASE);
+		if(m_Sqpoll)
+		{
+			// the poll thread goes to sleep when it had nothing to do for a while
+			if(__atomic_load_n(m_pSqFlags, __ATOMIC_ACQUIRE)&IORING_SQ_NEED_WAKEUP)
+				Enter(m_Fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+		}
+		else if(m_NumToSubmit)
+		{
+			if(Enter(m_Fd, m_NumToSubmit, 0, 0) < 0)
+				dbg_msg("uring", "submit failed (%d '%s')", errno, strerror(errno));
+		}
+		m_NumToSubmit = 0;
+	}
+
+	void AddBuffer(unsigned short Buffer)
+	{
+		// not m_pBufRing->bufs, the flex array sits behind a dummy member in c++
+		struct io_uring_buf *pBuf = &((struct io_uring_buf *)m_pBufRing)[m_BufTail&(NUM_BUFFERS-1)];
+		pBuf->addr = (unsigned long)&m_pBuffers[Buffer*BUFFER_SIZE];
+		pBuf->len = BUFFER_SIZE;
+		pBuf->bid = Buffer;
+		m_BufTail++;
+	}
+
+	void PublishBuffers() { __atomic_store_n(&m_pBufRing->tail, m_BufTail, __ATOMIC_RELEASE); }
+
+	void ArmRecv(int Index)
+	{
+		struct io_uring_sqe *pSqe = GetSqe();
+		pSqe->opcode = IORING_OP_RECVMSG;
+		pSqe->fd = m_aSocks[Index];
+		pSqe->addr = (unsigned long)&m_aRecvMsgs[Index];
+		pSqe->len = 1;
+		pSqe->ioprio = IORING_RECV_MULTISHOT;
+		pSqe->flags = IOSQE_BUFFER_SELECT;
+		pSqe->buf_group = BUFFER_GROUP;
+		pSqe->user_data = REQ_RECV+Index;
+		m_aRecvArmed[Index] = true;
+	}
+
+	void Reap()
+	{
+		unsigned Head = *m_pCqHead;
+		unsigned Tail = __atomic_load_n(m_pCqTail, __ATOMIC_ACQUIRE);
+		for(; Head != Tail; Head++)
+		{
+			const struct io_uring_cqe *pCqe = &m_pCqes[Head&m_CqMask];
+			if(pCqe->user_data == REQ_SEND)
+			{
+				m_NumSendsPending--;
+				if(pCqe->res < 0)
+					dbg_msg("uring", "sendmsg error (%d '%s')", -pCqe->res, strerror(-pCqe->res));
+				continue;
+			}
+
+			int Index = (int)pCqe->user_data - REQ_RECV;
+			if(pCqe->flags&IORING_CQE_F_BUFFER)
+			{
+				unsigned short Buffer = pCqe->flags>>IORING_CQE_BUFFER_SHIFT;
+				if(pCqe->res >= 0 && m_NumReady < NUM_BUFFERS)
+					m_aReadyBuffers[(m_ReadyStart+m_NumReady++)&(NUM_BUFFERS-1)] = Buffer;
+				else
+					AddBuffer(Buffer);
+			}
+			// out of buffers ends the multishot, it's armed again on the next Recv
+			else if(pCqe->res < 0 && pCqe->res != -ENOBUFS)
+				dbg_msg("uring", "recvmsg error (%d '%s')", -pCqe->res, strerror(-pCqe->res));
+			if(!(pCqe->flags&IORING_CQE_F_MORE))
+				m_aRecvArmed[Index] = false;
+		}
+		__atomic_store_n(m_pCqHead, Head, __ATOMIC_RELEASE);
+	}
+
+public:
+	CNetUring()
+	{
+		m_Fd = -1;
+		m_pRingMem = 0;
+		m_pSqes = 0;
+		m_pBufRing = 0;
+		m_pBuffers = 0;
+	}
+	~CNetUring() { Close(); }
+
+	bool Active() const { return m_Fd >= 0; }
+	// readable when completions are waiting
+	int Fd() const { return m_Fd; }
+
+	// -1 if io_uring isn't available, the sockets have to be used then
+	int Open(NETSOCKET Sock, bool Sqpoll)
+	{
+		Close();
+
+		struct io_uring_params Params;
+		mem_zero(&Params, sizeof(Params));
+		Params.flags = IORING_SETUP_CQSIZE;
+		Params.cq_entries = NUM_COMPLETIONS;
+		if(Sqpoll)
+		{
+			Params.flags |= IORING_SETUP_SQPOLL;
+			Params.sq_thread_idle = SQPOLL_IDLE_MS;
+		}
+		m_Fd = (int)syscall(__NR_io_uring_setup, NUM_ENTRIES, &Params);
+		if(m_Fd < 0)
+		{
+			dbg_msg("uring", "io_uring_setup failed (%d '%s')", errno, strerror(errno));
+			return -1;
+		}
+		m_Sqpoll = Sqpoll;
+		if(!(Params.features&IORING_FEAT_SINGLE_MMAP))
+		{
+			dbg_msg("uring", "the kernel is too old");
+			Close();
+			return -1;
+		}
+
+		size_t SqSize = Params.sq_off.array + Params.sq_entries*sizeof(unsigned);
+		size_t CqSize = Params.cq_off.cqes + Params.cq_entries*sizeof(struct io_uring_cqe);
+		m_RingMemSize = SqSize > CqSize ? SqSize : CqSize;
+		m_pRingMem = mmap(0, m_RingMemSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_Fd, IORING_OFF_SQ_RING);
+		m_SqesSize = Params.sq_entries*sizeof(struct io_uring_sqe);
+		m_pSqes = (struct io_uring_sqe *)mmap(0, m_SqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_Fd, IORING_OFF_SQES);
+		if(m_pRingMem == MAP_FAILED || m_pSqes == MAP_FAILED)
+		{
+			if(m_pRingMem == MAP_FAILED)
+				m_pRingMem = 0;
+			if(m_pSqes == MAP_FAILED)
+				m_pSqes = 0;
+			dbg_msg("uring", "could not map the rings (%d '%s')", errno, strerror(errno));
+			Close();
+			return -1;
+		}
+
+		unsigned char *pRing = (unsigned char *)m_pRingMem;
+		m_pSqHead = (unsigned *)(pRing + Params.sq_off.head);
+		m_pSqTail = (unsigned *)(pRing + Params.sq_off.tail);
+		m_pSqFlags = (unsigned *)(pRing + Params.sq_off.flags);
+		m_pSqArray = (unsigned *)(pRing + Params.sq_off.array);
+		m_SqMask = *(unsigned *)(pRing + Params.sq_off.ring_mask);
+		m_SqTail = *m_pSqTail;
+		m_NumToSubmit = 0;
+		m_pCqHead = (unsigned *)(pRing + Params.cq_off.head);
+		m_pCqTail = (unsigned *)(pRing + Params.cq_off.tail);
+		m_pCqes = (struct io_uring_cqe *)(pRing + Params.cq_off.cqes);
+		m_CqMask = *(unsigned *)(pRing + Params.cq_off.ring_mask);
+
+		// the buffer ring has to be page aligned, mmap takes care of that
+		m_pBufRing = (struct io_uring_buf_ring *)mmap(0, NUM_BUFFERS*sizeof(struct io_uring_buf), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if(m_pBufRing == MAP_FAILED)
+		{
+			m_pBufRing = 0;
+			Close();
+			return -1;
+		}
+		struct io_uring_buf_reg Reg;
+		mem_zero(&Reg, sizeof(Reg));
+		Reg.ring_addr = (unsigned long)m_pBufRing;
+		Reg.ring_entries = NUM_BUFFERS;
+		Reg.bgid = BUFFER_GROUP;
+		if(syscall(__NR_io_uring_register, m_Fd, IORING_REGISTER_PBUF_RING, &Reg, 1) != 0)
+		{
+			dbg_msg("uring", "could not register the buffer ring (%d '%s')", errno, strerror(errno));
+			Close();
+			return -1;
+		}
+		m_pBuffers = (unsigned char *)mem_alloc(NUM_BUFFERS*BUFFER_SIZE);
+		m_BufTail = 0;
+		for(int i = 0; i < NUM_BUFFERS; i++)
+			AddBuffer(i);
+		PublishBuffers();
+		m_ReadyStart = 0;
+		m_NumReady = 0;
+		m_NumLent = 0;
+		m_NumSendsPending = 0;
+
+		m_aSocks[0] = Sock.ipv4sock;
+		m_aSocks[1] = Sock.ipv6sock;
+		for(int i = 0; i < 2; i++)
+		{
+			// the kernel puts the header, the address and the payload into the buffer
+			mem_zero(&m_aRecvMsgs[i], sizeof(m_aRecvMsgs[i]));
+			m_aRecvMsgs[i].msg_namelen = sizeof(struct sockaddr_in6);
+			m_aRecvArmed[i] = false;
+			if(m_aSocks[i] >= 0)
+				ArmRecv(i);
+		}
+		Submit();
+		return 0;
+	}
+
+	void Close()
+	{
+		// closing the ring cancels the receives
+		if(m_Fd >= 0)
+			close(m_Fd);
+		m_Fd = -1;
+		if(m_pRingMem)
+			munmap(m_pRingMem, m_RingMemSize);
+		if(m_pSqes)
+			munmap(m_pSqes, m_SqesSize);
+		if(m_pBufRing)
+			munmap(m_pBufRing, NUM_BUFFERS*sizeof(struct io_uring_buf));
+		mem_free(m_pBuffers);
+		m_pRingMem = 0;
+		m_pSqes = 0;
+		m_pBufRing = 0;
+		m_pBuffers = 0;
+	}
+
+	// something for Recv without asking the kernel
+	bool Pending() const
+	{
+		return m_NumReady || *m_pCqHead != __atomic_load_n(m_pCqTail, __ATOMIC_ACQUIRE);
+	}
+
+	/*
+		Function: Recv
+			Like net_udp_recv_batch, but the data of the packets is set to
+			the ring buffers. They stay valid until the next call.
+	*/
+	int Recv(NETPACKET *pPackets, int Num)
+	{
+		for(int i = 0; i < m_NumLent; i++)
+			AddBuffer(m_aLentBuffers[i]);
+		m_NumLent = 0;
+		PublishBuffers();
+
+		Reap();
+		bool Arm = false;
+		for(int i = 0; i < 2; i++)
+		{
+			if(!m_aRecvArmed[i] && m_aSocks[i] >= 0)
+			{
+				ArmRecv(i);
+				Arm = true;
+			}
+		}
+		if(Arm)
+		{
+			Submit();
+			Reap();
+		}
+
+		if(Num > NET_BATCH_MAX)
+			Num = NET_BATCH_MAX;
+		int Received = 0;
+		while(Received < Num && m_NumReady)
+		{
+			unsigned short Buffer = m_aReadyBuffers[m_ReadyStart];
+			m_ReadyStart = (m_ReadyStart+1)&(NUM_BUFFERS-1);
+			m_NumReady--;
+
+			unsigned char *pBuffer = &m_pBuffers[Buffer*BUFFER_SIZE];
+			const struct io_uring_recvmsg_out *pOut = (const struct io_uring_recvmsg_out *)pBuffer;
+			if(pOut->flags&MSG_TRUNC || !pOut->namelen)
+			{
+				AddBuffer(Buffer);
+				continue;
+			}
+			NETPACKET *pPacket = &pPackets[Received++];
+			sockaddr_to_netaddr((struct sockaddr *)(pOut+1), &pPacket->addr);
+			pPacket->data = pBuffer + sizeof(*pOut) + sizeof(struct sockaddr_in6);
+			pPacket->size = pOut->payloadlen;
+			m_aLentBuffers[m_NumLent++] = Buffer;
+		}
+		// the dropped ones
+		PublishBuffers();
+		return Received;
+	}
+
+	/*
+		Function: Send
+			Like net_udp_send_batch, returns once the kernel copied the data.
+	*/
+	int Send(const NETPACKET *pPackets, int Num)
+	{
+		if(Num > NET_BATCH_MAX)
+			Num = NET_BATCH_MAX;
+		int Queued = 0;
+		for(int i = 0; i < Num; i++)
+		{
+			const NETADDR *pAddr = &pPackets[i].addr;
+			struct msghdr *pMsg = &m_aSendMsgs[Queued];
+			mem_zero(pMsg, sizeof(*pMsg));
+			int Sock;
+			if(pAddr->type&NETTYPE_IPV4 && m_aSocks[0] >= 0)
+			{
+				Sock = m_aSocks[0];
+				netaddr_to_sockaddr_in(pAddr, (struct sockaddr_in *)&m_aSendAddrs[Queued]);
+				pMsg->msg_namelen = sizeof(struct sockaddr_in);
+			}
+			else if(pAddr->type&NETTYPE_IPV6 && m_aSocks[1] >= 0)
+			{
+				Sock = m_aSocks[1];
+				netaddr_to_sockaddr_in6(pAddr, &m_aSendAddrs[Queued]);
+				pMsg->msg_namelen = sizeof(struct sockaddr_in6);
+			}
+			else
+			{
+				dbg_msg("uring", "can't send to network of type %d", pAddr->type);
+				continue;
+			}
+			m_aSendIovecs[Queued].iov_base = pPackets[i].data;
+			m_aSendIovecs[Queued].iov_len = pPackets[i].size;
+			pMsg->msg_name = &m_aSendAddrs[Queued];
+			pMsg->msg_iov = &m_aSendIovecs[Queued];
+			pMsg->msg_iovlen = 1;
+
+			struct io_uring_sqe *pSqe = GetSqe();
+			pSqe->opcode = IORING_OP_SENDMSG;
+			pSqe->fd = Sock;
+			pSqe->addr = (unsigned long)pMsg;
+			pSqe->len = 1;
+			pSqe->user_data = REQ_SEND;
+			Queued++;
+		}
+		if(!Queued)
+			return 0;
+
+		m_NumSendsPending += Queued;
+		Submit();
+		// udp sends usually complete right in the submit
+		Reap();
+		while(m_NumSendsPending > 0)
+		{
+			if(Enter(m_Fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+			{
+				dbg_msg("uring", "waiting for the sends failed (%d '%s')", errno, strerror(errno));
+				m_NumSendsPending = 0;
+				break;
+			}
+			Reap();
+		}
+		return Queued;
+	}
+};
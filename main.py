@@ -22,10 +22,26 @@ class CNetPacketConstruct(ctypes.Structure):
         ("chunk_data", ctypes.c_ubyte * 1391)
     ]
 
-addr_str = ctypes.create_string_buffer(b"127.0.0.1")
-lib.Connect(ctypes.pointer(addr_str), 8303)
+lib.Create.restype = ctypes.c_void_p
+lib.Connect.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int]
+lib.ConnectionState.argtypes = [ctypes.c_void_p, ctypes.c_int]
+lib.ConnectionError.argtypes = [ctypes.c_void_p, ctypes.c_int]
+lib.ConnectionError.restype = ctypes.c_char_p
+lib.PumpNetwork.argtypes = [ctypes.c_void_p]
+lib.WaitNetwork.argtypes = [ctypes.c_void_p, ctypes.c_int]
+lib.Destroy.argtypes = [ctypes.c_void_p]
+lib.SetLogLevel.argtypes = [ctypes.c_void_p, ctypes.c_int]
 
-lib.SendSample()
+client = lib.Create(1)
+# log every packet with its payload
+lib.SetLogLevel(client, 2)
+conn = lib.Connect(client, b"127.0.0.1", 8303)
 
+state = lib.ConnectionState(client, conn)
 while True:
-    lib.PumpNetwork()
+    # sleeps until a packet arrives or a connection timer is due
+    lib.WaitNetwork(client, 1000)
+    lib.PumpNetwork(client)
+    if lib.ConnectionState(client, conn) != state:
+        state = lib.ConnectionState(client, conn)
+        print("connection state %d %s" % (state, lib.ConnectionError(client, conn).decode()))
@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+
+# prints a trace written by DumpTrace, one line per datagram
+
+import socket
+import struct
+import sys
+
+CTRLMSGS = {0: "KEEPALIVE", 1: "CONNECT", 2: "ACCEPT", 4: "CLOSE", 5: "TOKEN"}
+FLAGS = [(1, "CONTROL"), (2, "RESEND"), (4, "COMPRESSION"), (8, "CONNLESS")]
+
+# see CNetTraceRecord
+RECORD = struct.Struct("=q16sHHBBBB16s")
+
+
+def format_addr(ip_type, ip, port):
+    if ip_type == 2:
+        return "[%s]:%d" % (socket.inet_ntop(socket.AF_INET6, ip), port)
+    return "%s:%d" % (socket.inet_ntop(socket.AF_INET, ip[:4]), port)
+
+
+def format_header(header):
+    if len(header) < 7:
+        return "short header"
+    flags = header[0] >> 2
+    names = "|".join(name for bit, name in FLAGS if flags & bit)
+    if flags & 8:
+        if len(header) < 9:
+            return "short connless header"
+        token, response_token = struct.unpack(">II", header[1:9])
+        return "flags=%s token=%08x response_token=%08x" % (names, token, response_token)
+    ack = ((header[0] & 3) << 8) | header[1]
+    token = struct.unpack(">I", header[3:7])[0]
+    line = "flags=%s ack=%d chunks=%d token=%08x" % (names or "0", ack, header[2], token)
+    if flags & 1 and not flags & 4 and len(header) > 7:
+        line += " ctrl=%s" % CTRLMSGS.get(header[7], header[7])
+    return line
+
+
+def main():
+    if len(sys.argv) != 2:
+        print("usage: %s <trace file>" % sys.argv[0])
+        sys.exit(1)
+    with open(sys.argv[1], "rb") as f:
+        data = f.read()
+    if data[:8] != b"TWTRACE1":
+        print("not a trace file")
+        sys.exit(1)
+    freq, record_size, num_records = struct.unpack("=qii", data[8:24])
+    if record_size != RECORD.size:
+        print("unexpected record size %d" % record_size)
+        sys.exit(1)
+
+    start = None
+    for i in range(num_records):
+        time, ip, port, size, direction, ip_type, header_size, _, header = RECORD.unpack_from(data, 24 + i * record_size)
+        if start is None:
+            start = time
+        print("%10.6f %s %-22s size=%-4d %s" % (
+            (time - start) / freq, "->" if direction == 1 else "<-",
+            format_addr(ip_type, ip, port), size, format_header(header[:header_size])))
+
+
+if __name__ == "__main__":
+    main()